@@ -1428,7 +1428,7 @@ struct animmodel : model
         if(bih) return bih;
         vector<BIH::mesh> meshes;
         genBIH(meshes);
-        bih = new BIH(meshes);
+        bih = new BIH(meshes, name);
         return bih;
     }
 
@@ -1,5 +1,10 @@
 #include "engine/engine.h"
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define BIHPACKET_SSE
+#include <xmmintrin.h>
+#endif
+
 extern vec hitsurface;
 
 bool BIH::triintersect(const mesh &m, int tidx, const vec &mo, const vec &mray, float maxdist, float &dist, int mode)
@@ -145,7 +150,176 @@ inline bool BIH::traverse(const vec &o, const vec &ray, float maxdist, float &di
     return false;
 }
 
-void BIH::build(mesh &m, ushort *indices, int numindices, const ivec &vmin, const ivec &vmax)
+// packets of up to four rays share the walk down the tree; mask selects the live rays and every
+// function returns the subset of it that has not hit anything yet. Only rays whose directions have
+// the same signs are walked together, so each visits the children in the same order as the scalar
+// traversal and stops at the same first hit
+#ifdef BIHPACKET_SSE
+struct bihpacket
+{
+    __m128 o[3], invray[3];
+    vec mo[4], mray[4];
+    const float *maxdist;
+    float *dist;
+    int order[3], mode;
+};
+
+static int traversepacket(BIH &bih, const BIH::mesh &m, const bihpacket &p, const BIH::node *curnode, __m128 tmin, __m128 tmax, int mask)
+{
+    int axis = curnode->axis(), nearidx = p.order[axis], faridx = nearidx^1;
+    __m128 nearsplit = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(curnode->split[nearidx]), p.o[axis]), p.invray[axis]),
+           farsplit = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(curnode->split[faridx]), p.o[axis]), p.invray[axis]);
+    // same bounds as the scalar walk: the near child ends at its split, the far child starts at its own
+    __m128 cmin[2] = { tmin, _mm_max_ps(tmin, farsplit) }, cmax[2] = { _mm_min_ps(tmax, nearsplit), tmax };
+    loopk(2)
+    {
+        int which = k ? faridx : nearidx, cmask = mask & _mm_movemask_ps(_mm_cmplt_ps(cmin[k], cmax[k]));
+        if(!cmask) continue;
+        if(curnode->isleaf(which))
+        {
+            int tidx = curnode->childindex(which);
+            loopi(4) if(cmask&(1<<i) && bih.triintersect(m, tidx, p.mo[i], p.mray[i], p.maxdist[i], p.dist[i], p.mode)) mask &= ~(1<<i);
+        }
+        else mask = (mask & ~cmask) | traversepacket(bih, m, p, curnode + curnode->childindex(which), cmin[k], cmax[k], cmask);
+        if(!mask) break;
+    }
+    return mask;
+}
+
+static inline int bihraysigns(const vec &ray)
+{
+    return (ray.x > 0 ? 0 : 1) | (ray.y > 0 ? 0 : 2) | (ray.z > 0 ? 0 : 4);
+}
+#endif
+
+int BIH::traverse(const vec *o, const vec *ray, const float *maxdist, float *dist, int mode, int mask)
+{
+#ifdef BIHPACKET_SSE
+    int hits = 0;
+    while(mask)
+    {
+        int first = 0;
+        while(!(mask&(1<<first))) first++;
+        int signs = bihraysigns(ray[first]), group = 0;
+        loopi(4) if(mask&(1<<i) && bihraysigns(ray[i]) == signs) group |= 1<<i;
+        mask &= ~group;
+
+        bihpacket p;
+        p.maxdist = maxdist;
+        p.dist = dist;
+        p.mode = mode;
+        float lanes[3][4], inv[3][4];
+        loopi(4)
+        {
+            int r = group&(1<<i) ? i : first;
+            loopj(3)
+            {
+                lanes[j][i] = o[r][j];
+                inv[j][i] = ray[r][j] ? 1/ray[r][j] : 1e16f;
+            }
+        }
+        loopj(3)
+        {
+            p.o[j] = _mm_loadu_ps(lanes[j]);
+            p.invray[j] = _mm_loadu_ps(inv[j]);
+            p.order[j] = (signs>>j)&1;
+        }
+        loopi(nummeshes)
+        {
+            mesh &m = meshes[i];
+            if(!(m.flags&MESH_RENDER) || (!(mode&RAY_SHADOW) && m.flags&MESH_NOCLIP)) continue;
+            int live = group & ~hits;
+            if(!live) break;
+            float bmaxdist[4];
+            loopj(4) bmaxdist[j] = group&(1<<j) ? maxdist[j] : 0;
+            __m128 tmin = _mm_set1_ps(-1e16f), tmax = _mm_loadu_ps(bmaxdist);
+            loopj(3)
+            {
+                __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(m.bbmin[j]), p.o[j]), p.invray[j]),
+                       t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(m.bbmax[j]), p.o[j]), p.invray[j]);
+                tmin = _mm_max_ps(tmin, _mm_min_ps(t1, t2));
+                tmax = _mm_min_ps(tmax, _mm_max_ps(t1, t2));
+            }
+            live &= _mm_movemask_ps(_mm_cmplt_ps(tmin, tmax));
+            if(!live) continue;
+            loopj(4) if(live&(1<<j))
+            {
+                p.mo[j] = m.invxform.transform(o[j]);
+                p.mray[j] = m.invxformnorm.transform(ray[j]);
+            }
+            hits |= live & ~traversepacket(*this, m, p, m.nodes, tmin, tmax, live);
+        }
+    }
+    return hits;
+#else
+    int hits = 0;
+    loopi(4) if(mask&(1<<i) && traverse(o[i], ray[i], maxdist[i], dist[i], mode)) hits |= 1<<i;
+    return hits;
+#endif
+}
+
+VAR(bihsah, 0, 1, 1);
+
+enum { BIHSAHBINS = 16 };
+
+static inline double bihsurface(const ivec &bbmin, const ivec &bbmax)
+{
+    double dx = bbmax.x - bbmin.x, dy = bbmax.y - bbmin.y, dz = bbmax.z - bbmin.z;
+    return dx*dy + dy*dz + dz*dx;
+}
+
+// bins the triangle centers along each axis and partitions at the bin boundary with the lowest surface area
+// heuristic cost, returning the axis and the boundary as the first bin on the right
+static bool findsahsplit(const BIH::tribb *tribbs, const ushort *indices, int numindices, int &bestaxis, int &bestbin, int &binmin, int &binrange)
+{
+    ivec cmin(INT_MAX, INT_MAX, INT_MAX), cmax(INT_MIN, INT_MIN, INT_MIN);
+    loopi(numindices)
+    {
+        ivec c(tribbs[indices[i]].center);
+        cmin.min(c);
+        cmax.max(c);
+    }
+    double bestcost = 1e30;
+    bestaxis = -1;
+    loopk(3)
+    {
+        int range = cmax[k] - cmin[k] + 1;
+        if(range <= 1) continue;
+        int counts[BIHSAHBINS] = { 0 };
+        ivec bmin[BIHSAHBINS], bmax[BIHSAHBINS];
+        loopi(BIHSAHBINS) { bmin[i] = ivec(INT_MAX, INT_MAX, INT_MAX); bmax[i] = ivec(INT_MIN, INT_MIN, INT_MIN); }
+        loopi(numindices)
+        {
+            const BIH::tribb &tri = tribbs[indices[i]];
+            int bin = ((tri.center[k] - cmin[k])*BIHSAHBINS)/range;
+            counts[bin]++;
+            bmin[bin].min(ivec(tri.center).sub(ivec(tri.radius)));
+            bmax[bin].max(ivec(tri.center).add(ivec(tri.radius)));
+        }
+        double rightcost[BIHSAHBINS];
+        ivec rmin(INT_MAX, INT_MAX, INT_MAX), rmax(INT_MIN, INT_MIN, INT_MIN);
+        int rcount = 0;
+        for(int i = BIHSAHBINS-1; i > 0; i--)
+        {
+            rcount += counts[i];
+            if(counts[i]) { rmin.min(bmin[i]); rmax.max(bmax[i]); }
+            rightcost[i] = rcount ? bihsurface(rmin, rmax) : 0;
+        }
+        ivec lmin(INT_MAX, INT_MAX, INT_MAX), lmax(INT_MIN, INT_MIN, INT_MIN);
+        int lcount = 0;
+        for(int i = 1; i < BIHSAHBINS; i++)
+        {
+            lcount += counts[i-1];
+            if(counts[i-1]) { lmin.min(bmin[i-1]); lmax.max(bmax[i-1]); }
+            if(!lcount || lcount == numindices) continue;
+            double cost = bihsurface(lmin, lmax)*lcount + rightcost[i]*(numindices - lcount);
+            if(cost < bestcost) { bestcost = cost; bestaxis = k; bestbin = i; binmin = cmin[k]; binrange = range; }
+        }
+    }
+    return bestaxis >= 0;
+}
+
+void BIH::build(mesh &m, ushort *indices, int numindices, const ivec &vmin, const ivec &vmax, int offset, ushort *leaves, int &numleaves)
 {
     int axis = 2;
     loopk(2) if(vmax[k] - vmin[k] > vmax[axis] - vmin[axis]) axis = k;
@@ -153,7 +327,35 @@ void BIH::build(mesh &m, ushort *indices, int numindices, const ivec &vmin, cons
     ivec leftmin, leftmax, rightmin, rightmax;
     int splitleft, splitright;
     int left, right;
-    loopk(3)
+    int sahaxis, sahbin, sahmin, sahrange;
+    if(bihsah && findsahsplit(m.tribbs, indices, numindices, sahaxis, sahbin, sahmin, sahrange))
+    {
+        axis = sahaxis;
+        leftmin = rightmin = ivec(INT_MAX, INT_MAX, INT_MAX);
+        leftmax = rightmax = ivec(INT_MIN, INT_MIN, INT_MIN);
+        for(left = 0, right = numindices, splitleft = SHRT_MIN, splitright = SHRT_MAX; left < right;)
+        {
+            const tribb &tri = m.tribbs[indices[left]];
+            ivec trimin = ivec(tri.center).sub(ivec(tri.radius)),
+                 trimax = ivec(tri.center).add(ivec(tri.radius));
+            if(((tri.center[axis] - sahmin)*BIHSAHBINS)/sahrange < sahbin)
+            {
+                ++left;
+                splitleft = max(splitleft, trimax[axis]);
+                leftmin.min(trimin);
+                leftmax.max(trimax);
+            }
+            else
+            {
+                --right;
+                swap(indices[left], indices[right]);
+                splitright = min(splitright, trimin[axis]);
+                rightmin.min(trimin);
+                rightmax.max(trimax);
+            }
+        }
+    }
+    else loopk(3)
     {
         leftmin = rightmin = ivec(INT_MAX, INT_MAX, INT_MAX);
         leftmax = rightmax = ivec(INT_MIN, INT_MIN, INT_MIN);
@@ -211,28 +413,146 @@ void BIH::build(mesh &m, ushort *indices, int numindices, const ivec &vmin, cons
         }
     }
 
-    int offset = m.numnodes++;
     node &curnode = m.nodes[offset];
     curnode.split[0] = short(splitleft);
     curnode.split[1] = short(splitright);
 
-    if(left==1) curnode.child[0] = (axis<<14) | indices[0];
-    else
+    // both children sit next to each other, with pairs kept inside one 64 byte line, and leaves are
+    // numbered in the order they are reached so their triangles can be stored in that order
+    bool leftleaf = left==1, rightleaf = numindices-right==1;
+    int children = m.numnodes;
+    if(!leftleaf && !rightleaf && children&1) children++;
+    int leftnode = children, rightnode = children + (leftleaf ? 0 : 1);
+    m.numnodes = rightnode + (rightleaf ? 0 : 1);
+
+    if(leftleaf)
     {
-        curnode.child[0] = (axis<<14) | (m.numnodes - offset);
-        build(m, indices, left, leftmin, leftmax);
+        curnode.child[0] = (axis<<14) | numleaves;
+        leaves[numleaves++] = indices[0];
     }
+    else curnode.child[0] = (axis<<14) | (leftnode - offset);
 
-    if(numindices-right==1) curnode.child[1] = (1<<15) | (left==1 ? 1<<14 : 0) | indices[right];
-    else
+    if(rightleaf)
     {
-        curnode.child[1] = (left==1 ? 1<<14 : 0) | (m.numnodes - offset);
-        build(m, &indices[right], numindices-right, rightmin, rightmax);
+        curnode.child[1] = (1<<15) | (leftleaf ? 1<<14 : 0) | numleaves;
+        leaves[numleaves++] = indices[right];
     }
+    else curnode.child[1] = (leftleaf ? 1<<14 : 0) | (rightnode - offset);
+
+    if(!leftleaf) build(m, indices, left, leftmin, leftmax, leftnode, leaves, numleaves);
+    if(!rightleaf) build(m, &indices[right], numindices-right, rightmin, rightmax, rightnode, leaves, numleaves);
 }
 
-BIH::BIH(vector<mesh> &buildmeshes)
-  : meshes(NULL), nummeshes(0), nodes(NULL), numnodes(0), tribbs(NULL), numtris(0), bbmin(1e16f, 1e16f, 1e16f), bbmax(-1e16f, -1e16f, -1e16f), center(0, 0, 0), radius(0), entradius(0)
+// finished trees are cached under cache/bih/ keyed by a hash of the triangle bounds they were built from,
+// which is all the builder looks at, so an unchanged model loads its tree instead of rebuilding it
+#define BIHCACHEVERSION 1
+
+VARP(bihcache, 0, 1, 1);
+
+static inline void bihcachehash(uint &key, const void *data, int len)
+{
+    const uchar *bytes = (const uchar *)data;
+    loopi(len) key = ((key<<5)+key)^bytes[i];
+}
+
+static uint bihcachekey(const BIH::mesh *meshes, int nummeshes)
+{
+    uint key = 5381, params[4] = { BIHCACHEVERSION, uint(bihsah), BIHSAHBINS, uint(nummeshes) };
+    bihcachehash(key, params, sizeof(params));
+    loopi(nummeshes)
+    {
+        const BIH::mesh &m = meshes[i];
+        bihcachehash(key, &m.numtris, sizeof(m.numtris));
+        bihcachehash(key, m.tribbs, m.numtris*sizeof(BIH::tribb));
+    }
+    return key;
+}
+
+static stream *openbihcache(const char *name, const char *mode)
+{
+    defformatstring(fname, "cache/bih/%s.bih", name);
+    return openfile(path(fname), mode);
+}
+
+static bool loadbihmesh(stream *f, BIH::mesh &m, ushort *leaves, int maxnodes)
+{
+    if(f->getlil<int>() != m.numtris) return false;
+    int numnodes = f->getlil<int>();
+    if(numnodes <= 0 || numnodes > maxnodes) return false;
+    if(f->read(m.nodes, numnodes*sizeof(BIH::node)) != numnodes*sizeof(BIH::node) ||
+       f->read(leaves, m.numtris*sizeof(ushort)) != m.numtris*sizeof(ushort))
+        return false;
+    lilswap((ushort *)m.nodes, numnodes*4);
+    lilswap(leaves, m.numtris);
+    // the file is untrusted, so the leaves must be a permutation of the triangles and the reachable nodes
+    // must form a proper tree with valid axes that reaches every leaf exactly once, padding slots hold nothing
+    vector<uchar> seen;
+    uchar *nodeseen = seen.pad(numnodes + 2*m.numtris), *leafseen = &nodeseen[numnodes], *triseen = &leafseen[m.numtris];
+    memset(nodeseen, 0, seen.length());
+    loopi(m.numtris) if(leaves[i] >= m.numtris || triseen[leaves[i]]++) return false;
+    if(m.numtris == 1)
+    {
+        // a lone triangle hangs off a root whose children are both that triangle's leaf
+        const BIH::node &n = m.nodes[0];
+        if(n.axis() > 2 || !n.isleaf(0) || !n.isleaf(1) || n.childindex(0) || n.childindex(1)) return false;
+        m.numnodes = numnodes;
+        return true;
+    }
+    int numleaves = 0;
+    vector<int> stack;
+    stack.add(0);
+    nodeseen[0] = 1;
+    while(stack.length())
+    {
+        int idx = stack.pop();
+        const BIH::node &n = m.nodes[idx];
+        if(n.axis() > 2) return false;
+        loopj(2)
+        {
+            int child = n.childindex(j);
+            if(n.isleaf(j))
+            {
+                if(child >= m.numtris || leafseen[child]++) return false;
+                numleaves++;
+            }
+            else if(child <= 0 || idx + child >= numnodes || nodeseen[idx + child]++) return false;
+            else stack.add(idx + child);
+        }
+    }
+    if(numleaves != m.numtris) return false;
+    m.numnodes = numnodes;
+    return true;
+}
+
+static void savebihcache(const char *name, uint key, const BIH::mesh *meshes, int nummeshes, const ushort *leaves)
+{
+    stream *f = openbihcache(name, "wb");
+    if(!f) return;
+    f->write("BIHC", 4);
+    f->putlil<uint>(BIHCACHEVERSION);
+    f->putlil<uint>(key);
+    f->putlil<int>(nummeshes);
+    loopi(nummeshes)
+    {
+        const BIH::mesh &m = meshes[i];
+        f->putlil<int>(m.numtris);
+        f->putlil<int>(m.numnodes);
+        loopj(m.numnodes)
+        {
+            const BIH::node &n = m.nodes[j];
+            f->putlil<short>(n.split[0]);
+            f->putlil<short>(n.split[1]);
+            f->putlil<ushort>(n.child[0]);
+            f->putlil<ushort>(n.child[1]);
+        }
+        loopj(m.numtris) f->putlil<ushort>(leaves[j]);
+        leaves += m.numtris;
+    }
+    delete f;
+}
+
+BIH::BIH(vector<mesh> &buildmeshes, const char *name)
+  : meshes(NULL), nummeshes(0), nodes(NULL), numnodes(0), tris(NULL), tribbs(NULL), numtris(0), bbmin(1e16f, 1e16f, 1e16f), bbmax(-1e16f, -1e16f, -1e16f), center(0, 0, 0), radius(0), entradius(0)
 {
     if(buildmeshes.empty()) return;
     loopv(buildmeshes) numtris += buildmeshes[i].numtris;
@@ -286,25 +606,85 @@ BIH::BIH(vector<mesh> &buildmeshes)
     radius = vec(bbmax).sub(bbmin).mul(0.5f).magnitude();
     entradius = max(bbmin.squaredlen(), bbmax.squaredlen());
 
-    nodes = new node[numtris];
-    node *curnode = nodes;
-    ushort *indices = new ushort[numtris];
+    uint key = 0;
+    stream *cache = NULL;
+    if(name && bihcache)
+    {
+        key = bihcachekey(meshes, nummeshes);
+        cache = openbihcache(name, "rb");
+        char magic[4];
+        if(cache && (cache->read(magic, 4) != 4 || memcmp(magic, "BIHC", 4) || cache->getlil<uint>() != BIHCACHEVERSION ||
+                     cache->getlil<uint>() != key || cache->getlil<int>() != nummeshes))
+            DELETEP(cache);
+    }
+
+    // every mesh starts on a 64 byte line and sibling pairs may waste a node to stay inside one
+    int maxnodes = 2*numtris + 8*(nummeshes+1);
+    nodes = new node[maxnodes];
+    memset(nodes, 0, maxnodes*sizeof(node));
+    node *base = (node *)((size_t(nodes) + 63) & ~size_t(63)), *curnode = base;
+    tris = new tri[numtris];
+    tri *dsttris = tris;
+    ushort *indices = new ushort[numtris], *allleaves = new ushort[numtris];
+    tribb *leafbbs = new tribb[numtris];
     loopi(nummeshes)
     {
         mesh &m = meshes[i];
         m.nodes = curnode;
-        loopj(m.numtris) indices[j] = j;
-        build(m, indices, m.numtris, ivec::floor(m.bbmin), ivec::ceil(m.bbmax));
-        curnode += m.numnodes;
+        m.numnodes = 1;
+        ushort *leaves = &allleaves[dsttris - tris];
+        int numleaves = 0;
+        if(cache)
+        {
+            if(loadbihmesh(cache, m, leaves, 2*m.numtris + 1)) numleaves = m.numtris;
+            else
+            {
+                DELETEP(cache);
+                memset(m.nodes, 0, (2*m.numtris + 1)*sizeof(node));
+                m.numnodes = 1;
+            }
+        }
+        if(!numleaves)
+        {
+            if(m.numtris > 1)
+            {
+                loopj(m.numtris) indices[j] = j;
+                build(m, indices, m.numtris, ivec::floor(m.bbmin), ivec::ceil(m.bbmax), 0, leaves, numleaves);
+            }
+            else
+            {
+                // a lone triangle still needs a root to hang from
+                m.nodes[0].split[0] = SHRT_MAX;
+                m.nodes[0].split[1] = SHRT_MAX;
+                m.nodes[0].child[0] = 0;
+                m.nodes[0].child[1] = (1<<15) | (1<<14);
+                leaves[numleaves++] = 0;
+            }
+        }
+        loopj(numleaves)
+        {
+            dsttris[j] = m.tris[leaves[j]];
+            leafbbs[j] = m.tribbs[leaves[j]];
+        }
+        memcpy((tribb *)m.tribbs, leafbbs, numleaves*sizeof(tribb));
+        m.tris = dsttris;
+        dsttris += m.numtris;
+        curnode += (m.numnodes + 7) & ~7;
     }
     delete[] indices;
-    numnodes = int(curnode - nodes);
+    delete[] leafbbs;
+    numnodes = int(curnode - base);
+
+    if(cache) delete cache;
+    else if(name && bihcache) savebihcache(name, key, meshes, nummeshes, allleaves);
+    delete[] allleaves;
 }
 
 BIH::~BIH()
 {
     delete[] meshes;
     delete[] nodes;
+    delete[] tris;
     delete[] tribbs;
 }
 
@@ -355,6 +735,52 @@ bool mmintersect(const extentity &e, const vec &o, const vec &ray, float maxdist
     return false;
 }
 
+int mmintersect(const extentity &e, const vec *o, const vec *ray, const float *maxdist, int mode, float *dist, int mask)
+{
+    model *m = loadmapmodel(e.attr1);
+    if(!m) return 0;
+    if(mode&RAY_SHADOW)
+    {
+        if(!m->shadow || e.flags&EF_NOSHADOW) return 0;
+    }
+    else if((mode&RAY_ENTS)!=RAY_ENTS && (!m->collide || e.flags&EF_NOCOLLIDE)) return 0;
+    if(!m->bih && !m->setBIH()) return 0;
+    float scale = e.attr5 ? 100.0f/e.attr5 : 1.0f;
+    int yaw = e.attr2, pitch = e.attr3, roll = e.attr4;
+    vec mo[4], mray[4];
+    float mdist[4] = { 0, 0, 0, 0 };
+    loopi(4) if(mask&(1<<i))
+    {
+        mo[i] = vec(o[i]).sub(e.o).mul(scale);
+        mray[i] = ray[i];
+        float v = mo[i].dot(mray[i]), inside = m->bih->entradius - mo[i].squaredlen();
+        if((inside < 0 && v > 0) || inside + v*v < 0) { mask &= ~(1<<i); continue; }
+        if(yaw != 0)
+        {
+            const vec2 &rot = sincosmod360(-yaw);
+            mo[i].rotate_around_z(rot);
+            mray[i].rotate_around_z(rot);
+        }
+        if(pitch != 0)
+        {
+            const vec2 &rot = sincosmod360(-pitch);
+            mo[i].rotate_around_x(rot);
+            mray[i].rotate_around_x(rot);
+        }
+        if(roll != 0)
+        {
+            const vec2 &rot = sincosmod360(roll);
+            mo[i].rotate_around_y(rot);
+            mray[i].rotate_around_y(rot);
+        }
+        mdist[i] = maxdist[i] ? maxdist[i]*scale : 1e16f;
+    }
+    if(!mask) return 0;
+    int hits = m->bih->traverse(mo, mray, mdist, dist, mode, mask);
+    loopi(4) if(hits&(1<<i)) dist[i] /= scale;
+    return hits;
+}
+
 static inline float segmentdistance(const vec &d1, const vec &d2, const vec &r)
 {
     float a = d1.squaredlen(), e = d2.squaredlen(), f = d2.dot(r), s, t;
@@ -605,7 +1031,7 @@ inline void BIH::collide(const mesh &m, physent *d, const vec &dir, float cutoff
                     }
                     else
                     {
-                        collide<C>(m, d, dir, cutoff, center, radius, orient, dist, &nodes[curnode->childindex(nearidx)], bo, br);
+                        collide<C>(m, d, dir, cutoff, center, radius, orient, dist, curnode + curnode->childindex(nearidx), bo, br);
                         curnode += curnode->childindex(faridx);
                         continue;
                     }
@@ -767,7 +1193,7 @@ void BIH::genstaintris(stainrenderer *s, const mesh &m, const vec &center, float
                     }
                     else
                     {
-                        genstaintris(s, m, center, radius, orient, &nodes[curnode->childindex(nearidx)], bo, br);
+                        genstaintris(s, m, center, radius, orient, curnode + curnode->childindex(nearidx), bo, br);
                         curnode += curnode->childindex(faridx);
                         continue;
                     }
@@ -817,3 +1243,83 @@ void BIH::genstaintris(stainrenderer *s, const vec &staincenter, float stainradi
     }
 }
 
+
+static inline float bihbenchrand(uint &seed)
+{
+    seed = seed*1103515245 + 12345;
+    return ((seed>>16)&0x7FFF)/float(0x7FFF);
+}
+
+// benchbih [RAYS]: rebuilds the BIH of every map model with the midpoint and the SAH builder, timing the
+// builds and RAYS random rays cast from around each model into its bounds, both one at a time and in
+// packets of four, and counts packet results that differ from the scalar ones
+void benchbih(int *numrays)
+{
+    int rays = (max(*numrays > 0 ? *numrays : 10000, 4) + 3)&~3;
+    vector<model *> mdls;
+    loopv(mapmodels)
+    {
+        model *m = loadmapmodel(i);
+        if(m && mdls.find(m) < 0 && (m->bih || m->setBIH())) mdls.add(m);
+    }
+    if(mdls.empty()) { conoutf(CON_ERROR, "no map models loaded"); return; }
+
+    vector<vec> o, dir;
+    vector<float> maxdist, scalardist, packetdist;
+    vector<bool> scalarhit;
+    o.pad(rays);
+    dir.pad(rays);
+    maxdist.pad(rays);
+    scalardist.pad(rays);
+    packetdist.pad(rays);
+    scalarhit.pad(rays);
+    loopi(rays) maxdist[i] = 1e16f;
+    int oldsah = bihsah, oldcache = bihcache, nodes[2] = { 0, 0 }, hits[2] = { 0, 0 }, mismatched = 0;
+    float buildmillis[2] = { 0, 0 }, raymillis[2] = { 0, 0 }, packetmillis[2] = { 0, 0 };
+    // the timed builds must neither load nor rewrite the on-disk cache
+    bihcache = 0;
+    loopk(2)
+    {
+        bihsah = k;
+        uint seed = 1;
+        loopv(mdls)
+        {
+            model *m = mdls[i];
+            DELETEP(m->bih);
+            Uint64 start = SDL_GetPerformanceCounter();
+            BIH *b = m->setBIH();
+            buildmillis[k] += (SDL_GetPerformanceCounter() - start)*1000.0f/SDL_GetPerformanceFrequency();
+            if(!b || !b->numnodes) continue;
+            nodes[k] += b->numnodes;
+            vec size = vec(b->bbmax).sub(b->bbmin);
+            loopj(rays)
+            {
+                o[j] = vec(bihbenchrand(seed)*2-1, bihbenchrand(seed)*2-1, bihbenchrand(seed)*2-1);
+                vec target(bihbenchrand(seed), bihbenchrand(seed), bihbenchrand(seed));
+                o[j].rescale(2*b->radius).add(b->center);
+                dir[j] = target.mul(size).add(b->bbmin).sub(o[j]).normalize();
+            }
+            Uint64 scalarstart = SDL_GetPerformanceCounter();
+            loopj(rays) if((scalarhit[j] = b->traverse(o[j], dir[j], 1e16f, scalardist[j], RAY_SHADOW))) hits[k]++;
+            Uint64 packetstart = SDL_GetPerformanceCounter();
+            for(int j = 0; j < rays; j += 4)
+            {
+                int packethits = b->traverse(&o[j], &dir[j], &maxdist[j], &packetdist[j], RAY_SHADOW, 0xF);
+                loopl(4) if(((packethits>>l)&1) != int(scalarhit[j+l]) || (scalarhit[j+l] && packetdist[j+l] != scalardist[j+l])) mismatched++;
+            }
+            Uint64 packetend = SDL_GetPerformanceCounter();
+            raymillis[k] += (packetstart - scalarstart)*1000.0f/SDL_GetPerformanceFrequency();
+            packetmillis[k] += (packetend - packetstart)*1000.0f/SDL_GetPerformanceFrequency();
+        }
+    }
+    bihsah = oldsah;
+    bihcache = oldcache;
+    loopv(mdls) { DELETEP(mdls[i]->bih); mdls[i]->setBIH(); }
+
+    int total = rays*mdls.length();
+    conoutf("bih: %d models, %d rays each, %d packet results differ from scalar", mdls.length(), rays, mismatched);
+    loopk(2) conoutf("bih: %s: %d nodes, build %.2f ms, %d hits, scalar %.2f ms (%.0f rays/s), packet %.2f ms (%.0f rays/s)",
+        k ? "sah" : "midpoint", nodes[k], buildmillis[k], hits[k],
+        raymillis[k], total*1000.0f/max(raymillis[k], 1e-3f), packetmillis[k], total*1000.0f/max(packetmillis[k], 1e-3f));
+}
+COMMAND(benchbih, "i");
@@ -57,18 +57,20 @@ struct BIH
     int nummeshes;
     node *nodes;
     int numnodes;
+    tri *tris;
     tribb *tribbs;
     int numtris;
     vec bbmin, bbmax, center;
     float radius, entradius;
 
-    BIH(vector<mesh> &buildmeshes);
+    BIH(vector<mesh> &buildmeshes, const char *name = NULL);
 
     ~BIH();
 
-    void build(mesh &m, ushort *indices, int numindices, const ivec &vmin, const ivec &vmax);
+    void build(mesh &m, ushort *indices, int numindices, const ivec &vmin, const ivec &vmax, int offset, ushort *leaves, int &numleaves);
 
     bool traverse(const vec &o, const vec &ray, float maxdist, float &dist, int mode);
+    int traverse(const vec *o, const vec *ray, const float *maxdist, float *dist, int mode, int mask);
     bool traverse(const mesh &m, const vec &o, const vec &ray, const vec &invray, float maxdist, float &dist, int mode, node *curnode, float tmin, float tmax);
     bool triintersect(const mesh &m, int tidx, const vec &mo, const vec &mray, float maxdist, float &dist, int mode);
 
@@ -88,4 +90,5 @@ struct BIH
 };
 
 extern bool mmintersect(const extentity &e, const vec &o, const vec &ray, float maxdist, int mode, float &dist);
+extern int mmintersect(const extentity &e, const vec *o, const vec *ray, const float *maxdist, int mode, float *dist, int mask);
 
@@ -171,6 +171,11 @@ static inline bool pvsoccluded(const ivec &bborigin, int size)
     return pvsoccluded(bborigin, ivec(bborigin).add(size));
 }
 
+// occlusion
+extern bool swoccluding;
+extern void swocclude();
+extern bool swoccludedbb(const ivec &bbmin, const ivec &bbmax);
+
 // rendergl
 extern bool hasVAO;
 extern bool hasTR;
@@ -470,8 +475,26 @@ extern void clearshadowcache();
 extern void rendervolumetric();
 extern void cleanupvolumetric();
 
-extern void findshadowvas();
-extern void findshadowmms();
+struct shadowcaster
+{
+    vtxarray *va;
+    int dist, mask;
+};
+
+struct shadowcull
+{
+    int mapping, spot;
+    vec origin, dir;
+    float radius, bias;
+    int firstpart, numparts;
+    vector<shadowcaster> vas;
+    vector<octaentities *> mms;
+};
+
+extern void initshadowcull(shadowcull &sc);
+extern void findshadowcasters(shadowcull *culls, int numculls);
+extern void useshadowcasters(shadowcull &sc);
+extern void findshadowcasters();
 
 extern int calcshadowinfo(const extentity &e, vec &origin, float &radius, vec &spotloc, int &spotangle, float &bias);
 extern int dynamicshadowvabounds(int mask, vec &bbmin, vec &bbmax);
@@ -629,9 +652,13 @@ extern void guessnormals(const vec *pos, int numverts, vec *normals);
 extern void reduceslope(ivec &n);
 extern void findtjoints();
 extern void octarender();
-extern void allchanged(bool load = false);
+extern void allchanged(bool load = false, stream *bakedvas = NULL);
+extern void savebakedvas(stream *f);
+extern bool findbakedvas(stream *f, uint crc);
 extern void clearvas(cube *c);
+extern void cleanupvbos();
 extern void destroyva(vtxarray *va, bool reparent = true);
+extern void dirtyva(cube &c);
 extern void updatevabb(vtxarray *va, bool force = false);
 extern void updatevabbs(bool force = false);
 
@@ -653,6 +680,7 @@ extern float alpharefractsy2;
 extern uint alphatiles[LIGHTTILE_MAXH];
 extern vtxarray *visibleva;
 
+extern void clearvacull();
 extern void visiblecubes(bool cull = true);
 extern void setvfcP(const vec &bbmin = vec(-1, -1, -1), const vec &bbmax = vec(1, 1, 1));
 extern void savevfcP();
@@ -667,6 +695,7 @@ extern void cleanupva();
 
 extern bool isfoggedsphere(float rad, const vec &cv);
 extern int isvisiblesphere(float rad, const vec &cv);
+extern int isvisiblecube(const ivec &o, int size);
 extern int isvisiblebb(const ivec &bo, const ivec &br);
 extern bool bboccluded(const ivec &bo, const ivec &br);
 
@@ -900,6 +929,13 @@ enum
 
 extern void textinput(bool on, int mask = ~0);
 
+// workers
+typedef void (*workfunc)(int job, int thread, void *data);
+extern int workerthreads;
+extern int numworkerthreads();
+extern void runworkers(int n, workfunc fn, void *data);
+extern void cleanupworkers();
+
 // physics
 extern void modifyorient(float yaw, float pitch);
 extern void mousemove(int dx, int dy);
@@ -940,7 +976,7 @@ extern void loadskin(const char *dir, const char *altdir, Texture *&skin, Textur
 extern void resetmodelbatches();
 extern void startmodelquery(occludequery *query);
 extern void endmodelquery();
-extern void rendershadowmodelbatches(bool dynmodel = true);
+extern void rendershadowmodelbatches(bool dynmodel = true, bool statmodel = true);
 extern void shadowmaskbatchedmodels(bool dynshadow = true);
 extern void rendermapmodelbatches();
 extern void rendermodelbatches();
@@ -957,6 +993,7 @@ extern void rendermapmodel(int idx,
 extern void clearbatchedmapmodels();
 extern void preloadusedmapmodels(bool msg = false, bool bih = false);
 extern int batcheddynamicmodels();
+extern void batcheddynamicmodelsigs(uint *sigs, int numsides);
 extern int batcheddynamicmodelbounds(int mask, vec &bbmin, vec &bbmax);
 extern void cleanupmodels();
 
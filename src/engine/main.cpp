@@ -321,6 +321,7 @@ static void cleanup()
 {
     recorder::stop();
     cleanupserver();
+    cleanupworkers();
     SDL_ShowCursor(SDL_TRUE);
     SDL_SetRelativeMouseMode(SDL_FALSE);
     if (screen)
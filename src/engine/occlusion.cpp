@@ -0,0 +1,326 @@
+// occlusion.cpp: software hierarchical-z occlusion culling from solid cubes, resolved in the same frame
+
+#include "engine/engine.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define SWOCC_SSE
+#include <xmmintrin.h>
+#endif
+
+#define SWOCC_W 256
+#define SWOCC_H 128
+#define SWOCC_BAND 16
+#define SWOCC_BANDLEVELS 5          // levels that can be reduced within a band
+#define SWOCC_LEVELS 8              // 256x128 down to 2x1
+
+VAR(swocclusion, 0, 0, 1);
+VAR(swoccludersize, 8, 16, 0x1000);
+VAR(swoccluderdist, 0, 768, 0x10000);
+VAR(swoccluders, 0, 1024, 16384);
+
+bool swoccluding = false;
+static bool hadswocclusion = false;
+static matrix4 swprojmatrix;
+static float swdepth[SWOCC_W*SWOCC_H*2];
+static float *swlevels[SWOCC_LEVELS];
+static int swstats[3], swmillis = 0;
+
+struct swoccluder
+{
+    ivec o;
+    int size;
+    float dist;
+};
+
+struct swpoly
+{
+    vec v[5];
+    int numv, miny, maxy;
+};
+
+static vector<swoccluder> occluders;
+static vector<swpoly> swpolys;
+static vector<vtxarray *> swvas;
+
+static void gatheroccluders(cube *c, const ivec &o, int size, float maxdist)
+{
+    loopi(8)
+    {
+        ivec co(i, o, size);
+        float dist = camera1->o.dist_to_bb(co, size);
+        if(dist > maxdist || isvisiblecube(co, size) >= VFC_FOGGED) continue;
+        if(c[i].children)
+        {
+            if(size > swoccludersize) gatheroccluders(c[i].children, co, size/2, maxdist);
+        }
+        else if(size >= swoccludersize && isentirelysolid(c[i]) && c[i].visible&0xC0 && !(c[i].material&MAT_ALPHA))
+        {
+            swoccluder &oc = occluders.add();
+            oc.o = co;
+            oc.size = size;
+            oc.dist = dist;
+        }
+    }
+}
+
+static inline void addswpoly(const vec *v, int numv)
+{
+    float miny = v[0].y, maxy = v[0].y;
+    for(int i = 1; i < numv; i++) { miny = min(miny, v[i].y); maxy = max(maxy, v[i].y); }
+    if(maxy < 0 || miny >= SWOCC_H) return;
+    swpoly &p = swpolys.add();
+    memcpy(p.v, v, numv*sizeof(vec));
+    p.numv = numv;
+    p.miny = max(int(floorf(miny)), 0);
+    p.maxy = min(int(ceilf(maxy)), SWOCC_H-1);
+}
+
+static inline vec swscreen(const vec4 &p)
+{
+    float invw = 1/p.w;
+    return vec((p.x*invw*0.5f + 0.5f)*SWOCC_W, (p.y*invw*0.5f + 0.5f)*SWOCC_H, p.z*invw);
+}
+
+// clips a face against the near plane and projects it into a convex screen space polygon
+static void addswface(const vec *corners)
+{
+    vec4 in[4], out[5];
+    loopi(4) swprojmatrix.transform(corners[i], in[i]);
+    int numout = 0;
+    loopi(4)
+    {
+        const vec4 &p = in[i], &q = in[(i+1)&3];
+        float dp = p.z + p.w, dq = q.z + q.w;
+        if(dp >= 0) out[numout++] = p;
+        if((dp >= 0) != (dq >= 0)) out[numout++] = vec4(p).lerp(q, dp/(dp - dq));
+    }
+    if(numout < 3) return;
+    vec s[5];
+    loopi(numout)
+    {
+        if(out[i].w <= 1e-3f) return;
+        s[i] = swscreen(out[i]);
+    }
+    addswpoly(s, numout);
+}
+
+static void addswoccluder(const swoccluder &oc)
+{
+    const vec &cam = camera1->o;
+    vec lo(oc.o), hi = vec(oc.o).add(oc.size);
+    loopi(3)
+    {
+        int dim = i, d1 = R[i], d2 = C[i];
+        float coord;
+        if(cam[dim] < lo[dim]) coord = lo[dim];
+        else if(cam[dim] > hi[dim]) coord = hi[dim];
+        else continue;
+        vec corners[4];
+        loopj(4)
+        {
+            vec &p = corners[j];
+            p[dim] = coord;
+            p[d1] = j == 1 || j == 2 ? hi[d1] : lo[d1];
+            p[d2] = j >= 2 ? hi[d2] : lo[d2];
+        }
+        addswface(corners);
+    }
+}
+
+// rasterizes conservatively: a pixel only takes the face's depth if the whole pixel lies inside the
+// face, and then the farthest depth the face has anywhere in it, so occluders never claim more than
+// they cover; faces are kept whole rather than fanned so no pixels are lost along their diagonals
+static void rasterpoly(const swpoly &p, int y0, int y1)
+{
+    const vec *v = p.v;
+    int numv = p.numv;
+    float area = 0;
+    loopi(numv) { const vec &a = v[i], &b = v[(i+1)%numv]; area += a.x*b.y - b.x*a.y; }
+    if(fabs(area) < 1e-6f) return;
+    // edge k runs from vertex k to k+1, pushed inwards by the most the edge function falls across a pixel
+    float ea[5], eb[5], ec[5];
+    loopi(numv)
+    {
+        const vec &a = v[i], &b = v[(i+1)%numv];
+        ea[i] = a.y - b.y;
+        eb[i] = b.x - a.x;
+        ec[i] = a.x*b.y - b.x*a.y;
+        if(area < 0) { ea[i] = -ea[i]; eb[i] = -eb[i]; ec[i] = -ec[i]; }
+        ec[i] -= 0.5f*(fabs(ea[i]) + fabs(eb[i]));
+    }
+    // depth plane from the largest triangle of the fan, the face itself is planar
+    int best = 2;
+    float bestarea = 0;
+    for(int i = 2; i < numv; i++)
+    {
+        const vec &a = v[0], &b = v[i-1], &c = v[i];
+        float tarea = fabs((b.x - a.x)*(c.y - a.y) - (c.x - a.x)*(b.y - a.y));
+        if(tarea > bestarea) { bestarea = tarea; best = i; }
+    }
+    if(bestarea < 1e-6f) return;
+    const vec &a = v[0], &b = v[best-1], &c = v[best];
+    float tarea = (b.x - a.x)*(c.y - a.y) - (c.x - a.x)*(b.y - a.y), invarea = 1/tarea,
+          za = ((b.y - c.y)*a.z + (c.y - a.y)*b.z + (a.y - b.y)*c.z)*invarea,
+          zb = ((c.x - b.x)*a.z + (a.x - c.x)*b.z + (b.x - a.x)*c.z)*invarea,
+          zc = ((b.x*c.y - c.x*b.y)*a.z + (c.x*a.y - a.x*c.y)*b.z + (a.x*b.y - b.x*a.y)*c.z)*invarea + 0.5f*(fabs(za) + fabs(zb));
+    float fminx = v[0].x, fmaxx = v[0].x;
+    for(int i = 1; i < numv; i++) { fminx = min(fminx, v[i].x); fmaxx = max(fmaxx, v[i].x); }
+    int minx = max(int(floorf(fminx)), 0)&~3, maxx = min(int(ceilf(fmaxx)), SWOCC_W-1);
+    y0 = max(y0, p.miny);
+    y1 = min(y1, p.maxy+1);
+#ifdef SWOCC_SSE
+    __m128 xstep = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f), az = _mm_set1_ps(za), zero = _mm_setzero_ps(), ax[5];
+    loopi(numv) ax[i] = _mm_set1_ps(ea[i]);
+#endif
+    for(int y = y0; y < y1; y++)
+    {
+        float yc = y + 0.5f;
+        float *row = &swdepth[y*SWOCC_W];
+#ifdef SWOCC_SSE
+        __m128 rz = _mm_set1_ps(zb*yc + zc), rx[5];
+        loopi(numv) rx[i] = _mm_set1_ps(eb[i]*yc + ec[i]);
+        for(int x = minx; x <= maxx; x += 4)
+        {
+            __m128 xc = _mm_add_ps(_mm_set1_ps(float(x)), xstep),
+                   inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(ax[0], xc), rx[0]), zero);
+            for(int i = 1; i < numv; i++) inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(ax[i], xc), rx[i]), zero));
+            if(!_mm_movemask_ps(inside)) continue;
+            __m128 depth = _mm_loadu_ps(&row[x]), z = _mm_min_ps(depth, _mm_add_ps(_mm_mul_ps(az, xc), rz));
+            _mm_storeu_ps(&row[x], _mm_or_ps(_mm_and_ps(inside, z), _mm_andnot_ps(inside, depth)));
+        }
+#else
+        for(int x = minx; x <= maxx; x++)
+        {
+            float xc = x + 0.5f;
+            bool inside = true;
+            loopi(numv) if(ea[i]*xc + eb[i]*yc + ec[i] < 0) { inside = false; break; }
+            if(inside) row[x] = min(row[x], za*xc + zb*yc + zc);
+        }
+#endif
+    }
+}
+
+static void reducelevel(int level, int y0, int y1)
+{
+    int w = SWOCC_W>>level, srcw = w*2;
+    const float *src = swlevels[level-1];
+    float *dst = swlevels[level];
+    for(int y = y0; y < y1; y++)
+    {
+        const float *s0 = &src[2*y*srcw], *s1 = s0 + srcw;
+        float *d = &dst[y*w];
+        loop(x, w) d[x] = max(max(s0[2*x], s0[2*x+1]), max(s1[2*x], s1[2*x+1]));
+    }
+}
+
+static void rasterband(int job, int thread, void *data)
+{
+    int y0 = job*SWOCC_BAND, y1 = y0 + SWOCC_BAND;
+    loopi(SWOCC_W*SWOCC_BAND) swdepth[y0*SWOCC_W + i] = 1;
+    loopv(swpolys)
+    {
+        const swpoly &p = swpolys[i];
+        if(p.maxy >= y0 && p.miny < y1) rasterpoly(p, y0, y1);
+    }
+    for(int level = 1; level < SWOCC_BANDLEVELS; level++) reducelevel(level, y0>>level, y1>>level);
+}
+
+static bool testswocclusion(const ivec &bbmin, const ivec &bbmax)
+{
+    float minx = 1e16f, miny = 1e16f, maxx = -1e16f, maxy = -1e16f, minz = 1e16f;
+    loopi(8)
+    {
+        vec4 p;
+        swprojmatrix.transform(vec(i&1 ? bbmax.x : bbmin.x, i&2 ? bbmax.y : bbmin.y, i&4 ? bbmax.z : bbmin.z), p);
+        if(p.z + p.w <= 0 || p.w <= 1e-3f) return false;
+        vec s = swscreen(p);
+        minx = min(minx, s.x);
+        maxx = max(maxx, s.x);
+        miny = min(miny, s.y);
+        maxy = max(maxy, s.y);
+        minz = min(minz, s.z);
+    }
+    if(maxx < 0 || maxy < 0 || minx >= SWOCC_W || miny >= SWOCC_H) return false;
+    int x0 = max(int(minx), 0), y0 = max(int(miny), 0), x1 = min(int(maxx), SWOCC_W-1), y1 = min(int(maxy), SWOCC_H-1), level = 0;
+    while(level < SWOCC_LEVELS-1 && (x1 - x0 >= 4 || y1 - y0 >= 4))
+    {
+        x0 >>= 1; y0 >>= 1; x1 >>= 1; y1 >>= 1;
+        level++;
+    }
+    const float *depth = swlevels[level];
+    int w = SWOCC_W>>level;
+    for(int y = y0; y <= y1; y++) for(int x = x0; x <= x1; x++) if(depth[y*w + x] >= minz) return false;
+    return true;
+}
+
+bool swoccludedbb(const ivec &bbmin, const ivec &bbmax)
+{
+    return swoccluding && testswocclusion(bbmin, bbmax);
+}
+
+#define SWOCC_VAJOB 32
+
+static void testvas(int job, int thread, void *data)
+{
+    int end = min((job+1)*SWOCC_VAJOB, swvas.length());
+    for(int i = job*SWOCC_VAJOB; i < end; i++)
+    {
+        vtxarray *va = swvas[i];
+        if(testswocclusion(va->bbmin, va->bbmax)) va->occluded = OCCLUDE_BB;
+        else if(!va->texs || testswocclusion(va->geommin, va->geommax)) va->occluded = OCCLUDE_GEOM;
+        else va->occluded = OCCLUDE_NOTHING;
+    }
+}
+
+// rasterizes the nearest solid cubes into a coarse depth buffer and marks the visible vas it hides
+void swocclude()
+{
+    swoccluding = false;
+    if(!swocclusion || drawtex)
+    {
+        // leave no occlusion state behind that the query path would not overwrite
+        if(hadswocclusion) for(vtxarray *va = visibleva; va; va = va->next) va->occluded = !va->texs ? OCCLUDE_GEOM : OCCLUDE_NOTHING;
+        hadswocclusion = false;
+        return;
+    }
+    Uint32 start = SDL_GetTicks();
+    if(!swlevels[0])
+    {
+        float *level = swdepth;
+        loopi(SWOCC_LEVELS)
+        {
+            swlevels[i] = level;
+            level += (SWOCC_W>>i)*(SWOCC_H>>i);
+        }
+    }
+    swprojmatrix = camprojmatrix;
+
+    occluders.setsize(0);
+    gatheroccluders(worldroot, ivec(0, 0, 0), worldsize/2, swoccluderdist ? float(swoccluderdist) : 1e16f);
+    if(occluders.length() > swoccluders)
+    {
+        occluders.sort([](const swoccluder &x, const swoccluder &y) { return x.dist < y.dist; });
+        occluders.setsize(swoccluders);
+    }
+    swpolys.setsize(0);
+    loopv(occluders) addswoccluder(occluders[i]);
+
+    runworkers(SWOCC_H/SWOCC_BAND, rasterband, NULL);
+    for(int level = SWOCC_BANDLEVELS; level < SWOCC_LEVELS; level++) reducelevel(level, 0, SWOCC_H>>level);
+
+    swvas.setsize(0);
+    for(vtxarray *va = visibleva; va; va = va->next) swvas.add(va);
+    runworkers((swvas.length() + SWOCC_VAJOB-1)/SWOCC_VAJOB, testvas, NULL);
+
+    swstats[0] = occluders.length();
+    swstats[1] = swpolys.length();
+    swstats[2] = 0;
+    loopv(swvas) if(swvas[i]->occluded >= OCCLUDE_BB) swstats[2]++;
+    swmillis = SDL_GetTicks() - start;
+    swoccluding = hadswocclusion = true;
+}
+
+ICOMMAND(swocclusionstats, "", (),
+{
+    conoutf("software occlusion: %d occluders, %d faces, %d of %d vas occluded, %d ms", swstats[0], swstats[1], swstats[2], swvas.length(), swmillis);
+});
@@ -119,6 +119,8 @@ enum
     MERGE_USE    = 1<<2
 };
 
+struct vboarena;
+
 struct vtxarray
 {
     vtxarray *parent;
@@ -128,6 +130,8 @@ struct vtxarray
     ushort voffset, eoffset, skyoffset, decaloffset; // offset into vertex data
     ushort *edata, *skydata, *decaldata; // vertex indices
     GLuint vbuf, ebuf, skybuf, decalbuf; // VBOs
+    vboarena *vbos;          // arena the VBO ranges are allocated from
+    int vbolen[4];           // lengths of the VBO ranges
     ushort minvert, maxvert; // DRE info
     elementset *texelems, *decalelems;   // List of element indices sets (range) per texture
     materialsurface *matbuf; // buffer of material surfaces
@@ -144,6 +148,7 @@ struct vtxarray
     ivec nogimin, nogimax;   // BB of any nogi
     ivec bbmin, bbmax;       // BB of everything including children
     uchar curvfc, occluded;
+    int cullchildren;        // offset of children bounds in the culling blocks
     occludequery *query;
     vector<octaentities *> mapmodels, decals;
     vector<grasstri> grasstris;
@@ -240,7 +245,7 @@ struct undoblock // undo header, all data sits in payload
 };
 
 extern cube *worldroot;             // the world data. only a ptr to 8 cubes (ie: like cube.children above)
-extern int wtris, wverts, vtris, vverts, glde, gbatches, rplanes;
+extern int wtris, wverts, vtris, vverts, glde, gbatches, gstates, rplanes;
 extern int allocnodes, allocva, selchildcount, selchildmat;
 
 const uint F_EMPTY = 0;             // all edges in the range (0,0)
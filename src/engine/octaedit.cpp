@@ -532,37 +532,66 @@ void tryedit()
 
 static bool haschanged = false;
 
-void readychanges(const ivec &bbmin, const ivec &bbmax, cube *c, const ivec &cor, int size)
+// true if any va on the path to a changed leaf has merges, not just the one owning it
+static bool changesmerges(const ivec &bbmin, const ivec &bbmax, cube *c, const ivec &cor, int size, bool merges = false)
+{
+    loopoctabox(cor, size, bbmin, bbmax)
+    {
+        bool vamerges = merges || (c[i].ext && c[i].ext->va && c[i].ext->va->hasmerges);
+        if(c[i].children && size > 1)
+        {
+            ivec o(i, cor, size);
+            if(changesmerges(bbmin, bbmax, c[i].children, o, size/2, vamerges)) return true;
+        }
+        else if(vamerges) return true;
+    }
+    return false;
+}
+
+static void readychanges(const ivec &bbmin, const ivec &bbmax, cube *c, const ivec &cor, int size, bool rebuildall, cube *owner = NULL)
 {
     loopoctabox(cor, size, bbmin, bbmax)
     {
         ivec o(i, cor, size);
+        cube *vacube = owner;
         if(c[i].ext)
         {
-            if(c[i].ext->va)             // removes va s so that octarender will recreate
+            if(c[i].ext->va)
             {
-                int hasmerges = c[i].ext->va->hasmerges;
-                destroyva(c[i].ext->va);
-                c[i].ext->va = NULL;
-                if(hasmerges) invalidatemerges(c[i], o, size, true);
+                if(rebuildall)          // removes va s so that octarender will recreate
+                {
+                    int hasmerges = c[i].ext->va->hasmerges;
+                    destroyva(c[i].ext->va);
+                    c[i].ext->va = NULL;
+                    if(hasmerges) invalidatemerges(c[i], o, size, true);
+                }
+                else vacube = &c[i];
             }
             freeoctaentities(c[i]);
             c[i].ext->tjoints = -1;
         }
-        if(c[i].children)
+        if(c[i].children && size > 1) readychanges(bbmin, bbmax, c[i].children, o, size/2, rebuildall, vacube);
+        else
         {
-            if(size<=1)
+            // only the va that owns a changed leaf is rebuilt, its ancestors keep their geometry
+            if(vacube && vacube->ext && vacube->ext->va) dirtyva(*vacube);
+            if(c[i].children)
             {
                 solidfaces(c[i]);
                 discardchildren(c[i], true);
-                brightencube(c[i]);
             }
-            else readychanges(bbmin, bbmax, c[i].children, o, size/2);
+            brightencube(c[i]);
         }
-        else brightencube(c[i]);
     }
 }
 
+static void readychanges(const ivec &bbmin, const ivec &bbmax)
+{
+    // merged faces span va boundaries, so edits touching them still rebuild every va along the path
+    bool rebuildall = changesmerges(bbmin, bbmax, worldroot, ivec(0, 0, 0), worldsize/2);
+    readychanges(bbmin, bbmax, worldroot, ivec(0, 0, 0), worldsize/2, rebuildall);
+}
+
 void commitchanges(bool force)
 {
     if(!force && !haschanged) return;
@@ -581,7 +610,7 @@ void commitchanges(bool force)
 
 void changed(const ivec &bbmin, const ivec &bbmax, bool commit)
 {
-    readychanges(bbmin, bbmax, worldroot, ivec(0, 0, 0), worldsize/2);
+    readychanges(bbmin, bbmax);
     haschanged = true;
 
     if(commit) commitchanges();
@@ -590,7 +619,7 @@ void changed(const ivec &bbmin, const ivec &bbmax, bool commit)
 void changed(const block3 &sel, bool commit)
 {
     if(sel.s.iszero()) return;
-    readychanges(ivec(sel.o).sub(1), ivec(sel.s).mul(sel.grid).add(sel.o).add(1), worldroot, ivec(0, 0, 0), worldsize/2);
+    readychanges(ivec(sel.o).sub(1), ivec(sel.s).mul(sel.grid).add(sel.o).add(1));
     haschanged = true;
 
     if(commit) commitchanges();
@@ -2847,6 +2876,7 @@ EDITSTAT(octa, int, allocnodes*8);
 EDITSTAT(va, int, allocva);
 EDITSTAT(glde, int, glde);
 EDITSTAT(geombatch, int, gbatches);
+EDITSTAT(geomstate, int, gstates);
 EDITSTAT(oq, int, getnumqueries());
 EDITSTAT(pvs, int, getnumviewcells());
 
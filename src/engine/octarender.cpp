@@ -2,16 +2,8 @@
 
 #include "engine/engine.h"
 
-struct vboinfo
-{
-    int uses;
-    uchar *data;
-};
-
-hashtable<GLuint, vboinfo> vbos;
-
 VAR(printvbo, 0, 0, 1);
-VARFN(vbosize, maxvbosize, 0, 1<<14, 1<<16, allchanged());
+VARFN(vbosize, maxvbosize, 0, 1<<16, 1<<16, allchanged());
 
 enum
 {
@@ -22,107 +14,204 @@ enum
     NUMVBO
 };
 
-static vector<uchar> vbodata[NUMVBO];
-static vector<vtxarray *> vbovas[NUMVBO];
-static int vbosize[NUMVBO];
+static const int vboelemsize[NUMVBO] = { sizeof(vertex), sizeof(ushort), sizeof(ushort), sizeof(ushort) };
+
+struct vborange
+{
+    int offset, len;
+};
 
-void destroyvbo(GLuint vbo)
+// a few large buffers of each type that vas sub-allocate their ranges from; a va takes all of its ranges
+// from a single arena so that vas sharing a vertex buffer also share their index buffers
+struct vboarena
 {
-    vboinfo *exists = vbos.access(vbo);
-    if(!exists) return;
-    vboinfo &vbi = *exists;
-    if(vbi.uses <= 0) return;
-    vbi.uses--;
-    if(!vbi.uses)
+    GLuint vbo[NUMVBO];
+    uchar *data[NUMVBO];
+    int size[NUMVBO], dirtymin[NUMVBO], dirtymax[NUMVBO], uses;
+    vector<vborange> freelist[NUMVBO];
+
+    vboarena(const int *sizes) : uses(0)
     {
-        glDeleteBuffers_(1, &vbo);
-        if(vbi.data) delete[] vbi.data;
-        vbos.remove(vbo);
+        gle::disable();
+        glGenBuffers_(NUMVBO, vbo);
+        loopi(NUMVBO)
+        {
+            size[i] = sizes[i];
+            data[i] = new uchar[size[i]*vboelemsize[i]];
+            dirtymin[i] = size[i];
+            dirtymax[i] = 0;
+            vborange &r = freelist[i].add();
+            r.offset = 0;
+            r.len = size[i];
+            GLenum target = i==VBO_VBUF ? GL_ARRAY_BUFFER : GL_ELEMENT_ARRAY_BUFFER;
+            glBindBuffer_(target, vbo[i]);
+            glBufferData_(target, size[i]*vboelemsize[i], NULL, GL_STATIC_DRAW);
+            glBindBuffer_(target, 0);
+        }
+        if(printvbo) conoutf(CON_DEBUG, "vbo arena: %d verts, %d/%d/%d indices", size[VBO_VBUF], size[VBO_EBUF], size[VBO_SKYBUF], size[VBO_DECALBUF]);
     }
-}
 
-void genvbo(int type, void *buf, int len, vtxarray **vas, int numva)
-{
-    gle::disable();
+    ~vboarena()
+    {
+        glDeleteBuffers_(NUMVBO, vbo);
+        loopi(NUMVBO) delete[] data[i];
+    }
 
-    GLuint vbo;
-    glGenBuffers_(1, &vbo);
-    GLenum target = type==VBO_VBUF ? GL_ARRAY_BUFFER : GL_ELEMENT_ARRAY_BUFFER;
-    glBindBuffer_(target, vbo);
-    glBufferData_(target, len, buf, GL_STATIC_DRAW);
-    glBindBuffer_(target, 0);
+    int findfree(int type, int len) const
+    {
+        const vector<vborange> &ranges = freelist[type];
+        loopv(ranges) if(ranges[i].len >= len) return i;
+        return -1;
+    }
 
-    vboinfo &vbi = vbos[vbo];
-    vbi.uses = numva;
-    vbi.data = new uchar[len];
-    memcpy(vbi.data, buf, len);
+    bool fits(const int *lens) const
+    {
+        loopi(NUMVBO) if(lens[i] && findfree(i, lens[i]) < 0) return false;
+        return true;
+    }
 
-    if(printvbo) conoutf(CON_DEBUG, "vbo %d: type %d, size %d, %d uses", vbo, type, len, numva);
+    int alloc(int type, int len)
+    {
+        vector<vborange> &ranges = freelist[type];
+        int i = findfree(type, len);
+        vborange &r = ranges[i];
+        int offset = r.offset;
+        r.offset += len;
+        r.len -= len;
+        if(!r.len) ranges.remove(i);
+        dirtymin[type] = min(dirtymin[type], offset);
+        dirtymax[type] = max(dirtymax[type], offset + len);
+        return offset;
+    }
+
+    void free(int type, int offset, int len)
+    {
+        vector<vborange> &ranges = freelist[type];
+        int i = 0;
+        while(i < ranges.length() && ranges[i].offset < offset) i++;
+        if(i > 0 && ranges[i-1].offset + ranges[i-1].len == offset)
+        {
+            ranges[i-1].len += len;
+            if(i < ranges.length() && offset + len == ranges[i].offset)
+            {
+                ranges[i-1].len += ranges[i].len;
+                ranges.remove(i);
+            }
+        }
+        else if(i < ranges.length() && offset + len == ranges[i].offset)
+        {
+            ranges[i].offset = offset;
+            ranges[i].len += len;
+        }
+        else
+        {
+            vborange &r = ranges.insert(i, vborange());
+            r.offset = offset;
+            r.len = len;
+        }
+    }
 
-    loopi(numva)
+    void flush()
     {
-        vtxarray *va = vas[i];
-        switch(type)
+        loopi(NUMVBO) if(dirtymin[i] < dirtymax[i])
         {
-            case VBO_VBUF:
-                va->vbuf = vbo;
-                va->vdata = (vertex *)vbi.data;
-                break;
-            case VBO_EBUF:
-                va->ebuf = vbo;
-                va->edata = (ushort *)vbi.data;
-                break;
-            case VBO_SKYBUF:
-                va->skybuf = vbo;
-                va->skydata = (ushort *)vbi.data;
-                break;
-            case VBO_DECALBUF:
-                va->decalbuf = vbo;
-                va->decaldata = (ushort *)vbi.data;
-                break;
+            gle::disable();
+            GLenum target = i==VBO_VBUF ? GL_ARRAY_BUFFER : GL_ELEMENT_ARRAY_BUFFER;
+            glBindBuffer_(target, vbo[i]);
+            glBufferSubData_(target, dirtymin[i]*vboelemsize[i], (dirtymax[i] - dirtymin[i])*vboelemsize[i], data[i] + dirtymin[i]*vboelemsize[i]);
+            glBindBuffer_(target, 0);
+            dirtymin[i] = size[i];
+            dirtymax[i] = 0;
         }
     }
+};
+
+static vector<vboarena *> vboarenas;
+
+// reserves the ranges of all buffer types for a va in the first arena that has room for every one of them
+static void allocvbos(vtxarray *va, int verts, int tris, int skytris, int decaltris)
+{
+    int lens[NUMVBO] = { verts, tris, skytris, decaltris };
+    loopi(NUMVBO) va->vbolen[i] = lens[i];
+    va->vbos = NULL;
+    if(!(verts|tris|skytris|decaltris)) return;
+    loopv(vboarenas) if(vboarenas[i]->fits(lens)) { va->vbos = vboarenas[i]; break; }
+    if(!va->vbos)
+    {
+        int sizes[NUMVBO] = { max(maxvbosize, verts), max(int(USHRT_MAX), tris), max(int(USHRT_MAX), skytris), max(int(USHRT_MAX), decaltris) };
+        va->vbos = vboarenas.add(new vboarena(sizes));
+    }
+    va->vbos->uses++;
 }
 
-void flushvbo(int type = -1)
+static void freevbos(vtxarray *va)
 {
-    if(type < 0)
+    vboarena *arena = va->vbos;
+    if(!arena) return;
+    va->vbos = NULL;
+    if(va->vbuf) arena->free(VBO_VBUF, va->voffset, va->vbolen[VBO_VBUF]);
+    if(va->ebuf) arena->free(VBO_EBUF, va->eoffset, va->vbolen[VBO_EBUF]);
+    if(va->skybuf) arena->free(VBO_SKYBUF, va->skyoffset, va->vbolen[VBO_SKYBUF]);
+    if(va->decalbuf) arena->free(VBO_DECALBUF, va->decaloffset, va->vbolen[VBO_DECALBUF]);
+    // an empty arena is kept around for the next edit unless there are others to allocate from
+    if(--arena->uses <= 0 && vboarenas.length() > 1)
     {
-        loopi(NUMVBO) flushvbo(i);
-        return;
+        vboarenas.removeobj(arena);
+        delete arena;
     }
+}
+
+void flushvbo()
+{
+    loopv(vboarenas) vboarenas[i]->flush();
+}
 
-    vector<uchar> &data = vbodata[type];
-    if(data.empty()) return;
-    vector<vtxarray *> &vas = vbovas[type];
-    genvbo(type, data.getbuf(), data.length(), vas.getbuf(), vas.length());
-    data.setsize(0);
-    vas.setsize(0);
-    vbosize[type] = 0;
+// drops every arena along with its buffers, once no va is left that could use them (e.g. before the GL context goes away)
+void cleanupvbos()
+{
+    vboarenas.deletecontents();
 }
 
 uchar *addvbo(vtxarray *va, int type, int numelems, int elemsize)
 {
+    vboarena &arena = *va->vbos;
+    int offset = arena.alloc(type, numelems);
+    uchar *data = arena.data[type];
     switch(type)
     {
-        case VBO_VBUF: va->voffset = vbosize[type]; break;
-        case VBO_EBUF: va->eoffset = vbosize[type]; break;
-        case VBO_SKYBUF: va->skyoffset = vbosize[type]; break;
-        case VBO_DECALBUF: va->decaloffset = vbosize[type]; break;
+        case VBO_VBUF: va->voffset = offset; va->vbuf = arena.vbo[type]; va->vdata = (vertex *)data; break;
+        case VBO_EBUF: va->eoffset = offset; va->ebuf = arena.vbo[type]; va->edata = (ushort *)data; break;
+        case VBO_SKYBUF: va->skyoffset = offset; va->skybuf = arena.vbo[type]; va->skydata = (ushort *)data; break;
+        case VBO_DECALBUF: va->decaloffset = offset; va->decalbuf = arena.vbo[type]; va->decaldata = (ushort *)data; break;
     }
+    return data + offset*elemsize;
+}
 
-    vbosize[type] += numelems;
-
-    vector<uchar> &data = vbodata[type];
-    vector<vtxarray *> &vas = vbovas[type];
-
-    vas.add(va);
-
-    int len = numelems*elemsize;
-    uchar *buf = data.reserve(len).buf;
-    data.advance(len);
-    return buf;
+void vbostats()
+{
+    static const char * const names[NUMVBO] = { "vertex", "world index", "sky index", "decal index" };
+    conoutf("vbo arenas: %d, %d vas", vboarenas.length(), allocva);
+    loopi(NUMVBO)
+    {
+        int size = 0, used = 0, ranges = 0, largest = 0;
+        loopvj(vboarenas)
+        {
+            vboarena &arena = *vboarenas[j];
+            size += arena.size[i];
+            used += arena.size[i];
+            ranges += arena.freelist[i].length();
+            loopvk(arena.freelist[i])
+            {
+                used -= arena.freelist[i][k].len;
+                largest = max(largest, arena.freelist[i][k].len);
+            }
+        }
+        int unused = size - used;
+        conoutf("%s: %d KB used of %d KB, %d free ranges, %.1f%% fragmented", names[i],
+            (used*vboelemsize[i])>>10, (size*vboelemsize[i])>>10, ranges, unused ? 100.0f*(1 - largest/float(unused)) : 0.0f);
+    }
 }
+COMMAND(vbostats, "");
 
 struct verthash
 {
@@ -267,10 +356,46 @@ struct sortval
      sortval() {}
 };
 
+struct mergedface
+{
+    uchar orient, numverts;
+    ushort mat, tex, envmap;
+    vertinfo *verts;
+    int tjoints;
+};
+
+// a visible face found while walking the octree, which is turned into vertices later on a worker
+struct vaface
+{
+    cube *c;                    // NULL for merged faces
+    ivec co;
+    int size, tj;
+    uchar orient, vis;
+    ushort envmap, envmap2;
+    VSlot *vslot, *layer;
+    mergedface mf;
+};
+
+static void calctexmask(vtxarray *va)
+{
+    va->texmask = 0;
+    va->dyntexs = 0;
+    loopi(va->texs+va->blends+va->alphaback+va->alphafront+va->refract)
+    {
+        VSlot &vslot = lookupvslot(va->texelems[i].texture, false);
+        if(vslot.isdynamic()) va->dyntexs++;
+        Slot &slot = *vslot.slot;
+        loopvj(slot.sts) va->texmask |= 1<<slot.sts[j].type;
+        if(slot.shader->type&SHADER_ENVMAP) va->texmask |= 1<<TEX_ENVMAP;
+    }
+}
+
 struct vacollect : verthash
 {
+    vtxarray *va;
     ivec origin;
     int size;
+    vector<vaface> faces;
     hashtable<sortkey, sortval> indices;
     hashtable<decalkey, sortval> decalindices;
     vector<ushort> skyindices;
@@ -284,9 +409,14 @@ struct vacollect : verthash
     vec refractmin, refractmax;
     vec skymin, skymax;
     ivec nogimin, nogimax;
+    hashset<int> decalseen;
+
+    vacollect() { clear(); }
 
     void clear()
     {
+        va = NULL;
+        faces.setsize(0);
         clearverts();
         worldtris = skytris = decaltris = 0;
         indices.clear();
@@ -410,35 +540,30 @@ struct vacollect : verthash
         }
     }
 
+    // decal slots are loaded up front by loaddecalslots(), and entities reachable through several
+    // nodes are skipped with a local set since other vas may be built at the same time
     void gendecals()
     {
         if(decals.length()) extdecals.put(decals.getbuf(), decals.length());
         if(extdecals.empty()) return;
         vector<extentity *> &ents = entities::getents();
+        decalseen.clear();
         loopv(extdecals)
         {
             octaentities *oe = extdecals[i];
             loopvj(oe->decals)
             {
-                extentity &e = *ents[oe->decals[j]];
-                if(e.flags&EF_RENDER) continue;
-                e.flags |= EF_RENDER;
-                DecalSlot &s = lookupdecalslot(e.attr1, true);
+                int id = oe->decals[j];
+                if(decalseen.access(id)) continue;
+                decalseen.add(id);
+                extentity &e = *ents[id];
+                DecalSlot &s = lookupdecalslot(e.attr1, false);
                 if(!s.shader) continue;
                 ushort envmap = s.shader->type&SHADER_ENVMAP ? (s.texmask&(1<<TEX_ENVMAP) ? EMID_CUSTOM : closestenvmap(e.o)) : EMID_NONE;
                 decalkey k(e.attr1, envmap);
                 gendecal(e, s, k);
             }
         }
-        loopv(extdecals)
-        {
-            octaentities *oe = extdecals[i];
-            loopvj(oe->decals)
-            {
-                extentity &e = *ents[oe->decals[j]];
-                if(e.flags&EF_RENDER) e.flags &= ~EF_RENDER;
-            }
-        }
         enumeratekt(decalindices, decalkey, k, sortval, t,
         {
             if(t.tris.length()) decaltexs.add(k);
@@ -446,11 +571,16 @@ struct vacollect : verthash
         decaltexs.sort(decalkey::sort);
     }
 
-    void setupdata(vtxarray *va)
+    void loaddecalslots()
     {
-        optimize();
-        gendecals();
+        vector<extentity *> &ents = entities::getents();
+        loopv(extdecals) loopvj(extdecals[i]->decals) lookupdecalslot(ents[extdecals[i]->decals[j]]->attr1, true);
+        loopv(decals) loopvj(decals[i]->decals) lookupdecalslot(ents[decals[i]->decals[j]]->attr1, true);
+    }
 
+    // copies the generated geometry into the shared vbos, which has to happen in va order on the main thread
+    void setupdata(vtxarray *va)
+    {
         va->verts = verts.length();
         va->tris = worldtris/3;
         va->vbuf = 0;
@@ -458,14 +588,9 @@ struct vacollect : verthash
         va->minvert = 0;
         va->maxvert = va->verts-1;
         va->voffset = 0;
+        allocvbos(va, verts.length(), worldtris, skytris, decaltris);
         if(va->verts)
         {
-            if(vbosize[VBO_VBUF] + verts.length() > maxvbosize ||
-               vbosize[VBO_EBUF] + worldtris > USHRT_MAX ||
-               vbosize[VBO_SKYBUF] + skytris > USHRT_MAX ||
-               vbosize[VBO_DECALBUF] + decaltris > USHRT_MAX)
-                flushvbo();
-
             uchar *vdata = addvbo(va, VBO_VBUF, va->verts, sizeof(vertex));
             genverts(vdata);
             va->minvert += va->voffset;
@@ -555,16 +680,7 @@ struct vacollect : verthash
             }
         }
 
-        va->texmask = 0;
-        va->dyntexs = 0;
-        loopi(va->texs+va->blends+va->alphaback+va->alphafront+va->refract)
-        {
-            VSlot &vslot = lookupvslot(va->texelems[i].texture, false);
-            if(vslot.isdynamic()) va->dyntexs++;
-            Slot &slot = *vslot.slot;
-            loopvj(slot.sts) va->texmask |= 1<<slot.sts[j].type;
-            if(slot.shader->type&SHADER_ENVMAP) va->texmask |= 1<<TEX_ENVMAP;
-        }
+        calctexmask(va);
 
         va->decalbuf = 0;
         va->decaldata = 0;
@@ -610,21 +726,20 @@ struct vacollect : verthash
             va->grasstris.move(grasstris);
             loadgrassshaders();
         }
-
-        if(mapmodels.length()) va->mapmodels.put(mapmodels.getbuf(), mapmodels.length());
-        if(decals.length()) va->decals.put(decals.getbuf(), decals.length());
     }
 
+    // every recorded face yields vertices, and sky and grass only come from faces
     bool emptyva()
     {
-        return verts.empty() && matsurfs.empty() && skyindices.empty() && grasstris.empty() && mapmodels.empty() && decals.empty();
+        return faces.empty() && matsurfs.empty() && mapmodels.empty() && decals.empty();
     }
-} vc;
+};
 
 int recalcprogress = 0;
 #define progress(s)     if((recalcprogress++&0xFFF)==0) renderprogress(recalcprogress/(float)allocnodes, s);
 
 vector<tjoint> tjoints;
+static bool tjointspending = false;
 
 VARFP(filltjoints, 0, 1, 1, allchanged());
 
@@ -664,7 +779,7 @@ extern const vec orientation_bitangent[6][6] =
     { vec( 0,  0,  1), vec( 0,  0,  1), vec( 0,  0,  1), vec( 0,  0,  1), vec( 0,  1,  0), vec( 0, -1,  0) }
 };
 
-void addtris(VSlot &vslot, int orient, const sortkey &key, vertex *verts, int *index, int numverts, int convex, int tj)
+void addtris(vacollect &vc, VSlot &vslot, int orient, const sortkey &key, vertex *verts, int *index, int numverts, int convex, int tj)
 {
     int &total = key.tex==DEFAULT_SKY ? vc.skytris : vc.worldtris;
     int edge = orient*(MAXFACEVERTS+1);
@@ -752,7 +867,7 @@ void addtris(VSlot &vslot, int orient, const sortkey &key, vertex *verts, int *i
     }
 }
 
-void addgrasstri(int face, vertex *verts, int numv, ushort texture, int layer)
+void addgrasstri(vacollect &vc, int face, vertex *verts, int numv, ushort texture, int layer)
 {
     grasstri &g = vc.grasstris.add();
     int i1, i2, i3, i4;
@@ -857,7 +972,7 @@ void guessnormals(const vec *pos, int numverts, vec *normals)
     normals[3] = n2;
 }
 
-void addcubeverts(VSlot &vslot, int orient, int size, vec *pos, int convex, ushort texture, vertinfo *vinfo, int numverts, int tj = -1, ushort envmap = EMID_NONE, int grassy = 0, bool alpha = false, int layer = LAYER_TOP)
+void addcubeverts(vacollect &vc, VSlot &vslot, int orient, int size, vec *pos, int convex, ushort texture, vertinfo *vinfo, int numverts, int tj = -1, ushort envmap = EMID_NONE, int grassy = 0, bool alpha = false, int layer = LAYER_TOP)
 {
     vec4 sgen, tgen;
     calctexgen(vslot, orient, sgen, tgen);
@@ -906,7 +1021,7 @@ void addcubeverts(VSlot &vslot, int orient, int size, vec *pos, int convex, usho
     }
 
     sortkey key(texture, vslot.scroll.iszero() ? O_ANY : orient, layer&LAYER_BOTTOM ? layer : LAYER_TOP, envmap, alpha ? (vslot.refractscale > 0 ? ALPHA_REFRACT : (vslot.alphaback ? ALPHA_BACK : ALPHA_FRONT)) : NO_ALPHA);
-    addtris(vslot, orient, key, verts, index, numverts, convex, tj);
+    addtris(vc, vslot, orient, key, verts, index, numverts, convex, tj);
 
     if(grassy)
     {
@@ -915,11 +1030,11 @@ void addcubeverts(VSlot &vslot, int orient, int size, vec *pos, int convex, usho
             int faces = 0;
             if(index[0]!=index[i+1] && index[i+1]!=index[i+2] && index[i+2]!=index[0]) faces |= 1;
             if(i+3 < numverts && index[0]!=index[i+2] && index[i+2]!=index[i+3] && index[i+3]!=index[0]) faces |= 2;
-            if(grassy > 1 && faces==3) addgrasstri(i, verts, 4, texture, layer);
+            if(grassy > 1 && faces==3) addgrasstri(vc, i, verts, 4, texture, layer);
             else
             {
-                if(faces&1) addgrasstri(i, verts, 3, texture, layer);
-                if(faces&2) addgrasstri(i+1, verts, 3, texture, layer);
+                if(faces&1) addgrasstri(vc, i, verts, 3, texture, layer);
+                if(faces&2) addgrasstri(vc, i+1, verts, 3, texture, layer);
             }
         }
     }
@@ -1075,7 +1190,9 @@ void gencubeedges(cube *c = worldroot, const ivec &co = ivec(0, 0, 0), int size
     --neighbourdepth;
 }
 
-void gencubeverts(cube &c, const ivec &co, int size, int csi)
+// visibility depends on the neighbour stack and texture lookups may load slots, so faces are
+// only recorded while walking the octree and their vertices generated later by gencubeverts()
+void findcubefaces(vacollect &vc, cube &c, const ivec &co, int size)
 {
     if(!(c.visible&0xC0)) return;
 
@@ -1086,53 +1203,69 @@ void gencubeverts(cube &c, const ivec &co, int size, int csi)
     int tj = filltjoints && c.ext ? c.ext->tjoints : -1, vis;
     loopi(6) if(vismask&(1<<i) && (vis = visibletris(c, i, co, size)))
     {
-        vec pos[MAXFACEVERTS];
-        vertinfo *verts = NULL;
-        int numverts = c.ext ? c.ext->surfaces[i].numverts&MAXFACEVERTS : 0, convex = 0;
-        if(numverts)
-        {
-            verts = c.ext->verts() + c.ext->surfaces[i].verts;
-            vec vo(ivec(co).mask(~0xFFF));
-            loopj(numverts) pos[j] = vec(verts[j].getxyz()).mul(1.0f/8).add(vo);
-            if(!flataxisface(c, i)) convex = faceconvexity(verts, numverts, size);
-        }
-        else
-        {
-            ivec v[4];
-            genfaceverts(c, i, v);
-            if(!flataxisface(c, i)) convex = faceconvexity(v);
-            int order = vis&4 || convex < 0 ? 1 : 0;
-            vec vo(co);
-            pos[numverts++] = vec(v[order]).mul(size/8.0f).add(vo);
-            if(vis&1) pos[numverts++] = vec(v[order+1]).mul(size/8.0f).add(vo);
-            pos[numverts++] = vec(v[order+2]).mul(size/8.0f).add(vo);
-            if(vis&2) pos[numverts++] = vec(v[(order+3)&3]).mul(size/8.0f).add(vo);
-        }
-
         VSlot &vslot = lookupvslot(c.texture[i], true),
               *layer = vslot.layer && !(c.material&MAT_ALPHA) ? &lookupvslot(vslot.layer, true) : NULL;
-        ushort envmap = vslot.slot->shader->type&SHADER_ENVMAP ? (vslot.slot->texmask&(1<<TEX_ENVMAP) ? EMID_CUSTOM : closestenvmap(i, co, size)) : EMID_NONE,
-               envmap2 = layer && layer->slot->shader->type&SHADER_ENVMAP ? (layer->slot->texmask&(1<<TEX_ENVMAP) ? EMID_CUSTOM : closestenvmap(i, co, size)) : EMID_NONE;
+        vaface &f = vc.faces.add();
+        f.c = &c;
+        f.co = co;
+        f.size = size;
+        f.orient = i;
+        f.vis = vis;
+        f.vslot = &vslot;
+        f.layer = layer;
+        f.envmap = vslot.slot->shader->type&SHADER_ENVMAP ? (vslot.slot->texmask&(1<<TEX_ENVMAP) ? EMID_CUSTOM : closestenvmap(i, co, size)) : EMID_NONE;
+        f.envmap2 = layer && layer->slot->shader->type&SHADER_ENVMAP ? (layer->slot->texmask&(1<<TEX_ENVMAP) ? EMID_CUSTOM : closestenvmap(i, co, size)) : EMID_NONE;
         while(tj >= 0 && tjoints[tj].edge < i*(MAXFACEVERTS+1)) tj = tjoints[tj].next;
-        int hastj = tj >= 0 && tjoints[tj].edge < (i+1)*(MAXFACEVERTS+1) ? tj : -1;
-        int grassy = vslot.slot->grass && i!=O_BOTTOM ? (vis!=3 || convex ? 1 : 2) : 0;
-        if(!c.ext)
-            addcubeverts(vslot, i, size, pos, convex, c.texture[i], NULL, numverts, hastj, envmap, grassy, (c.material&MAT_ALPHA)!=0);
-        else
-        {
-            const surfaceinfo &surf = c.ext->surfaces[i];
-            if(!surf.numverts || surf.numverts&LAYER_TOP)
-                addcubeverts(vslot, i, size, pos, convex, c.texture[i], verts, numverts, hastj, envmap, grassy, (c.material&MAT_ALPHA)!=0, surf.numverts&LAYER_BLEND);
-            if(surf.numverts&LAYER_BOTTOM)
-                addcubeverts(layer ? *layer : vslot, i, size, pos, convex, vslot.layer, verts, numverts, hastj, envmap2, 0, false, surf.numverts&LAYER_TOP ? LAYER_BOTTOM : LAYER_TOP);
-        }
+        f.tj = tj >= 0 && tjoints[tj].edge < (i+1)*(MAXFACEVERTS+1) ? tj : -1;
+    }
+}
+
+void gencubeverts(vacollect &vc, const vaface &f)
+{
+    cube &c = *f.c;
+    const ivec &co = f.co;
+    int size = f.size, i = f.orient, vis = f.vis;
+    vec pos[MAXFACEVERTS];
+    vertinfo *verts = NULL;
+    int numverts = c.ext ? c.ext->surfaces[i].numverts&MAXFACEVERTS : 0, convex = 0;
+    if(numverts)
+    {
+        verts = c.ext->verts() + c.ext->surfaces[i].verts;
+        vec vo(ivec(co).mask(~0xFFF));
+        loopj(numverts) pos[j] = vec(verts[j].getxyz()).mul(1.0f/8).add(vo);
+        if(!flataxisface(c, i)) convex = faceconvexity(verts, numverts, size);
+    }
+    else
+    {
+        ivec v[4];
+        genfaceverts(c, i, v);
+        if(!flataxisface(c, i)) convex = faceconvexity(v);
+        int order = vis&4 || convex < 0 ? 1 : 0;
+        vec vo(co);
+        pos[numverts++] = vec(v[order]).mul(size/8.0f).add(vo);
+        if(vis&1) pos[numverts++] = vec(v[order+1]).mul(size/8.0f).add(vo);
+        pos[numverts++] = vec(v[order+2]).mul(size/8.0f).add(vo);
+        if(vis&2) pos[numverts++] = vec(v[(order+3)&3]).mul(size/8.0f).add(vo);
+    }
+
+    VSlot &vslot = *f.vslot, *layer = f.layer;
+    int grassy = vslot.slot->grass && i!=O_BOTTOM ? (vis!=3 || convex ? 1 : 2) : 0;
+    if(!c.ext)
+        addcubeverts(vc, vslot, i, size, pos, convex, c.texture[i], NULL, numverts, f.tj, f.envmap, grassy, (c.material&MAT_ALPHA)!=0);
+    else
+    {
+        const surfaceinfo &surf = c.ext->surfaces[i];
+        if(!surf.numverts || surf.numverts&LAYER_TOP)
+            addcubeverts(vc, vslot, i, size, pos, convex, c.texture[i], verts, numverts, f.tj, f.envmap, grassy, (c.material&MAT_ALPHA)!=0, surf.numverts&LAYER_BLEND);
+        if(surf.numverts&LAYER_BOTTOM)
+            addcubeverts(vc, layer ? *layer : vslot, i, size, pos, convex, vslot.layer, verts, numverts, f.tj, f.envmap2, 0, false, surf.numverts&LAYER_TOP ? LAYER_BOTTOM : LAYER_TOP);
     }
 }
 
 ////////// Vertex Arrays //////////////
 
 int allocva = 0;
-int wtris = 0, wverts = 0, vtris = 0, vverts = 0, glde = 0, gbatches = 0;
+int wtris = 0, wverts = 0, vtris = 0, vverts = 0, glde = 0, gbatches = 0, gstates = 0;
 vector<vtxarray *> valist, varoot;
 
 vtxarray *newva(const ivec &o, int size)
@@ -1147,8 +1280,21 @@ vtxarray *newva(const ivec &o, int size)
     va->bbmin = va->alphamin = va->refractmin = va->skymin = ivec(-1, -1, -1);
     va->bbmax = va->alphamax = va->refractmax = va->skymax = ivec(-1, -1, -1);
     va->hasmerges = 0;
+    va->cullchildren = 0;
+    va->vbos = NULL;
     va->mergelevel = -1;
 
+    allocva++;
+    valist.add(va);
+
+    return va;
+}
+
+// fills in a va created by newva() once its geometry has been generated
+void setupva(vacollect &vc)
+{
+    vtxarray *va = vc.va;
+
     vc.setupdata(va);
 
     if(va->alphafronttris || va->alphabacktris || va->refracttris)
@@ -1172,12 +1318,10 @@ vtxarray *newva(const ivec &o, int size)
     va->nogimin = vc.nogimin;
     va->nogimax = vc.nogimax;
 
+    calcmatbb(va, vc.origin, vc.size, vc.matsurfs);
+
     wverts += va->verts;
     wtris  += va->tris + va->blends + va->alphabacktris + va->alphafronttris + va->refracttris + va->decaltris;
-    allocva++;
-    valist.add(va);
-
-    return va;
 }
 
 void destroyva(vtxarray *va, bool reparent)
@@ -1186,6 +1330,7 @@ void destroyva(vtxarray *va, bool reparent)
     wtris -= va->tris + va->blends + va->alphabacktris + va->alphafronttris + va->refracttris + va->decaltris;
     allocva--;
     valist.removeobj(va);
+    clearvacull();
     if(!va->parent) varoot.removeobj(va);
     if(reparent)
     {
@@ -1197,10 +1342,7 @@ void destroyva(vtxarray *va, bool reparent)
             if(child->parent) child->parent->children.add(child);
         }
     }
-    if(va->vbuf) destroyvbo(va->vbuf);
-    if(va->ebuf) destroyvbo(va->ebuf);
-    if(va->skybuf) destroyvbo(va->skybuf);
-    if(va->decalbuf) destroyvbo(va->decalbuf);
+    freevbos(va);
     if(va->texelems) delete[] va->texelems;
     if(va->decalelems) delete[] va->decalelems;
     if(va->matbuf) delete[] va->matbuf;
@@ -1278,14 +1420,6 @@ void updatevabbs(bool force)
     else loopv(varoot) updatevabb(varoot[i]);
 }
 
-struct mergedface
-{
-    uchar orient, numverts;
-    ushort mat, tex, envmap;
-    vertinfo *verts;
-    int tjoints;
-};
-
 #define MAXMERGELEVEL 12
 static int vahasmerges = 0, vamergemax = 0;
 static vector<mergedface> vamerges[MAXMERGELEVEL+1];
@@ -1362,45 +1496,55 @@ int findmergedfaces(cube &c, const ivec &co, int size, int csi, int minlevel)
     else return -1;
 }
 
-void addmergedverts(int level, const ivec &o)
+void addmergedverts(vacollect &vc, int level, const ivec &o)
 {
     vector<mergedface> &mfl = vamerges[level];
     if(mfl.empty()) return;
-    vec vo(ivec(o).mask(~0xFFF));
-    vec pos[MAXFACEVERTS];
     loopv(mfl)
     {
-        mergedface &mf = mfl[i];
-        int numverts = mf.numverts&MAXFACEVERTS;
-        loopi(numverts)
-        {
-            vertinfo &v = mf.verts[i];
-            pos[i] = vec(v.x, v.y, v.z).mul(1.0f/8).add(vo);
-        }
-        VSlot &vslot = lookupvslot(mf.tex, true);
-        int grassy = vslot.slot->grass && mf.orient!=O_BOTTOM && mf.numverts&LAYER_TOP ? 2 : 0;
-        addcubeverts(vslot, mf.orient, 1<<level, pos, 0, mf.tex, mf.verts, numverts, mf.tjoints, mf.envmap, grassy, (mf.mat&MAT_ALPHA)!=0, mf.numverts&LAYER_BLEND);
+        vaface &f = vc.faces.add();
+        f.c = NULL;
+        f.co = o;
+        f.size = 1<<level;
+        f.mf = mfl[i];
+        f.vslot = &lookupvslot(mfl[i].tex, true);
         vahasmerges |= MERGE_USE;
     }
     mfl.setsize(0);
 }
 
-static inline void finddecals(vtxarray *va)
+void genmergedverts(vacollect &vc, const vaface &f)
+{
+    const mergedface &mf = f.mf;
+    vec vo(ivec(f.co).mask(~0xFFF));
+    vec pos[MAXFACEVERTS];
+    int numverts = mf.numverts&MAXFACEVERTS;
+    loopi(numverts)
+    {
+        vertinfo &v = mf.verts[i];
+        pos[i] = vec(v.x, v.y, v.z).mul(1.0f/8).add(vo);
+    }
+    VSlot &vslot = *f.vslot;
+    int grassy = vslot.slot->grass && mf.orient!=O_BOTTOM && mf.numverts&LAYER_TOP ? 2 : 0;
+    addcubeverts(vc, vslot, mf.orient, f.size, pos, 0, mf.tex, mf.verts, numverts, mf.tjoints, mf.envmap, grassy, (mf.mat&MAT_ALPHA)!=0, mf.numverts&LAYER_BLEND);
+}
+
+static inline void finddecals(vacollect &vc, vtxarray *va)
 {
     if(va->hasmerges&(MERGE_ORIGIN|MERGE_PART))
     {
         loopv(va->decals) vc.extdecals.add(va->decals[i]);
-        loopv(va->children) finddecals(va->children[i]);
+        loopv(va->children) finddecals(vc, va->children[i]);
     }
 }
 
-void rendercube(cube &c, const ivec &co, int size, int csi, int &maxlevel) // creates vertices and indices ready to be put into a va
+void rendercube(vacollect &vc, cube &c, const ivec &co, int size, int csi, int &maxlevel) // creates vertices and indices ready to be put into a va
 {
     //if(size<=16) return;
     if(c.ext && c.ext->va)
     {
         maxlevel = max(maxlevel, c.ext->va->mergelevel);
-        finddecals(c.ext->va);
+        finddecals(vc, c.ext->va);
         return; // don't re-render
     }
 
@@ -1412,14 +1556,14 @@ void rendercube(cube &c, const ivec &co, int size, int csi, int &maxlevel) // cr
         {
             ivec o(i, co, size/2);
             int level = -1;
-            rendercube(c.children[i], o, size/2, csi-1, level);
+            rendercube(vc, c.children[i], o, size/2, csi-1, level);
             if(level >= csi)
                 c.escaped |= 1<<i;
             maxlevel = max(maxlevel, level);
         }
         --neighbourdepth;
 
-        if(csi <= MAXMERGELEVEL && vamerges[csi].length()) addmergedverts(csi, co);
+        if(csi <= MAXMERGELEVEL && vamerges[csi].length()) addmergedverts(vc, csi, co);
 
         if(c.ext && c.ext->ents)
         {
@@ -1431,7 +1575,7 @@ void rendercube(cube &c, const ivec &co, int size, int csi, int &maxlevel) // cr
 
     if(!isempty(c))
     {
-        gencubeverts(c, co, size, csi);
+        findcubefaces(vc, c, co, size);
         if(c.merged) maxlevel = max(maxlevel, genmergedfaces(c, co, size));
     }
     if(c.material != MAT_AIR)
@@ -1450,10 +1594,10 @@ void rendercube(cube &c, const ivec &co, int size, int csi, int &maxlevel) // cr
         if(c.ext->ents->decals.length()) vc.decals.add(c.ext->ents);
     }
 
-    if(csi <= MAXMERGELEVEL && vamerges[csi].length()) addmergedverts(csi, co);
+    if(csi <= MAXMERGELEVEL && vamerges[csi].length()) addmergedverts(vc, csi, co);
 }
 
-void calcgeombb(const ivec &co, int size, ivec &bbmin, ivec &bbmax)
+void calcgeombb(vacollect &vc, const ivec &co, int size, ivec &bbmin, ivec &bbmax)
 {
     vec vmin(co), vmax = vmin;
     vmin.add(size);
@@ -1472,6 +1616,48 @@ void calcgeombb(const ivec &co, int size, ivec &bbmin, ivec &bbmax)
 static int entdepth = -1;
 static octaentities *entstack[32];
 
+// vas are recorded in batches whose geometry is generated by the worker threads, and then copied
+// into the vbos in order so the result matches a single threaded build
+#define VABATCH 64
+static vector<vacollect *> vabatch, vacollects;
+int vabuildmillis = 0;
+
+static vacollect &newvacollect()
+{
+    return vacollects.length() ? *vacollects.pop() : *new vacollect;
+}
+
+static void freevacollect(vacollect &vc)
+{
+    vc.clear();
+    vacollects.add(&vc);
+}
+
+static void buildva(int job, int thread, void *data)
+{
+    vacollect &vc = *vabatch[job];
+    loopv(vc.faces)
+    {
+        const vaface &f = vc.faces[i];
+        if(f.c) gencubeverts(vc, f);
+        else genmergedverts(vc, f);
+    }
+    vc.optimize();
+    vc.gendecals();
+    calcgeombb(vc, vc.origin, vc.size, vc.va->geommin, vc.va->geommax);
+}
+
+static void flushvas()
+{
+    runworkers(vabatch.length(), buildva, NULL);
+    loopv(vabatch)
+    {
+        setupva(*vabatch[i]);
+        freevacollect(*vabatch[i]);
+    }
+    vabatch.setsize(0);
+}
+
 void setva(cube &c, const ivec &co, int size, int csi)
 {
     ASSERT(size <= 0x1000);
@@ -1479,6 +1665,7 @@ void setva(cube &c, const ivec &co, int size, int csi)
     int vamergeoffset[MAXMERGELEVEL+1];
     loopi(MAXMERGELEVEL+1) vamergeoffset[i] = vamerges[i].length();
 
+    vacollect &vc = newvacollect();
     vc.origin = co;
     vc.size = size;
 
@@ -1489,23 +1676,26 @@ void setva(cube &c, const ivec &co, int size, int csi)
     }
 
     int maxlevel = -1;
-    rendercube(c, co, size, csi, maxlevel);
+    rendercube(vc, c, co, size, csi, maxlevel);
 
     if(size == min(0x1000, worldsize/2) || !vc.emptyva())
     {
         vtxarray *va = newva(co, size);
         ext(c).va = va;
-        calcgeombb(co, size, va->geommin, va->geommax);
-        calcmatbb(va, co, size, vc.matsurfs);
         va->hasmerges = vahasmerges;
         va->mergelevel = vamergemax;
+        if(vc.mapmodels.length()) va->mapmodels.put(vc.mapmodels.getbuf(), vc.mapmodels.length());
+        if(vc.decals.length()) va->decals.put(vc.decals.getbuf(), vc.decals.length());
+        vc.va = va;
+        vc.loaddecalslots();
+        vabatch.add(&vc);
+        if(vabatch.length() >= VABATCH) flushvas();
     }
     else
     {
         loopi(MAXMERGELEVEL+1) vamerges[i].setsize(vamergeoffset[i]);
+        freevacollect(vc);
     }
-
-    vc.clear();
 }
 
 static inline int setcubevisibility(cube &c, const ivec &co, int size)
@@ -1598,6 +1788,99 @@ int updateva(cube *c, const ivec &co, int size, int csi)
     return ccount;
 }
 
+struct vahole
+{
+    ivec o;
+    int scale;
+};
+static vector<vahole> vaholes;
+
+// destroys only the va of an edited cube and remembers where it was, so octarender can rebuild it under its parent
+void dirtyva(cube &c)
+{
+    vtxarray *va = c.ext->va;
+    ivec o = va->o;
+    int scale = 0;
+    while(1<<scale < va->size) scale++;
+    destroyva(va);
+    c.ext->va = NULL;
+    loopv(vaholes) if(vaholes[i].o == o && vaholes[i].scale == scale) return;
+    vahole &h = vaholes.add();
+    h.o = o;
+    h.scale = scale;
+}
+
+static inline bool insidevahole(const vahole &h, const vahole &p)
+{
+    return h.scale < p.scale && !((h.o.x^p.o.x)>>p.scale) && !((h.o.y^p.o.y)>>p.scale) && !((h.o.z^p.o.z)>>p.scale);
+}
+
+static void fillvahole(const vahole &h)
+{
+    int neighbourbase = neighbourdepth, entbase = entdepth, scale = worldscale-1;
+    cube *c = worldroot;
+    ivec co(0, 0, 0);
+    vtxarray *parent = NULL;
+    for(;;)
+    {
+        neighbourstack[++neighbourdepth] = c;
+        int i = octastep(h.o.x, h.o.y, h.o.z, scale);
+        co = ivec(i, co, 1<<scale);
+        c = &c[i];
+        if(scale <= h.scale || !c->children) break;
+        if(c->ext)
+        {
+            if(c->ext->va) parent = c->ext->va;
+            if(c->ext->ents) entstack[++entdepth] = c->ext->ents;
+        }
+        c = c->children;
+        scale--;
+    }
+    // holes without a surviving parent are reached by updateva from the root
+    if(scale == h.scale && parent && !(c->ext && c->ext->va))
+    {
+        int size = 1<<scale, childpos = varoot.length();
+        vamergemax = 0;
+        vahasmerges = 0;
+        if(c->children)
+        {
+            if(c->ext && c->ext->ents) entstack[++entdepth] = c->ext->ents;
+            updateva(c->children, co, size/2, scale-1);
+            if(c->ext && c->ext->ents) --entdepth;
+        }
+        else if(!isempty(*c)) setcubevisibility(*c, co, size);
+        setva(*c, co, size, scale);
+        vtxarray *va = c->ext ? c->ext->va : NULL, *owner = va ? va : parent;
+        while(varoot.length() > childpos)
+        {
+            vtxarray *child = varoot.pop();
+            if(child->parent) child->parent->children.removeobj(child);
+            child->parent = owner;
+            owner->children.add(child);
+        }
+        if(va)
+        {
+            va->parent = parent;
+            parent->children.add(va);
+        }
+        for(vtxarray *p = parent; p; p = p->parent) p->bbmin.x = -1;
+        loopi(MAXMERGELEVEL+1) vamerges[i].setsize(0);
+    }
+    neighbourdepth = neighbourbase;
+    entdepth = entbase;
+}
+
+static void fillvaholes()
+{
+    loopv(vaholes)
+    {
+        bool inside = false;
+        loopvj(vaholes) if(insidevahole(vaholes[i], vaholes[j])) { inside = true; break; }
+        if(!inside) fillvahole(vaholes[i]);
+    }
+    vaholes.setsize(0);
+}
+
 void addtjoint(const edgegroup &g, const cubeedge &e, int offset)
 {
     int vcoord = (g.slope[g.axis]*offset + g.origin[g.axis]) & 0x7FFF;
@@ -1676,11 +1959,22 @@ void octarender()                               // creates va s for all leaf cub
     int csi = 0;
     while(1<<csi < worldsize) csi++;
 
+    if(tjointspending)
+    {
+        tjointspending = false;
+        if(filltjoints) findtjoints();
+    }
+
+    Uint32 start = SDL_GetTicks();
     recalcprogress = 0;
     varoot.setsize(0);
+    fillvaholes();
     updateva(worldroot, ivec(0, 0, 0), worldsize/2, csi-1);
+    flushvas();
+    clearvacull();
     loadprogress = 0;
     flushvbo();
+    vabuildmillis = SDL_GetTicks() - start;
 
     explicitsky = 0;
     loopv(valist)
@@ -1719,7 +2013,367 @@ void precachetextures()
     loadprogress = 0;
 }
 
-void allchanged(bool load)
+// the vas of a saved map can be baked onto the end of the map file, after the data the map crc covers, so
+// loading it copies them straight into the vbos instead of regenerating them; they are only used if they
+// were baked for the same map data, va settings and texture slots
+#define BAKEDVAVERSION 1
+
+VARP(bakevas, 0, 0, 1);
+VARP(usebakedvas, 0, 1, 1);
+
+static inline void bakekey(uint &key, uint val) { key = key*31 + val; }
+static inline void bakekey(uint &key, float val) { uint bits; memcpy(&bits, &val, sizeof(bits)); bakekey(key, bits); }
+static inline void bakekey(uint &key, const char *val) { bakekey(key, val ? hthash(val) : 0); }
+
+static void bakeslotkey(uint &key, const Slot &s)
+{
+    bakekey(key, s.shader ? s.shader->name : NULL);
+    bakekey(key, uint(s.smooth));
+    bakekey(key, s.grass);
+    loopv(s.sts)
+    {
+        bakekey(key, uint(s.sts[i].type));
+        bakekey(key, s.sts[i].name);
+    }
+}
+
+static uint bakedvakey()
+{
+    uint key = BAKEDVAVERSION;
+    bakekey(key, uint(worldsize));
+    bakekey(key, uint(vafacemax));
+    bakekey(key, uint(vafacemin));
+    bakekey(key, uint(vacubesize));
+    bakekey(key, uint(filltjoints));
+    bakekey(key, uint(sizeof(vertex)));
+    bakekey(key, uint(islittleendian()));
+    loopv(slots) bakeslotkey(key, *slots[i]);
+    loopv(vslots)
+    {
+        const VSlot &vs = *vslots[i];
+        bakekey(key, uint(vs.slot ? vs.slot->index : -1));
+        bakekey(key, vs.scale);
+        bakekey(key, uint(vs.rotation));
+        bakekey(key, uint(vs.offset.x));
+        bakekey(key, uint(vs.offset.y));
+        bakekey(key, vs.scroll.x);
+        bakekey(key, vs.scroll.y);
+        bakekey(key, uint(vs.layer));
+        bakekey(key, vs.alphafront);
+        bakekey(key, vs.alphaback);
+        bakekey(key, vs.refractscale);
+    }
+    loopv(decalslots)
+    {
+        const DecalSlot &s = *decalslots[i];
+        bakeslotkey(key, s);
+        bakekey(key, s.depth);
+        bakekey(key, s.fade);
+    }
+    return key;
+}
+
+static inline void putbakedivec(stream *f, const ivec &v) { f->putlil<int>(v.x); f->putlil<int>(v.y); f->putlil<int>(v.z); }
+static inline ivec getbakedivec(stream *f) { int x = f->getlil<int>(), y = f->getlil<int>(), z = f->getlil<int>(); return ivec(x, y, z); }
+
+static void savebakedva(stream *f, vtxarray *va, int parent, int &numvas)
+{
+    int index = numvas++;
+    f->putlil<int>(parent);
+    putbakedivec(f, va->o);
+    f->putlil<int>(va->size);
+    f->putlil<int>(va->hasmerges);
+    f->putlil<int>(va->mergelevel);
+    f->putlil<int>(va->verts);
+    f->putlil<int>(va->tris);
+    f->putlil<int>(va->texs);
+    f->putlil<int>(va->blendtris);
+    f->putlil<int>(va->blends);
+    f->putlil<int>(va->alphabacktris);
+    f->putlil<int>(va->alphaback);
+    f->putlil<int>(va->alphafronttris);
+    f->putlil<int>(va->alphafront);
+    f->putlil<int>(va->refracttris);
+    f->putlil<int>(va->refract);
+    f->putlil<int>(va->sky);
+    f->putlil<int>(va->matsurfs);
+    f->putlil<int>(va->matmask);
+    f->putlil<int>(va->decaltris);
+    f->putlil<int>(va->decaltexs);
+    f->putlil<int>(va->voffset);
+    f->putlil<int>(va->vbuf ? va->vbolen[VBO_VBUF] : 0);
+    f->putlil<int>(va->ebuf ? va->vbolen[VBO_EBUF] : 0);
+    f->putlil<int>(va->skybuf ? va->vbolen[VBO_SKYBUF] : 0);
+    f->putlil<int>(va->decalbuf ? va->vbolen[VBO_DECALBUF] : 0);
+    const ivec *bbs[16] = { &va->geommin, &va->geommax, &va->alphamin, &va->alphamax, &va->refractmin, &va->refractmax, &va->skymin, &va->skymax,
+                            &va->lavamin, &va->lavamax, &va->watermin, &va->watermax, &va->glassmin, &va->glassmax, &va->nogimin, &va->nogimax };
+    loopi(16) putbakedivec(f, *bbs[i]);
+    if(va->vbuf) f->write(va->vdata + va->voffset, va->vbolen[VBO_VBUF]*sizeof(vertex));
+    if(va->ebuf) f->write(va->edata + va->eoffset, va->vbolen[VBO_EBUF]*sizeof(ushort));
+    if(va->skybuf) f->write(va->skydata + va->skyoffset, va->vbolen[VBO_SKYBUF]*sizeof(ushort));
+    if(va->decalbuf) f->write(va->decaldata + va->decaloffset, va->vbolen[VBO_DECALBUF]*sizeof(ushort));
+    f->write(va->texelems, (va->texs+va->blends+va->alphaback+va->alphafront+va->refract)*sizeof(elementset));
+    f->write(va->decalelems, va->decaltexs*sizeof(elementset));
+    f->write(va->matbuf, va->matsurfs*sizeof(materialsurface));
+    f->putlil<int>(va->grasstris.length());
+    f->write(va->grasstris.getbuf(), va->grasstris.length()*sizeof(grasstri));
+    loopv(va->children) savebakedva(f, va->children[i], index, numvas);
+}
+
+static void savebakedcubes(stream *f, cube *c)
+{
+    loopi(8)
+    {
+        f->putchar(c[i].visible);
+        if(c[i].children) savebakedcubes(f, c[i].children);
+    }
+}
+
+// written last into the map stream, so the crc of everything before it is the one the map loads with
+void savebakedvas(stream *f)
+{
+    if(!bakevas) return;
+    commitchanges(true);
+    if(valist.empty()) return;
+    renderprogress(0, "saving vertex arrays...");
+    uint crc = f->getcrc();
+    f->write("BKVA", 4);
+    f->putlil<int>(BAKEDVAVERSION);
+    f->putlil<uint>(crc);
+    f->putlil<uint>(bakedvakey());
+    f->putlil<int>(valist.length());
+    int numvas = 0;
+    loopv(varoot) savebakedva(f, varoot[i], -1, numvas);
+    savebakedcubes(f, worldroot);
+}
+
+bool findbakedvas(stream *f, uint crc)
+{
+    if(!usebakedvas) return false;
+    char magic[4];
+    if(f->read(magic, 4) != 4 || memcmp(magic, "BKVA", 4)) return false;
+    if(f->getlil<int>() != BAKEDVAVERSION) return false;
+    return f->getlil<uint>() == crc;
+}
+
+static inline bool getbakedbuf(stream *f, void *buf, size_t len)
+{
+    return !len || f->read(buf, len) == len;
+}
+
+// the baked section comes from the map file, which may have arrived over the network, so every count,
+// index and range is checked against the buffers it refers to before anything renders from it
+static bool checkbakedindices(const ushort *idx, int len, int voffset, int verts)
+{
+    loopi(len) if(idx[i] < voffset || idx[i] - voffset >= verts) return false;
+    return true;
+}
+
+static bool checkbakedelems(const elementset *elems, int numelems, int tris, int voffset, int verts)
+{
+    int len = 0;
+    loopi(numelems)
+    {
+        const elementset &e = elems[i];
+        if(e.length%3) return false;
+        if(e.length && (e.minvert < voffset || e.minvert > e.maxvert || e.maxvert - voffset >= verts)) return false;
+        len += e.length;
+    }
+    return len == 3*tris;
+}
+
+static vtxarray *loadbakedva(stream *f, const vector<vtxarray *> &loaded)
+{
+    int parent = f->getlil<int>();
+    ivec o = getbakedivec(f);
+    int size = f->getlil<int>();
+    if(parent >= loaded.length() || size <= 0 || size > 0x1000 || (size&(size-1))) return NULL;
+    ivec co;
+    int csize;
+    cube &c = lookupcube(o, -size, co, csize);
+    if(co != o || csize != size || (c.ext && c.ext->va)) return NULL;
+
+    vtxarray *va = newva(o, size);
+    ext(c).va = va;
+    va->vbuf = va->ebuf = va->skybuf = va->decalbuf = 0;
+    va->vdata = NULL;
+    va->edata = va->skydata = va->decaldata = NULL;
+    va->voffset = va->eoffset = va->skyoffset = va->decaloffset = 0;
+    va->texelems = va->decalelems = NULL;
+    va->matbuf = NULL;
+    va->verts = va->tris = va->blends = va->alphabacktris = va->alphafronttris = va->refracttris = va->decaltris = 0;
+    if(loaded.inrange(parent))
+    {
+        va->parent = loaded[parent];
+        va->parent->children.add(va);
+    }
+    else varoot.add(va);
+
+    va->hasmerges = f->getlil<int>();
+    va->mergelevel = f->getlil<int>();
+    int verts = f->getlil<int>(), tris = f->getlil<int>();
+    va->texs = f->getlil<int>();
+    int blendtris = f->getlil<int>();
+    va->blends = f->getlil<int>();
+    int alphabacktris = f->getlil<int>();
+    va->alphaback = f->getlil<int>();
+    int alphafronttris = f->getlil<int>();
+    va->alphafront = f->getlil<int>();
+    int refracttris = f->getlil<int>();
+    va->refract = f->getlil<int>();
+    va->sky = f->getlil<int>();
+    va->matsurfs = f->getlil<int>();
+    va->matmask = f->getlil<int>();
+    int decaltris = f->getlil<int>();
+    va->decaltexs = f->getlil<int>();
+    int voffset = f->getlil<int>(), lens[NUMVBO];
+    loopi(NUMVBO) lens[i] = f->getlil<int>();
+    ivec *bbs[16] = { &va->geommin, &va->geommax, &va->alphamin, &va->alphamax, &va->refractmin, &va->refractmax, &va->skymin, &va->skymax,
+                      &va->lavamin, &va->lavamax, &va->watermin, &va->watermax, &va->glassmin, &va->glassmax, &va->nogimin, &va->nogimax };
+    loopi(16) *bbs[i] = getbakedivec(f);
+
+    int numtexelems = va->texs+va->blends+va->alphaback+va->alphafront+va->refract;
+    if(va->texs < 0 || va->blends < 0 || va->alphaback < 0 || va->alphafront < 0 || va->refract < 0) return NULL;
+    if(lens[VBO_VBUF] < 0 || lens[VBO_VBUF] > USHRT_MAX+1 || lens[VBO_VBUF] != verts || va->sky != lens[VBO_SKYBUF] || numtexelems < 0 || va->decaltexs < 0 || va->matsurfs < 0) return NULL;
+    loopi(NUMVBO) if(lens[i] < 0 || lens[i] > 0x100000) return NULL;
+    if(numtexelems > lens[VBO_EBUF] || va->decaltexs > lens[VBO_DECALBUF] || va->matsurfs > 0x100000) return NULL;
+    if(tris < 0 || blendtris < 0 || alphabacktris < 0 || alphafronttris < 0 || refracttris < 0 || decaltris < 0 ||
+       3*(llong(tris) + blendtris + alphabacktris + alphafronttris + refracttris) != lens[VBO_EBUF] || 3*llong(decaltris) != lens[VBO_DECALBUF])
+        return NULL;
+    if(!verts && (lens[VBO_EBUF] || lens[VBO_SKYBUF] || lens[VBO_DECALBUF])) return NULL;
+
+    allocvbos(va, lens[VBO_VBUF], lens[VBO_EBUF], lens[VBO_SKYBUF], lens[VBO_DECALBUF]);
+    if(lens[VBO_VBUF] && !getbakedbuf(f, addvbo(va, VBO_VBUF, lens[VBO_VBUF], sizeof(vertex)), lens[VBO_VBUF]*sizeof(vertex))) return NULL;
+    // indices were baked for wherever the vertices sat in the old vbo
+    int delta = va->voffset - voffset;
+    static const int idxtypes[3] = { VBO_EBUF, VBO_SKYBUF, VBO_DECALBUF };
+    loopi(3)
+    {
+        int type = idxtypes[i];
+        if(!lens[type]) continue;
+        ushort *idx = (ushort *)addvbo(va, type, lens[type], sizeof(ushort));
+        if(!getbakedbuf(f, idx, lens[type]*sizeof(ushort)) || !checkbakedindices(idx, lens[type], voffset, verts)) return NULL;
+        if(delta) loopj(lens[type]) idx[j] += delta;
+    }
+    va->verts = verts;
+    va->tris = tris;
+    va->blendtris = blendtris;
+    va->alphabacktris = alphabacktris;
+    va->alphafronttris = alphafronttris;
+    va->refracttris = refracttris;
+    va->decaltris = decaltris;
+    va->minvert = va->voffset;
+    va->maxvert = va->voffset + va->verts - 1;
+    wverts += va->verts;
+    wtris  += va->tris + va->blends + va->alphabacktris + va->alphafronttris + va->refracttris + va->decaltris;
+
+    if(numtexelems) va->texelems = new elementset[numtexelems];
+    if(va->decaltexs) va->decalelems = new elementset[va->decaltexs];
+    if(va->matsurfs) va->matbuf = new materialsurface[va->matsurfs];
+    if(!getbakedbuf(f, va->texelems, numtexelems*sizeof(elementset)) ||
+       !getbakedbuf(f, va->decalelems, va->decaltexs*sizeof(elementset)) ||
+       !getbakedbuf(f, va->matbuf, va->matsurfs*sizeof(materialsurface)))
+        return NULL;
+    // element sets cover their index buffers in order: world, blend, alpha back, alpha front, refract
+    if(!checkbakedelems(va->texelems, va->texs, tris, voffset, verts) ||
+       !checkbakedelems(va->texelems + va->texs, va->blends, blendtris, voffset, verts) ||
+       !checkbakedelems(va->texelems + va->texs + va->blends, va->alphaback, alphabacktris, voffset, verts) ||
+       !checkbakedelems(va->texelems + va->texs + va->blends + va->alphaback, va->alphafront, alphafronttris, voffset, verts) ||
+       !checkbakedelems(va->texelems + va->texs + va->blends + va->alphaback + va->alphafront, va->refract, refracttris, voffset, verts) ||
+       !checkbakedelems(va->decalelems, va->decaltexs, decaltris, voffset, verts))
+        return NULL;
+    loopi(va->matsurfs)
+    {
+        const materialsurface &m = va->matbuf[i];
+        if(m.orient >= 6 || i + m.skip >= va->matsurfs) return NULL;
+    }
+    if(delta)
+    {
+        loopi(numtexelems) if(va->texelems[i].length) { va->texelems[i].minvert += delta; va->texelems[i].maxvert += delta; }
+        loopi(va->decaltexs) if(va->decalelems[i].length) { va->decalelems[i].minvert += delta; va->decalelems[i].maxvert += delta; }
+    }
+    int numgrasstris = f->getlil<int>();
+    if(numgrasstris < 0 || numgrasstris > 0x100000) return NULL;
+    if(numgrasstris)
+    {
+        if(!getbakedbuf(f, va->grasstris.pad(numgrasstris), numgrasstris*sizeof(grasstri))) return NULL;
+        loopi(numgrasstris) if(va->grasstris[i].numv < 3 || va->grasstris[i].numv > 4) return NULL;
+        loadgrassshaders();
+    }
+
+    loopi(numtexelems) lookupvslot(va->texelems[i].texture, true);
+    loopi(va->decaltexs) lookupdecalslot(va->decalelems[i].texture, true);
+    calctexmask(va);
+    return va;
+}
+
+static bool loadbakedcubes(stream *f, cube *c)
+{
+    loopi(8)
+    {
+        int visible = f->getchar();
+        if(visible < 0) return false;
+        c[i].visible = visible;
+        if(c[i].children && !loadbakedcubes(f, c[i].children)) return false;
+    }
+    return true;
+}
+
+// entities are linked to the vas the same way rendercube() collects them
+static void linkbakedents(cube *c, vtxarray *va)
+{
+    loopi(8)
+    {
+        vtxarray *cva = c[i].ext && c[i].ext->va ? c[i].ext->va : va;
+        if(c[i].children) linkbakedents(c[i].children, cva);
+        if(cva && c[i].ext && c[i].ext->ents)
+        {
+            octaentities *oe = c[i].ext->ents;
+            if(oe->mapmodels.length()) cva->mapmodels.add(oe);
+            if(oe->decals.length()) cva->decals.add(oe);
+        }
+    }
+}
+
+static bool loadbakedvas(stream *f)
+{
+    if(f->getlil<uint>() != bakedvakey()) return false;
+    int numvas = f->getlil<int>();
+    if(numvas <= 0) return false;
+
+    renderprogress(0, "loading vertex arrays...");
+    Uint32 start = SDL_GetTicks();
+    varoot.setsize(0);
+    vector<vtxarray *> loaded;
+    loopi(numvas)
+    {
+        vtxarray *va = loadbakedva(f, loaded);
+        if(!va) break;
+        loaded.add(va);
+    }
+    if(loaded.length() < numvas || !loadbakedcubes(f, worldroot))
+    {
+        conoutf(CON_WARN, "baked vertex arrays are corrupt, regenerating geometry");
+        clearvas(worldroot);
+        varoot.setsize(0);
+        wverts = wtris = 0;
+        return false;
+    }
+    linkbakedents(worldroot, NULL);
+    clearvacull();
+    flushvbo();
+    vabuildmillis = SDL_GetTicks() - start;
+
+    explicitsky = 0;
+    loopv(valist) explicitsky += valist[i]->sky;
+    visibleva = NULL;
+
+    // t-joints are only needed again once an edit regenerates some of the vas
+    tjointspending = true;
+    return true;
+}
+
+void allchanged(bool load, stream *bakedvas)
 {
     if(mainmenu && !isconnected()) load = false;
     if(load) initlights();
@@ -1730,8 +2384,12 @@ void allchanged(bool load)
     if(load) initenvmaps();
     entitiesinoctanodes();
     tjoints.setsize(0);
-    if(filltjoints) findtjoints();
-    octarender();
+    tjointspending = false;
+    if(!bakedvas || !loadbakedvas(bakedvas))
+    {
+        if(filltjoints) findtjoints();
+        octarender();
+    }
     if(load) precachetextures();
     setupmaterials();
     clearshadowcache();
@@ -1753,3 +2411,19 @@ void recalc()
 
 COMMAND(recalc, "");
 
+// rebuilds the world geometry once on a single thread and once on the worker threads
+void benchva()
+{
+    int threads = numworkerthreads(), millis[2];
+    loopi(2)
+    {
+        int old = workerthreads;
+        if(!i) workerthreads = 1;
+        allchanged();
+        workerthreads = old;
+        millis[i] = vabuildmillis;
+    }
+    conoutf("vertex arrays: %d built, 1 thread %d ms, %d threads %d ms (%.1fx)", valist.length(), millis[0], threads, millis[1], millis[0]/float(max(millis[1], 1)));
+}
+COMMAND(benchva, "");
+
@@ -6,6 +6,11 @@
 #include "engine/engine.h"
 #include "engine/mpr.h"
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define RAYPACKET_SSE
+#include <xmmintrin.h>
+#endif
+
 const int MAXCLIPPLANES = 1024;
 static clipplanes clipcache[MAXCLIPPLANES];
 static int clipcacheversion = -2;
@@ -409,6 +414,132 @@ float rayfloor(const vec &o, vec &floor, int mode, float radius)
     return dist;
 }
 
+// packet tracing: four rays walk the octree together front to back, each keeping its closest hit in dist,
+// and mapmodels are tested through the packet BIH traversal; only world geometry, clip materials and
+// mapmodel polys are handled, other modes fall back to raycube
+#ifdef RAYPACKET_SSE
+struct raypacket
+{
+    __m128 o[3], invray[3];
+    vec ro[4], rray[4], rinvray[4];
+    float dist[4];
+    int order, mode;
+};
+
+static void raypacketents(raypacket &p, octaentities *oc, int mask)
+{
+    const vector<extentity *> &ents = entities::getents();
+    loopv(oc->mapmodels)
+    {
+        extentity &e = *ents[oc->mapmodels[i]];
+        if(!(e.flags&EF_OCTA)) continue;
+        float f[4] = { 0, 0, 0, 0 };
+        int hits = mmintersect(e, p.ro, p.rray, p.dist, p.mode, f, mask);
+        loopj(4) if(hits&(1<<j) && f[j]>0 && f[j]<p.dist[j] && vec(p.rray[j]).mul(f[j]).add(p.ro[j]).insidebb(oc->o, oc->size)) p.dist[j] = f[j];
+    }
+}
+
+static void raypacketcube(raypacket &p, cube *c, const ivec &co, int size, int mask)
+{
+    __m128 fsize = _mm_set1_ps(size);
+    loopi(8)
+    {
+        int idx = i ^ p.order;
+        ivec o(idx, co, size);
+        __m128 tnear = _mm_setzero_ps(), tfar = _mm_loadu_ps(p.dist);
+        loopj(3)
+        {
+            __m128 lo = _mm_set1_ps(o[j]),
+                   t1 = _mm_mul_ps(_mm_sub_ps(lo, p.o[j]), p.invray[j]),
+                   t2 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(lo, fsize), p.o[j]), p.invray[j]);
+            tnear = _mm_max_ps(tnear, _mm_min_ps(t1, t2));
+            tfar = _mm_min_ps(tfar, _mm_max_ps(t1, t2));
+        }
+        int cmask = mask & _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+        if(!cmask) continue;
+
+        cube &child = c[idx];
+        if(child.ext && child.ext->ents && (p.mode&RAY_POLY) == RAY_POLY) raypacketents(p, child.ext->ents, cmask);
+        if(child.children) { raypacketcube(p, child.children, o, size>>1, cmask); continue; }
+        if((p.mode&RAY_CLIPMAT) && (child.material&MATF_CLIP) == MAT_NOCLIP) continue;
+
+        bool solid = isentirelysolid(child) || ((p.mode&RAY_CLIPMAT) && isclipped(child.material&MATF_VOLUME));
+        if(!solid && isempty(child)) continue;
+        float enter[4];
+        _mm_storeu_ps(enter, tnear);
+        const clipplanes *planes = solid ? NULL : &getclipplanes(child, o, size, false, 1);
+        loopj(4) if(cmask&(1<<j))
+        {
+            float f = enter[j];
+            if(planes && !raycubeintersect(*planes, child, p.ro[j], p.rray[j], p.rinvray[j], p.dist[j], f)) continue;
+            if(f < p.dist[j]) p.dist[j] = f;
+        }
+    }
+}
+#endif
+
+// traces n rays, four at a time; dist receives the distance to the first hit or the ray's radius if nothing
+// is closer (a radius of 0 is unbounded and yields 1e16 on a miss)
+void raycubepacket(int n, const vec *o, const vec *ray, const float *radius, float *dist, int mode)
+{
+#ifdef RAYPACKET_SSE
+    // a bare RAY_BB walks the entity bounds differently in raycube, so only full polygon tests use packets
+    if(!(mode&~(RAY_ALPHAPOLY|RAY_CLIPMAT)) && (!(mode&RAY_BB) || (mode&RAY_POLY) == RAY_POLY) && worldroot)
+    {
+        for(int base = 0; base < n; base += 4)
+        {
+            int num = min(n - base, 4), mask = (1<<num)-1;
+            raypacket p;
+            p.mode = mode;
+            const vec &first = ray[base];
+            p.order = (first.x < 0 ? 1 : 0) | (first.y < 0 ? 2 : 0) | (first.z < 0 ? 4 : 0);
+            float lanes[3][4], inv[3][4];
+            loopi(4)
+            {
+                int r = base + min(i, num-1);
+                p.ro[i] = o[r];
+                p.rray[i] = ray[r];
+                p.rinvray[i] = vec(ray[r].x ? 1/ray[r].x : 1e16f, ray[r].y ? 1/ray[r].y : 1e16f, ray[r].z ? 1/ray[r].z : 1e16f);
+                p.dist[i] = radius[r] > 0 ? radius[r] : 1e16f;
+                loopj(3) { lanes[j][i] = p.ro[i][j]; inv[j][i] = p.rinvray[i][j]; }
+                if(ray[r].iszero()) { p.dist[i] = 0; mask &= ~(1<<i); }
+            }
+            loopj(3)
+            {
+                p.o[j] = _mm_loadu_ps(lanes[j]);
+                p.invray[j] = _mm_loadu_ps(inv[j]);
+            }
+            if(mask) raypacketcube(p, worldroot, ivec(0, 0, 0), worldsize>>1, mask);
+            loopi(num) dist[base+i] = p.dist[i];
+        }
+        return;
+    }
+#endif
+    loopi(n)
+    {
+        float d = raycube(o[i], ray[i], radius[i], mode);
+        dist[i] = radius[i] > 0 ? (d < 0 || d > radius[i] ? radius[i] : d) : (d < 0 ? 1e16f : d);
+    }
+}
+
+void raycubelos(int n, const vec *o, const vec *dest, bool *visible)
+{
+    static vector<vec> rays;
+    static vector<float> dists, hits;
+    rays.setsize(0);
+    dists.setsize(0);
+    hits.setsize(0);
+    loopi(n)
+    {
+        vec &ray = rays.add(vec(dest[i]).sub(o[i]));
+        float mag = ray.magnitude();
+        if(mag > 0) ray.mul(1/mag);
+        dists.add(mag);
+    }
+    raycubepacket(n, o, rays.getbuf(), dists.getbuf(), hits.pad(n), RAY_CLIPMAT|RAY_POLY);
+    loopi(n) visible[i] = hits[i] >= dists[i];
+}
+
 /////////////////////////  entity collision  ///////////////////////////////////////////////
 
 // info about collisions
@@ -516,73 +647,150 @@ bool ellipsecollide(physent *d, const vec &dir, const vec &o, const vec &center,
     return false;
 }
 
-#define DYNENTCACHESIZE 1024
+// benchphysics drives bare dynents that must stay hidden from the game module
+static bool physbench = false;
+static vector<dynent *> benchents;
+static int movecollisions = 0;
 
-static uint dynentframe = 0;
+static inline bool allowmove(physent *d) { return physbench || game::allowmove(d); }
 
-static struct dynentcacheentry
+// dynents are binned by the cell of their center into a loose uniform grid, rebuilt at most once per
+// physics frame; queries widen by the largest radius binned so every dynent lives in exactly one cell
+struct dynentcell
 {
-    int x, y;
-    uint frame;
-    vector<physent *> dynents;
-} dynentcache[DYNENTCACHESIZE];
+    int x, y, offset, count;
+};
+
+static vector<dynentcell> dynentcells;          // open addressed, power of two size
+static vector<physent *> dynentgrid;            // cell contents back to back, NULL where a dynent moved away
+static vector<physent *> dynentmoved;           // dynents that left their cell since the grid was built
+static vector<physent *> dynentresults;
+static vector<int> dynentslots;
+static float dynentmaxradius = 0;
+static bool dynentgridvalid = false;
 
 void cleardynentcache()
 {
-    dynentframe++;
-    if(!dynentframe || dynentframe == 1) loopi(DYNENTCACHESIZE) dynentcache[i].frame = 0;
-    if(!dynentframe) dynentframe = 1;
+    dynentgridvalid = false;
 }
 
 VARF(dynentsize, 4, 7, 12, cleardynentcache());
 
-#define DYNENTHASH(x, y) (((((x)^(y))<<5) + (((x)^(y))>>5)) & (DYNENTCACHESIZE - 1))
+static inline int dynentcoord(float c)
+{
+    return clamp(int(c), 0, worldsize-1)>>dynentsize;
+}
 
-const vector<physent *> &checkdynentcache(int x, int y)
+static inline dynentcell *finddynentcell(int x, int y, bool insert = false)
 {
-    dynentcacheentry &dec = dynentcache[DYNENTHASH(x, y)];
-    if(dec.x == x && dec.y == y && dec.frame == dynentframe) return dec.dynents;
-    dec.x = x;
-    dec.y = y;
-    dec.frame = dynentframe;
-    dec.dynents.shrink(0);
-    int numdyns = game::numdynents(), dsize = 1<<dynentsize, dx = x<<dynentsize, dy = y<<dynentsize;
-    loopi(numdyns)
+    int mask = dynentcells.length()-1;
+    for(uint h = uint(((x^y)<<5) + ((x^y)>>5) + x*31);; h++)
     {
-        dynent *d = game::iterdynents(i);
-        if(d->state != CS_ALIVE ||
-           d->o.x+d->radius <= dx || d->o.x-d->radius >= dx+dsize ||
-           d->o.y+d->radius <= dy || d->o.y-d->radius >= dy+dsize)
-            continue;
-        dec.dynents.add(d);
+        dynentcell &c = dynentcells[h&mask];
+        if(c.offset < 0)
+        {
+            if(!insert) return NULL;
+            c.x = x;
+            c.y = y;
+            c.offset = c.count = 0;
+            return &c;
+        }
+        if(c.x == x && c.y == y) return &c;
     }
-    return dec.dynents;
 }
 
-#define loopdynentcache(curx, cury, o, radius) \
-    for(int curx = max(int(o.x-radius), 0)>>dynentsize, endx = min(int(o.x+radius), worldsize-1)>>dynentsize; curx <= endx; curx++) \
-    for(int cury = max(int(o.y-radius), 0)>>dynentsize, endy = min(int(o.y+radius), worldsize-1)>>dynentsize; cury <= endy; cury++)
+static void builddynentgrid()
+{
+    dynentgridvalid = true;
+    dynentgrid.setsize(0);
+    dynentmoved.setsize(0);
+    dynentresults.setsize(0);
+    dynentmaxradius = 0;
+
+    int numdyns = physbench ? benchents.length() : game::numdynents();
+    loopi(numdyns)
+    {
+        dynent *d = physbench ? benchents[i] : game::iterdynents(i);
+        if(d->state != CS_ALIVE) continue;
+        dynentresults.add(d);
+        dynentmaxradius = max(dynentmaxradius, d->radius);
+    }
+
+    int size = 64;
+    while(size < 2*dynentresults.length()) size *= 2;
+    dynentcells.setsize(0);
+    dynentcell *cells = dynentcells.pad(size);
+    loopi(size) cells[i].offset = -1;
+
+    dynentslots.setsize(0);
+    loopv(dynentresults)
+    {
+        physent *d = dynentresults[i];
+        dynentcell *c = finddynentcell(dynentcoord(d->o.x), dynentcoord(d->o.y), true);
+        c->count++;
+        dynentslots.add(int(c - cells));
+    }
+    int offset = 0;
+    loopi(size) if(cells[i].offset >= 0)
+    {
+        cells[i].offset = offset;
+        offset += cells[i].count;
+        cells[i].count = 0;
+    }
+    physent **grid = dynentgrid.pad(offset);
+    loopv(dynentresults)
+    {
+        dynentcell &c = cells[dynentslots[i]];
+        grid[c.offset + c.count++] = dynentresults[i];
+    }
+}
 
 void updatedynentcache(physent *d)
 {
-    loopdynentcache(x, y, d->o, d->radius)
+    if(!dynentgridvalid || dynentmoved.find(d) >= 0) return;
+    dynentmaxradius = max(dynentmaxradius, d->radius);
+    dynentcell *c = finddynentcell(dynentcoord(d->o.x), dynentcoord(d->o.y));
+    if(c) for(int i = c->offset, end = c->offset + c->count; i < end; i++) if(dynentgrid[i] == d) return;
+    // crossing a cell is rare enough that finding the old slot by brute force is cheaper than tracking it
+    loopv(dynentgrid) if(dynentgrid[i] == d) { dynentgrid[i] = NULL; break; }
+    dynentmoved.add(d);
+    if(dynentmoved.length() > 32 + dynentgrid.length()/4) dynentgridvalid = false;
+}
+
+static inline bool overlapsdynent(physent *d, const vec &o, float radius)
+{
+    return d->state == CS_ALIVE &&
+           d->o.x+d->radius > o.x-radius && d->o.x-d->radius < o.x+radius &&
+           d->o.y+d->radius > o.y-radius && d->o.y-d->radius < o.y+radius;
+}
+
+// gathers the dynents whose bounds overlap the square around o; the result is only valid until the next call
+const vector<physent *> &finddynents(const vec &o, float radius)
+{
+    if(!dynentgridvalid) builddynentgrid();
+    dynentresults.setsize(0);
+    float r = radius + dynentmaxradius;
+    int x1 = dynentcoord(o.x-r), x2 = dynentcoord(o.x+r), y1 = dynentcoord(o.y-r), y2 = dynentcoord(o.y+r);
+    for(int x = x1; x <= x2; x++) for(int y = y1; y <= y2; y++)
     {
-        dynentcacheentry &dec = dynentcache[DYNENTHASH(x, y)];
-        if(dec.x != x || dec.y != y || dec.frame != dynentframe || dec.dynents.find(d) >= 0) continue;
-        dec.dynents.add(d);
+        dynentcell *c = finddynentcell(x, y);
+        if(c) for(int i = c->offset, end = c->offset + c->count; i < end; i++)
+        {
+            physent *d = dynentgrid[i];
+            if(d && overlapsdynent(d, o, radius)) dynentresults.add(d);
+        }
     }
+    loopv(dynentmoved) if(overlapsdynent(dynentmoved[i], o, radius)) dynentresults.add(dynentmoved[i]);
+    return dynentresults;
 }
 
 bool overlapsdynent(const vec &o, float radius)
 {
-    loopdynentcache(x, y, o, radius)
+    const vector<physent *> &dynents = finddynents(o, radius);
+    loopv(dynents)
     {
-        const vector<physent *> &dynents = checkdynentcache(x, y);
-        loopv(dynents)
-        {
-            physent *d = dynents[i];
-            if(o.dist(d->o)-d->radius < radius) return true;
-        }
+        physent *d = dynents[i];
+        if(o.dist(d->o)-d->radius < radius) return true;
     }
     return false;
 }
@@ -622,30 +830,27 @@ bool plcollide(physent *d, const vec &dir, bool insideplayercol)    // collide w
     if(d->type==ENT_CAMERA || d->state!=CS_ALIVE) return false;
     int lastinside = collideinside;
     physent *insideplayer = NULL;
-    loopdynentcache(x, y, d->o, d->radius)
-    {
-        const vector<physent *> &dynents = checkdynentcache(x, y);
-        loopv(dynents)
-        {
-            physent *o = dynents[i];
-            if(o==d || d->o.reject(o->o, d->radius+o->radius)) continue;
-            if(plcollide(d, dir, o))
-            {   
-                collideplayer = o;
-                game::dynentcollide(d, o, collidewall);
-                return true;
-            }
-            if(collideinside > lastinside)
-            {   
-                lastinside = collideinside;
-                insideplayer = o;
-            }
+    const vector<physent *> &dynents = finddynents(d->o, d->radius);
+    loopv(dynents)
+    {
+        physent *o = dynents[i];
+        if(o==d || d->o.reject(o->o, d->radius+o->radius)) continue;
+        if(plcollide(d, dir, o))
+        {   
+            collideplayer = o;
+            if(!physbench) game::dynentcollide(d, o, collidewall);
+            return true;
+        }
+        if(collideinside > lastinside)
+        {   
+            lastinside = collideinside;
+            insideplayer = o;
         }
     }
     if(insideplayer && insideplayercol)
     {
         collideplayer = insideplayer;
-        game::dynentcollide(d, insideplayer, vec(0, 0, 0));
+        if(!physbench) game::dynentcollide(d, insideplayer, vec(0, 0, 0));
         return true;
     }
     return false;
@@ -1330,7 +1535,7 @@ bool trystepdown(physent *d, vec &dir, float step, float xy, float z, bool init
 
 bool trystepdown(physent *d, vec &dir, bool init = false)
 {
-    if((!d->move && !d->strafe) || !game::allowmove(d)) return false;
+    if((!d->move && !d->strafe) || !allowmove(d)) return false;
     vec old(d->o);
     d->o.z -= STAIRHEIGHT;
     d->zmargin = -STAIRHEIGHT;
@@ -1732,10 +1937,10 @@ VAR(floatspeed, 1, 100, 10000);
 
 void modifyvelocity(physent *pl, bool local, bool water, bool floating, int curtime)
 {
-    bool allowmove = game::allowmove(pl);
+    bool canmove = allowmove(pl);
     if(floating)
     {
-        if(pl->jumping && allowmove)
+        if(pl->jumping && canmove)
         {
             pl->jumping = false;
             pl->vel.z = max(pl->vel.z, JUMPVEL);
@@ -1744,20 +1949,20 @@ void modifyvelocity(physent *pl, bool local, bool water, bool floating, int curt
     else if(pl->physstate >= PHYS_SLOPE || water)
     {
         if(water && !pl->inwater) pl->vel.div(8);
-        if(pl->jumping && allowmove)
+        if(pl->jumping && canmove)
         {
             pl->jumping = false;
 
             pl->vel.z = max(pl->vel.z, JUMPVEL); // physics impulse upwards
             if(water) { pl->vel.x /= 8.0f; pl->vel.y /= 8.0f; } // dampen velocity change even harder, gives correct water feel
 
-            game::physicstrigger(pl, local, 1, 0);
+            if(!physbench) game::physicstrigger(pl, local, 1, 0);
         }
     }
     if(!floating && pl->physstate == PHYS_FALL) pl->timeinair += curtime;
 
     vec m(0.0f, 0.0f, 0.0f);
-    if((pl->move || pl->strafe) && allowmove)
+    if((pl->move || pl->strafe) && canmove)
     {
         vecfromyawpitch(pl->yaw, floating || water || pl->type==ENT_CAMERA ? pl->pitch : 0, pl->move, pl->strafe, m);
 
@@ -1803,7 +2008,7 @@ void modifygravity(physent *pl, bool water, int curtime)
         g.normalize();
         g.mul(GRAVITY*secs);
     }
-    if(!water || !game::allowmove(pl) || (!pl->move && !pl->strafe)) pl->falling.add(g);
+    if(!water || !allowmove(pl) || (!pl->move && !pl->strafe)) pl->falling.add(g);
 
     if(water || pl->physstate >= PHYS_SLOPE)
     {
@@ -1859,7 +2064,8 @@ bool moveplayer(physent *pl, int moveres, bool local, int curtime)
 
         d.mul(f);
         loopi(moveres) if(!move(pl, d) && ++collisions<5) i--; // discrete steps collision detection & sliding
-        if(timeinair > 800 && !pl->timeinair && !water) // if we land after long time must have been a high jump, make thud sound
+        if(physbench) movecollisions += collisions;
+        if(timeinair > 800 && !pl->timeinair && !water && !physbench) // if we land after long time must have been a high jump, make thud sound
         {
             game::physicstrigger(pl, local, -1, 0);
         }
@@ -1879,11 +2085,18 @@ bool moveplayer(physent *pl, int moveres, bool local, int curtime)
         material = lookupmaterial(vec(pl->o.x, pl->o.y, pl->o.z + (pl->aboveeye - pl->eyeheight)/2));
         water = isliquid(material&MATF_VOLUME);
     }
-    if(!pl->inwater && water) game::physicstrigger(pl, local, 0, -1, material&MATF_VOLUME);
-    else if(pl->inwater && !water) game::physicstrigger(pl, local, 0, 1, pl->inwater);
+    if(!physbench)
+    {
+        if(!pl->inwater && water) game::physicstrigger(pl, local, 0, -1, material&MATF_VOLUME);
+        else if(pl->inwater && !water) game::physicstrigger(pl, local, 0, 1, pl->inwater);
+    }
     pl->inwater = water ? material&MATF_VOLUME : MAT_AIR;
 
-    if(pl->state==CS_ALIVE && (pl->o.z < 0 || material&MAT_DEATH)) game::suicide(pl);
+    if(pl->state==CS_ALIVE && (pl->o.z < 0 || material&MAT_DEATH))
+    {
+        if(physbench) pl->state = CS_DEAD;
+        else game::suicide(pl);
+    }
 
     return true;
 }
@@ -2039,3 +2252,123 @@ bool entinmap(dynent *d, bool avoidplayers)        // brute force but effective
     return false;
 }
 
+
+// benchphysics N TICKS [SEED]: spawns N bare players at the map's player starts and runs them through
+// moveplayer with scripted random inputs for TICKS physics frames, without touching the game state
+static uint benchrand(uint &seed)
+{
+    seed = seed*1103515245 + 12345;
+    return seed>>16;
+}
+
+void benchphysics(int *numents, int *numticks, int *seedp)
+{
+    if(!worldsize) { conoutf(CON_ERROR, "no map loaded"); return; }
+    int n = clamp(*numents, 1, 1024), ticks = max(*numticks, 1);
+    uint seed = *seedp ? uint(*seedp) : 1;
+
+    const vector<extentity *> &ents = entities::getents();
+    vector<int> starts;
+    loopv(ents) if(ents[i]->type == ET_PLAYERSTART) starts.add(i);
+
+    physbench = true;
+    cleardynentcache();
+    loopi(n)
+    {
+        dynent *d = new dynent;
+        if(starts.length()) findplayerspawn(d, starts[i%starts.length()]);
+        else { d->o = player->o; d->o.z -= player->eyeheight; entinmap(d, true); }
+        benchents.add(d);
+    }
+    vector<vec> spawns;
+    loopv(benchents) spawns.add(benchents[i]->o);
+
+    int calls = 0, respawns = 0;
+    movecollisions = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+    loopi(ticks)
+    {
+        cleardynentcache();
+        loopvj(benchents)
+        {
+            dynent *d = benchents[j];
+            if(d->state != CS_ALIVE)
+            {
+                d->reset();
+                d->o = spawns[j];
+                d->state = CS_ALIVE;
+                respawns++;
+            }
+            // change inputs roughly every half second
+            if(!(benchrand(seed)%(500/PHYSFRAMETIME)))
+            {
+                uint r = benchrand(seed);
+                d->move = int(r%3) - 1;
+                d->strafe = int((r>>2)%3) - 1;
+                d->yaw = (r>>4)%360;
+                d->jumping = (r>>13)%4 == 0;
+            }
+            moveplayer(d, 10, true, PHYSFRAMETIME);
+            calls++;
+        }
+    }
+    float millis = max((SDL_GetPerformanceCounter() - start)*1000.0f/SDL_GetPerformanceFrequency(), 1e-3f);
+
+    benchents.deletecontents();
+    physbench = false;
+    cleardynentcache();
+
+    conoutf("physics: %d ents, %d ticks, %d moves, %d collisions, %d respawns", n, ticks, calls, movecollisions, respawns);
+    conoutf("physics: %.2f ms, %.0f ns/move, %.0f collisions/s", millis, millis*1e6f/calls, movecollisions*1000.0f/millis);
+}
+COMMAND(benchphysics, "iii");
+
+// benchrays N [SPREAD] [SEED]: traces N packets of four line of sight rays fanning out from the player starts
+// by SPREAD degrees, once one ray at a time and once as packets, and compares throughput and results
+void benchrays(int *numpackets, float *spread, int *seedp)
+{
+    if(!worldsize) { conoutf(CON_ERROR, "no map loaded"); return; }
+    int n = clamp(*numpackets, 1, 1<<20)*4;
+    uint seed = *seedp ? uint(*seedp) : 1;
+    float fan = *spread > 0 ? *spread : 5;
+
+    const vector<extentity *> &ents = entities::getents();
+    vector<vec> starts;
+    loopv(ents) if(ents[i]->type == ET_PLAYERSTART) starts.add(vec(ents[i]->o).addz(14));
+    if(starts.empty()) starts.add(camera1->o);
+
+    vector<vec> o, dest;
+    for(int i = 0; i < n; i += 4)
+    {
+        const vec &src = starts[benchrand(seed)%starts.length()];
+        float yaw = benchrand(seed)%360, pitch = int(benchrand(seed)%60) - 30, len = 64 + benchrand(seed)%1024;
+        loopj(4)
+        {
+            vec dir;
+            vecfromyawpitch(yaw + (int(benchrand(seed)%1001) - 500)*fan/1000, pitch + (int(benchrand(seed)%1001) - 500)*fan/1000, 1, 0, dir);
+            o.add(src);
+            dest.add(vec(dir).mul(len).add(src));
+        }
+    }
+
+    vector<bool> scalar, packet;
+    scalar.pad(n);
+    packet.pad(n);
+    Uint64 start = SDL_GetPerformanceCounter();
+    loopi(n) { vec hitpos; scalar[i] = raycubelos(o[i], dest[i], hitpos); }
+    Uint64 mid = SDL_GetPerformanceCounter();
+    raycubelos(n, o.getbuf(), dest.getbuf(), packet.getbuf());
+    Uint64 end = SDL_GetPerformanceCounter();
+
+    float scalarmillis = max((mid - start)*1000.0f/SDL_GetPerformanceFrequency(), 1e-3f),
+          packetmillis = max((end - mid)*1000.0f/SDL_GetPerformanceFrequency(), 1e-3f);
+    int visible = 0, mismatched = 0;
+    loopi(n)
+    {
+        if(scalar[i]) visible++;
+        if(scalar[i] != packet[i]) mismatched++;
+    }
+    conoutf("rays: %d rays, %d visible, %d mismatched", n, visible, mismatched);
+    conoutf("rays: scalar %.2f ms (%.0f rays/s), packet %.2f ms (%.0f rays/s)", scalarmillis, n*1000.0f/scalarmillis, packetmillis, n*1000.0f/packetmillis);
+}
+COMMAND(benchrays, "ifi");
@@ -1236,6 +1236,14 @@ bool pvsoccludedsphere(const vec &center, float radius)
     return pvsoccluded(curpvs, bbmin, bbmax);
 }
 
+bool pvsoccludedfrom(const vec &viewer, const vec &center, float radius)
+{
+    pvsdata *d = usepvs ? lookupviewcell(viewer) : NULL;
+    if(!d) return false;
+    ivec bbmin(vec(center).sub(radius)), bbmax(vec(center).add(radius+1));
+    return pvsoccluded(&pvsbuf[d->offset + d->len%9], bbmin, bbmax);
+}
+
 bool waterpvsoccluded(int height)
 {
     if(!curwaterpvs) return false;
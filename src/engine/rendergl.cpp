@@ -1067,7 +1067,7 @@ struct timer
     bool gpu;
     GLuint query[MAXQUERY];
     int waiting;
-    uint starttime;
+    Uint64 starttime;
     float result, print;
 };
 static vector<timer> timers;
@@ -1107,7 +1107,7 @@ timer *begintimer(const char *name, bool gpu)
         glBeginQuery_(GL_TIME_ELAPSED_EXT, t->query[timercycle]);
         t->waiting |= 1<<timercycle;
     }
-    else t->starttime = getclockmillis();
+    else t->starttime = SDL_GetPerformanceCounter();
     return t;
 }
 
@@ -1119,7 +1119,7 @@ void endtimer(timer *t)
         glEndQuery_(GL_TIME_ELAPSED_EXT);
         deferquery--;
     }
-    else t->result = max(float(getclockmillis() - t->starttime), 0.0f);
+    else t->result = max(float(double(SDL_GetPerformanceCounter() - t->starttime) * 1000 / SDL_GetPerformanceFrequency()), 0.0f);
 }
 
 void synctimers()
@@ -2104,7 +2104,7 @@ void drawminimap()
     glEnable(GL_CULL_FACE);
     glEnable(GL_DEPTH_TEST);
 
-    xtravertsva = xtraverts = glde = gbatches = vtris = vverts = 0;
+    xtravertsva = xtraverts = glde = gbatches = gstates = vtris = vverts = 0;
     flipqueries();
 
     ldrscale = 1;
@@ -2200,7 +2200,7 @@ void drawcubemap(int size, const vec &o, float yaw, float pitch, const cubemapsi
     glEnable(GL_CULL_FACE);
     glEnable(GL_DEPTH_TEST);
 
-    xtravertsva = xtraverts = glde = gbatches = vtris = vverts = 0;
+    xtravertsva = xtraverts = glde = gbatches = gstates = vtris = vverts = 0;
     flipqueries();
 
     ldrscale = 1;
@@ -2801,7 +2801,7 @@ void gl_setupframe(bool force)
 void gl_drawframe()
 {
     synctimers();
-    xtravertsva = xtraverts = glde = gbatches = vtris = vverts = 0;
+    xtravertsva = xtraverts = glde = gbatches = gstates = vtris = vverts = 0;
     flipqueries();
     aspect = forceaspect ? forceaspect : hudw/float(hudh);
     fovy = 2*atan2(tan(curfov/2*RAD), aspect)/RAD;
@@ -1,5 +1,10 @@
 #include "engine/engine.h"
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define LIGHTCLUSTER_SSE
+#include <xmmintrin.h>
+#endif
+
 int gw = -1, gh = -1, bloomw = -1, bloomh = -1, lasthdraccum = 0;
 GLuint gfbo = 0, gdepthtex = 0, gcolortex = 0, gnormaltex = 0, gglowtex = 0, gdepthrb = 0, gstencilrb = 0;
 bool gdepthinit = false;
@@ -1664,17 +1669,24 @@ struct shadowcacheval;
 
 struct shadowmapinfo
 {
-    ushort x, y, size, sidemask;
+    ushort x, y, size, sidemask, staticmask;
     int light;
     shadowcacheval *cached;
+    uint dynsig[6];
 };
 
+// staticmask marks the sides whose world and static mapmodel depth is kept in the static atlas, and dynsig
+// identifies the dynamic models that were drawn into each side
 struct shadowcacheval
 {
-    ushort x, y, size, sidemask;
+    ushort x, y, size, sidemask, staticmask;
+    uint dynsig[6];
 
     shadowcacheval() {}
-    shadowcacheval(const shadowmapinfo &sm) : x(sm.x), y(sm.y), size(sm.size), sidemask(sm.sidemask) {}
+    shadowcacheval(const shadowmapinfo &sm) : x(sm.x), y(sm.y), size(sm.size), sidemask(sm.sidemask), staticmask(sm.staticmask)
+    {
+        memcpy(dynsig, sm.dynsig, sizeof(dynsig));
+    }
 };
 
 struct shadowcache : hashtable<shadowcachekey, shadowcacheval>
@@ -1687,11 +1699,11 @@ struct shadowcache : hashtable<shadowcachekey, shadowcacheval>
     }
 };
 
-extern int smcache, smfilter, smgather;
+extern int smcache, smstaticcache, smfilter, smgather;
 
 #define SHADOWCACHE_EVICT 2
 
-GLuint shadowatlastex = 0, shadowatlasfbo = 0;
+GLuint shadowatlastex = 0, shadowatlasfbo = 0, shadowstatictex = 0, shadowstaticfbo = 0;
 GLenum shadowatlastarget = GL_NONE;
 shadowcache shadowcache;
 bool shadowcachefull = false;
@@ -1760,6 +1772,28 @@ void setupshadowatlas()
     if(glCheckFramebufferStatus_(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
         fatal("failed allocating shadow atlas!");
 
+    if(smcache && smstaticcache)
+    {
+        if(!shadowstatictex) glGenTextures(1, &shadowstatictex);
+        createtexture(shadowstatictex, shadowatlaspacker.w, shadowatlaspacker.h, NULL, 3, 1, smdepthprec > 1 ? GL_DEPTH_COMPONENT32 : (smdepthprec ? GL_DEPTH_COMPONENT24 : GL_DEPTH_COMPONENT16), shadowatlastarget);
+
+        if(!shadowstaticfbo) glGenFramebuffers_(1, &shadowstaticfbo);
+
+        glBindFramebuffer_(GL_FRAMEBUFFER, shadowstaticfbo);
+
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+
+        glFramebufferTexture2D_(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadowatlastarget, shadowstatictex, 0);
+
+        if(glCheckFramebufferStatus_(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            conoutf(CON_WARN, "failed allocating static shadow atlas");
+            glDeleteFramebuffers_(1, &shadowstaticfbo);
+            shadowstaticfbo = 0;
+        }
+    }
+
     glBindFramebuffer_(GL_FRAMEBUFFER, 0);
 }
 
@@ -1767,6 +1801,8 @@ void cleanupshadowatlas()
 {
     if(shadowatlastex) { glDeleteTextures(1, &shadowatlastex); shadowatlastex = 0; }
     if(shadowatlasfbo) { glDeleteFramebuffers_(1, &shadowatlasfbo); shadowatlasfbo = 0; }
+    if(shadowstatictex) { glDeleteTextures(1, &shadowstatictex); shadowstatictex = 0; }
+    if(shadowstaticfbo) { glDeleteFramebuffers_(1, &shadowstaticfbo); shadowstaticfbo = 0; }
     clearshadowcache();
 }
 
@@ -1805,6 +1841,10 @@ VAR(smused, 1, 0, 0);
 VAR(smquery, 0, 1, 1);
 VARF(smcullside, 0, 1, 1, cleanupshadowatlas());
 VARF(smcache, 0, 1, 2, cleanupshadowatlas());
+VARF(smstaticcache, 0, 1, 1, cleanupshadowatlas());
+VAR(smcachehits, 1, 0, 0);
+VAR(smcachestatic, 1, 0, 0);
+VAR(smcachemisses, 1, 0, 0);
 VARFP(smfilter, 0, 2, 3, { cleardeferredlightshaders(); cleanupshadowatlas(); cleanupvolumetric(); });
 VARFP(smgather, 0, 0, 1, { cleardeferredlightshaders(); cleanupshadowatlas(); cleanupvolumetric(); });
 VAR(smnoshadow, 0, 0, 1);
@@ -1937,7 +1977,9 @@ static shadowmapinfo *addshadowmap(ushort x, ushort y, int size, int &idx, int l
     sm->size = size;
     sm->light = light;
     sm->sidemask = 0;
+    sm->staticmask = cached ? cached->staticmask : 0;
     sm->cached = cached;
+    memset(sm->dynsig, 0, sizeof(sm->dynsig));
     return sm;
 }
 
@@ -3442,6 +3484,8 @@ void collectlights()
 {
     if(lights.length()) return;
 
+    smcachehits = smcachestatic = smcachemisses = 0;
+
     // point lights processed here
     const vector<extentity *> &ents = entities::getents();
     if(!editmode || !fullbright) loopv(ents)
@@ -3685,6 +3729,168 @@ static void batchlights()
     lightbatchesused = lightbatches.length();
 }
 
+// clustered light culling: the light tiles are split into exponential depth slices and every light is
+// tested against the view space bounds of the clusters under its scissor, one slice per worker job,
+// so that its batch rect only covers tiles where it can actually reach some geometry
+enum { MAXLIGHTCLUSTERSLICES = 32 };
+
+VAR(lightclusters, 0, 1, 1);
+VAR(lightclusterslices, 1, 16, MAXLIGHTCLUSTERSLICES);
+VARN(lightclusterrefs, lightclusterrefsused, 1, 0, 0);
+VARN(lightclusterculled, lightclustercullused, 1, 0, 0);
+
+struct lightclusterslice
+{
+    float zmin, zmax;
+    int refs;
+    vector<lightrect> bounds;
+};
+
+struct clusterlight
+{
+    vec o;
+    float radius;
+    lightrect rect;
+};
+
+static lightclusterslice clusterslices[MAXLIGHTCLUSTERSLICES];
+static vector<clusterlight> clusterlights;
+static float clustertilex[LIGHTTILE_MAXW+1], clustertiley[LIGHTTILE_MAXH+1], clusterscalex = 0, clusterscaley = 0;
+
+static void calcclusterbounds(const float *edges, int n, float border, float d0, float d1, float scale, float *minv, float *maxv, int pad)
+{
+    loopi(n)
+    {
+        float e0 = edges[i] - border, e1 = edges[i+1] + border;
+        minv[i] = min(e0*d0, e0*d1)*scale;
+        maxv[i] = max(e1*d0, e1*d1)*scale;
+    }
+    for(int i = n; i < pad; i++) { minv[i] = 1e16f; maxv[i] = -1e16f; }
+}
+
+static inline uint clusterrowmask(const float *xmin, const float *xmax, int x1, int x2, float cx, float r2)
+{
+    uint mask = 0;
+#ifdef LIGHTCLUSTER_SSE
+    __m128 c = _mm_set1_ps(cx), rr = _mm_set1_ps(r2), zero = _mm_setzero_ps();
+    for(int x = x1&~3; x < x2; x += 4)
+    {
+        __m128 dx = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&xmin[x]), c), zero), _mm_max_ps(_mm_sub_ps(c, _mm_loadu_ps(&xmax[x])), zero));
+        mask |= uint(_mm_movemask_ps(_mm_cmple_ps(_mm_mul_ps(dx, dx), rr))) << x;
+    }
+#else
+    for(int x = x1; x < x2; x++)
+    {
+        float dx = max(xmin[x] - cx, 0.0f) + max(cx - xmax[x], 0.0f);
+        if(dx*dx <= r2) mask |= 1<<x;
+    }
+#endif
+    return mask & ((1<<x2) - (1<<x1));
+}
+
+static void buildlightcluster(int job, int thread, void *data)
+{
+    lightclusterslice &s = clusterslices[job];
+    float xmin[LIGHTTILE_MAXW], xmax[LIGHTTILE_MAXW], ymin[LIGHTTILE_MAXH], ymax[LIGHTTILE_MAXH];
+    calcclusterbounds(clustertilex, lighttilew, 2.0f/vieww, s.zmin, s.zmax, clusterscalex, xmin, xmax, LIGHTTILE_MAXW);
+    calcclusterbounds(clustertiley, lighttileh, 2.0f/viewh, s.zmin, s.zmax, clusterscaley, ymin, ymax, LIGHTTILE_MAXH);
+
+    s.refs = 0;
+    s.bounds.setsize(0);
+    loopv(clusterlights)
+    {
+        const clusterlight &l = clusterlights[i];
+        lightrect &b = s.bounds.add(lightrect(LIGHTTILE_MAXW, LIGHTTILE_MAXH, 0, 0));
+        float dz = max(s.zmin - l.o.z, 0.0f) + max(l.o.z - s.zmax, 0.0f), rz = l.radius*l.radius - dz*dz;
+        if(rz < 0) continue;
+        for(int y = l.rect.y1; y < l.rect.y2; y++)
+        {
+            float dy = max(ymin[y] - l.o.y, 0.0f) + max(l.o.y - ymax[y], 0.0f), ryz = rz - dy*dy;
+            if(ryz < 0) continue;
+            uint mask = clusterrowmask(xmin, xmax, l.rect.x1, l.rect.x2, l.o.x, ryz);
+            if(!mask) continue;
+            b.y1 = min(b.y1, uchar(y));
+            b.y2 = y+1;
+            for(int x = l.rect.x1; x < l.rect.x2; x++) if(mask&(1<<x))
+            {
+                b.x1 = min(b.x1, uchar(x));
+                b.x2 = max(b.x2, uchar(x+1));
+                s.refs++;
+            }
+        }
+    }
+}
+
+// shrinks each light's tile rect to the clusters it actually touches and drops lights that touch none
+static void assignlightclusters()
+{
+    lightclusterrefsused = lightclustercullused = 0;
+    if(!lightclusters || drawtex || batchrects.empty()) return;
+
+    clusterscalex = aspect*tan(fovy*0.5f*RAD);
+    clusterscaley = tan(fovy*0.5f*RAD);
+    // tile edges match those used by lightquads and get padded by a pixel to stay conservative
+    loopi(lighttilew+1) clustertilex[i] = min(((i*lighttilevieww)/lighttilew)*lighttilealignw, vieww)*2.0f/vieww - 1;
+    loopi(lighttileh+1) clustertiley[i] = min(((i*lighttileviewh)/lighttileh)*lighttilealignh, viewh)*2.0f/viewh - 1;
+    clustertilex[lighttilew] = clustertiley[lighttileh] = 1e16f;
+    clustertilex[0] = clustertiley[0] = -1e16f;
+
+    float clusternear = nearplane, clusterfar = clusternear;
+    clusterlights.setsize(0);
+    loopv(batchrects)
+    {
+        const batchrect &r = batchrects[i];
+        const lightinfo &l = lights[lightorder[r.idx]];
+        clusterlight &c = clusterlights.add();
+        cammatrix.transform(l.o, c.o);
+        c.o.z = -c.o.z;
+        c.radius = l.radius;
+        c.rect = r;
+        clusterfar = max(clusterfar, c.o.z + c.radius);
+    }
+    clusterfar = min(clusterfar, float(farplane));
+    if(clusterfar <= clusternear) return;
+
+    int numclusterslices = lightclusterslices;
+    float ratio = clusterfar/clusternear;
+    loopi(numclusterslices)
+    {
+        lightclusterslice &s = clusterslices[i];
+        s.zmin = i ? clusternear*pow(ratio, float(i)/numclusterslices) : 0;
+        s.zmax = i+1 < numclusterslices ? clusternear*pow(ratio, float(i+1)/numclusterslices) : 1e16f;
+    }
+    runworkers(numclusterslices, buildlightcluster, NULL);
+
+    int numrects = 0;
+    loopv(batchrects)
+    {
+        lightrect b(LIGHTTILE_MAXW, LIGHTTILE_MAXH, 0, 0);
+        loopj(numclusterslices)
+        {
+            const lightrect &sb = clusterslices[j].bounds[i];
+            b.x1 = min(b.x1, sb.x1); b.y1 = min(b.y1, sb.y1);
+            b.x2 = max(b.x2, sb.x2); b.y2 = max(b.y2, sb.y2);
+        }
+        b.intersect(batchrects[i]);
+        if(b.x1 >= b.x2 || b.y1 >= b.y2)
+        {
+            lightinfo &l = lights[lightorder[batchrects[i].idx]];
+            if(l.shadowmap >= 0)
+            {
+                shadowmaps[l.shadowmap].light = -1;
+                l.shadowmap = -1;
+            }
+            lightclustercullused++;
+            continue;
+        }
+        batchrect &r = batchrects[numrects++];
+        r = batchrects[i];
+        (lightrect &)r = b;
+    }
+    batchrects.setsize(numrects);
+    loopi(numclusterslices) lightclusterrefsused += clusterslices[i].refs;
+}
+
 void packlights()
 {
     lightsvisible = lightsoccluded = 0;
@@ -3730,6 +3936,7 @@ void packlights()
 
     lightsvisible = lightorder.length() - lightsoccluded;
 
+    assignlightclusters();
     batchlights();
 }
 
@@ -4162,8 +4369,9 @@ void renderradiancehints()
     shadowbias = rsm.lightview.project_bb(worldmin, worldmax);
     shadowradius = fabs(rsm.lightview.project_bb(worldmax, worldmin));
 
-    findshadowvas();
-    findshadowmms();
+    timer *cullcputimer = begintimer("rsm shadow cull", false);
+    findshadowcasters();
+    endtimer(cullcputimer);
 
     shadowmaskbatchedmodels(false);
     batchshadowmapmodels();
@@ -4244,8 +4452,9 @@ void rendercsmshadowmaps()
 
     glEnable(GL_SCISSOR_TEST);
 
-    findshadowvas();
-    findshadowmms();
+    timer *cullcputimer = begintimer("csm shadow cull", false);
+    findshadowcasters();
+    endtimer(cullcputimer);
 
     shadowmaskbatchedmodels(smdynshadow!=0);
     batchshadowmapmodels();
@@ -4320,6 +4529,35 @@ int calcshadowinfo(const extentity &e, vec &origin, float &radius, vec &spotloc,
 
 matrix4 shadowmatrix;
 
+static void copyshadowstatic(int x, int y, int size, bool save)
+{
+    glBindFramebuffer_(GL_READ_FRAMEBUFFER, save ? shadowatlasfbo : shadowstaticfbo);
+    glBindFramebuffer_(GL_DRAW_FRAMEBUFFER, save ? shadowstaticfbo : shadowatlasfbo);
+    glBlitFramebuffer_(x, y, x + size, y + size, x, y, x + size, y + size, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer_(GL_FRAMEBUFFER, shadowatlasfbo);
+}
+
+// a side whose world and static mapmodel depth is still in the static atlas only has it copied back before the
+// dynamic models are drawn over it, otherwise it is drawn in full and a copy of the static part is kept
+static void rendershadowside(shadowmapinfo &sm, shadowmesh *mesh, int x, int y)
+{
+    if(shadowstaticfbo && sm.staticmask&(1<<shadowside))
+    {
+        copyshadowstatic(x, y, sm.size, false);
+        smcachestatic++;
+    }
+    else
+    {
+        if(mesh) rendershadowmesh(mesh); else rendershadowmapworld();
+        smcachemisses++;
+        if(!shadowstaticfbo) { rendershadowmodelbatches(); return; }
+        rendershadowmodelbatches(false);
+        copyshadowstatic(x, y, sm.size, true);
+        sm.staticmask |= 1<<shadowside;
+    }
+    rendershadowmodelbatches(true, false);
+}
+
 void rendershadowmaps(int offset = 0)
 {
     if(!(sminoq && !debugshadowatlas && !inoq && shouldworkinoq())) offset = 0;
@@ -4343,13 +4581,37 @@ void rendershadowmaps(int offset = 0)
 
     glEnable(GL_SCISSOR_TEST);
 
+    timer *cullcputimer = begintimer("light shadow cull", false);
+    static vector<shadowcull> culls;
+    int numculls = 0;
+    for(int i = offset; i < shadowmaps.length(); i++)
+    {
+        const shadowmapinfo &sm = shadowmaps[i];
+        if(sm.light < 0) continue;
+
+        const lightinfo &l = lights[sm.light];
+        if(culls.length() <= numculls) culls.add();
+        shadowcull &sc = culls[numculls++];
+        int border = l.spot ? 0 : (smfilter > 2 ? smborder2 : smborder);
+        sc.mapping = l.spot ? SM_SPOT : SM_CUBEMAP;
+        sc.origin = l.o;
+        sc.dir = l.dir;
+        sc.radius = l.radius;
+        sc.bias = border / float(sm.size - border);
+        sc.spot = l.spot;
+    }
+    findshadowcasters(culls.getbuf(), numculls);
+    endtimer(cullcputimer);
+
     const vector<extentity *> &ents = entities::getents();
+    numculls = 0;
     for(int i = offset; i < shadowmaps.length(); i++)
     {
         shadowmapinfo &sm = shadowmaps[i];
         if(sm.light < 0) continue;
 
         lightinfo &l = lights[sm.light];
+        shadowcull &sc = culls[numculls++];
         extentity *e = l.ent >= 0 ? ents[l.ent] : NULL;
 
         int border, sidemask;
@@ -4376,8 +4638,7 @@ void rendershadowmaps(int offset = 0)
 
         shadowmesh *mesh = e ? findshadowmesh(l.ent, *e) : NULL;
 
-        findshadowvas();
-        findshadowmms();
+        useshadowcasters(sc);
 
         shadowmaskbatchedmodels(!(l.flags&L_NODYNSHADOW) && smdynshadow);
         batchshadowmapmodels(mesh != NULL);
@@ -4387,15 +4648,17 @@ void rendershadowmaps(int offset = 0)
         if(smcache)
         {
             int dynmask = smcache <= 1 ? batcheddynamicmodels() : 0;
+            if(dynmask) batcheddynamicmodelsigs(sm.dynsig, l.spot ? 1 : 6);
             cached = sm.cached;
             if(cached)
             {
-                if(!debugshadowatlas) cachemask = cached->sidemask & ~dynmask;
+                // a cached side only has to be redrawn once the dynamic models that fall into it have changed
+                if(!debugshadowatlas) loopk(6) if(cached->sidemask&(1<<k) && cached->dynsig[k] == sm.dynsig[k]) cachemask |= 1<<k;
                 sm.sidemask |= cachemask;
             }
-            sm.sidemask &= ~dynmask;
 
             sidemask &= ~cachemask;
+            loopk(6) if(cachemask&(1<<k)) smcachehits++;
             if(!sidemask) { clearbatchedmapmodels(); continue; }
         }
 
@@ -4421,8 +4684,7 @@ void rendershadowmaps(int offset = 0)
 
             shadowside = 0;
 
-            if(mesh) rendershadowmesh(mesh); else rendershadowmapworld();
-            rendershadowmodelbatches();
+            rendershadowside(sm, mesh, sm.x, sm.y);
         }
         else
         {
@@ -4452,8 +4714,7 @@ void rendershadowmaps(int offset = 0)
 
                 shadowside = side;
 
-                if(mesh) rendershadowmesh(mesh); else rendershadowmapworld();
-                rendershadowmodelbatches();
+                rendershadowside(sm, mesh, sm.x + sidex, sm.y + sidey);
             }
         }
 
@@ -641,6 +641,39 @@ int batcheddynamicmodels()
     return visible;
 }
 
+static inline void dynamicmodelsig(uint &sig, uint val) { sig = sig*31 + val; }
+static inline void dynamicmodelsig(uint &sig, float val) { uint bits; memcpy(&bits, &val, sizeof(bits)); dynamicmodelsig(sig, bits); }
+
+// identifies the dynamic models falling into each shadow side by their placement and animation, so a cached
+// side can tell whether they changed; animated models are posed by the current time and so always differ
+void batcheddynamicmodelsigs(uint *sigs, int numsides)
+{
+    loopi(numsides) sigs[i] = 0;
+    loopv(batches)
+    {
+        modelbatch &b = batches[i];
+        bool animated = b.m->animated();
+        if(b.flags&MDL_MAPMODEL && !animated) continue;
+        for(int j = b.batched; j >= 0;)
+        {
+            batchedmodel &bm = batchedmodels[j];
+            j = bm.next;
+            if(!(bm.visible&((1<<numsides)-1))) continue;
+            uint sig = uint(size_t(b.m));
+            loopk(3) dynamicmodelsig(sig, bm.pos[k]);
+            dynamicmodelsig(sig, bm.yaw);
+            dynamicmodelsig(sig, bm.pitch);
+            dynamicmodelsig(sig, bm.roll);
+            dynamicmodelsig(sig, bm.sizescale);
+            dynamicmodelsig(sig, uint(bm.anim));
+            dynamicmodelsig(sig, uint(bm.basetime));
+            dynamicmodelsig(sig, uint(bm.basetime2));
+            if(animated) dynamicmodelsig(sig, uint(lastmillis));
+            loopk(numsides) if(bm.visible&(1<<k)) dynamicmodelsig(sigs[k], sig);
+        }
+    }
+}
+
 int batcheddynamicmodelbounds(int mask, vec &bbmin, vec &bbmax)
 {
     int vis = 0;
@@ -674,12 +707,14 @@ int batcheddynamicmodelbounds(int mask, vec &bbmin, vec &bbmax)
     return vis;
 }
 
-void rendershadowmodelbatches(bool dynmodel)
+void rendershadowmodelbatches(bool dynmodel, bool statmodel)
 {
     loopv(batches)
     {
         modelbatch &b = batches[i];
-        if(!b.m->shadow || (!dynmodel && (!(b.flags&MDL_MAPMODEL) || b.m->animated()))) continue;
+        if(!b.m->shadow) continue;
+        bool dynamic = !(b.flags&MDL_MAPMODEL) || b.m->animated();
+        if(dynamic ? !dynmodel : !statmodel) continue;
         bool rendered = false;
         for(int j = b.batched; j >= 0;)
         {
@@ -2,6 +2,11 @@
 
 #include "engine/engine.h"
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define VACULL_SSE
+#include <xmmintrin.h>
+#endif
+
 static inline void drawtris(GLsizei numindices, const GLvoid *indices, ushort minvert, ushort maxvert)
 {
     glDrawRangeElements_(GL_TRIANGLES, minvert, maxvert, numindices, GL_UNSIGNED_SHORT, indices);
@@ -146,14 +151,84 @@ void sortvisiblevas()
     }
 }
 
+// va cube bounds laid out in blocks of 4 so a whole block can be tested against the frustum at once,
+// with every children list starting on its own block
+struct vacullblock
+{
+    float x[4], y[4], z[4], size[4];
+};
+
+static vector<vacullblock> vacull;
+static bool vacullvalid = false;
+
+void clearvacull()
+{
+    vacullvalid = false;
+}
+
+static int addvacull(vector<vtxarray *> &vas)
+{
+    int start = vacull.length()*4, numblocks = (vas.length() + 3)/4;
+    memset(vacull.pad(numblocks), 0, numblocks*sizeof(vacullblock));
+    loopv(vas)
+    {
+        vtxarray &v = *vas[i];
+        vacullblock &b = vacull[(start + i)/4];
+        int k = i&3;
+        b.x[k] = v.o.x;
+        b.y[k] = v.o.y;
+        b.z[k] = v.o.z;
+        b.size[k] = v.size;
+    }
+    loopv(vas)
+    {
+        vtxarray &v = *vas[i];
+        v.cullchildren = v.children.length() ? addvacull(v.children) : 0;
+    }
+    return start;
+}
+
+static void genvacull()
+{
+    vacull.setsize(0);
+    addvacull(varoot);
+    vacullvalid = true;
+}
+
+// same result as isvisiblecube() for the n <= 4 cubes of a block
+static void cullvablock(const vacullblock &b, int n, uchar *vfc)
+{
+#ifdef VACULL_SSE
+    __m128 x = _mm_loadu_ps(b.x), y = _mm_loadu_ps(b.y), z = _mm_loadu_ps(b.z), size = _mm_loadu_ps(b.size),
+           hidden = _mm_setzero_ps(), part = _mm_setzero_ps(), dist = _mm_setzero_ps();
+    loopi(5)
+    {
+        const plane &p = vfcP[i];
+        dist = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(p.x)), _mm_mul_ps(y, _mm_set1_ps(p.y))),
+                                     _mm_mul_ps(z, _mm_set1_ps(p.z))), _mm_set1_ps(p.offset));
+        hidden = _mm_or_ps(hidden, _mm_cmplt_ps(dist, _mm_mul_ps(size, _mm_set1_ps(-vfcDfar[i]))));
+        part = _mm_or_ps(part, _mm_cmplt_ps(dist, _mm_mul_ps(size, _mm_set1_ps(-vfcDnear[i]))));
+    }
+    dist = _mm_sub_ps(dist, _mm_set1_ps(vfcDfog));
+    __m128 fogged = _mm_cmpgt_ps(dist, _mm_mul_ps(size, _mm_set1_ps(-vfcDnear[4])));
+    part = _mm_or_ps(part, _mm_cmpgt_ps(dist, _mm_mul_ps(size, _mm_set1_ps(-vfcDfar[4]))));
+    int hiddenmask = _mm_movemask_ps(hidden), foggedmask = _mm_movemask_ps(fogged), partmask = _mm_movemask_ps(part);
+    loopi(n) vfc[i] = hiddenmask&(1<<i) ? VFC_NOT_VISIBLE : (foggedmask&(1<<i) ? VFC_FOGGED : (partmask&(1<<i) ? VFC_PART_VISIBLE : VFC_FULL_VISIBLE));
+#else
+    loopi(n) vfc[i] = isvisiblecube(ivec(int(b.x[i]), int(b.y[i]), int(b.z[i])), int(b.size[i]));
+#endif
+}
+
 template<bool fullvis, bool resetocclude>
-static inline void findvisiblevas(vector<vtxarray *> &vas)
+static inline void findvisiblevas(vector<vtxarray *> &vas, int cull)
 {
+    uchar vfc[4];
     loopv(vas)
     {
         vtxarray &v = *vas[i];
         int prevvfc = v.curvfc;
-        v.curvfc = fullvis ? VFC_FULL_VISIBLE : isvisiblecube(v.o, v.size);
+        if(!fullvis && !(i&3)) cullvablock(vacull[(cull + i)/4], min(vas.length() - i, 4), vfc);
+        v.curvfc = fullvis ? VFC_FULL_VISIBLE : vfc[i&3];
         if(v.curvfc != VFC_NOT_VISIBLE)
         {
             if(pvsoccluded(v.o, v.size))
@@ -172,11 +247,11 @@ static inline void findvisiblevas(vector<vtxarray *> &vas)
             {
                 if(fullvis || v.curvfc == VFC_FULL_VISIBLE)
                 {
-                    if(resetchildren) findvisiblevas<true, true>(v.children);
-                    else findvisiblevas<true, false>(v.children);
+                    if(resetchildren) findvisiblevas<true, true>(v.children, v.cullchildren);
+                    else findvisiblevas<true, false>(v.children, v.cullchildren);
                 }
-                else if(resetchildren) findvisiblevas<false, true>(v.children);
-                else findvisiblevas<false, false>(v.children);
+                else if(resetchildren) findvisiblevas<false, true>(v.children, v.cullchildren);
+                else findvisiblevas<false, false>(v.children, v.cullchildren);
             }
         }
     }
@@ -184,8 +259,9 @@ static inline void findvisiblevas(vector<vtxarray *> &vas)
 
 void findvisiblevas()
 {
+    if(!vacullvalid) genvacull();
     memset(vasort, 0, sizeof(vasort));
-    findvisiblevas<false, false>(varoot);
+    findvisiblevas<false, false>(varoot, 0);
     sortvisiblevas();
 }
 
@@ -226,17 +302,34 @@ void restorevfcP()
     calcvfcD();
 }
 
+struct cullframe
+{
+    plane p[5];
+    float fog;
+};
+
+static vector<cullframe> cullpath;
+static bool recordingcull = false;
+
 void visiblecubes(bool cull)
 {
     if(cull)
     {
         setvfcP();
+        if(recordingcull)
+        {
+            cullframe &f = cullpath.add();
+            memcpy(f.p, vfcP, sizeof(vfcP));
+            f.fog = vfcDfog;
+        }
         findvisiblevas();
+        swocclude();
     }
     else
     {
         memset(vfcP, 0, sizeof(vfcP));
         vfcDfog = farplane;
+        swoccluding = false;
         memset(vfcDnear, 0, sizeof(vfcDnear));
         memset(vfcDfar, 0, sizeof(vfcDfar));
         visibleva = NULL;
@@ -253,6 +346,109 @@ void visiblecubes(bool cull)
     }
 }
 
+ICOMMAND(recordcull, "i", (int *on),
+{
+    recordingcull = *on != 0;
+    if(recordingcull) cullpath.setsize(0);
+});
+
+ICOMMAND(savecull, "s", (char *name),
+{
+    defformatstring(fname, "%s.cull", name[0] ? name : "cullpath");
+    stream *f = openfile(path(fname), "wb");
+    if(!f) { conoutf(CON_ERROR, "could not write %s", fname); return; }
+    f->putlil<int>(cullpath.length());
+    loopv(cullpath)
+    {
+        const cullframe &c = cullpath[i];
+        loopj(5)
+        {
+            f->putlil<float>(c.p[j].x);
+            f->putlil<float>(c.p[j].y);
+            f->putlil<float>(c.p[j].z);
+            f->putlil<float>(c.p[j].offset);
+        }
+        f->putlil<float>(c.fog);
+    }
+    delete f;
+    conoutf("saved %d frames to %s", cullpath.length(), fname);
+});
+
+ICOMMAND(loadcull, "s", (char *name),
+{
+    defformatstring(fname, "%s.cull", name[0] ? name : "cullpath");
+    stream *f = openfile(path(fname), "rb");
+    if(!f) { conoutf(CON_ERROR, "could not read %s", fname); return; }
+    cullpath.setsize(0);
+    for(int n = f->getlil<int>(); n > 0 && !f->end(); n--)
+    {
+        cullframe &c = cullpath.add();
+        loopj(5)
+        {
+            c.p[j].x = f->getlil<float>();
+            c.p[j].y = f->getlil<float>();
+            c.p[j].z = f->getlil<float>();
+            c.p[j].offset = f->getlil<float>();
+        }
+        c.fog = f->getlil<float>();
+    }
+    delete f;
+    conoutf("loaded %d frames from %s", cullpath.length(), fname);
+});
+
+template<bool simd>
+static int countvisiblevas(vector<vtxarray *> &vas, int cull, int &culled)
+{
+    int tested = 0;
+    uchar vfc[4];
+    loopv(vas)
+    {
+        vtxarray &v = *vas[i];
+        int curvfc;
+        if(simd)
+        {
+            if(!(i&3)) cullvablock(vacull[(cull + i)/4], min(vas.length() - i, 4), vfc);
+            curvfc = vfc[i&3];
+        }
+        else curvfc = isvisiblecube(v.o, v.size);
+        tested++;
+        if(curvfc == VFC_NOT_VISIBLE) culled++;
+        else if(curvfc != VFC_FULL_VISIBLE && v.children.length()) tested += countvisiblevas<simd>(v.children, v.cullchildren, culled);
+    }
+    return tested;
+}
+
+// replays the recorded frustums against the current map with the scalar and the blocked culling tests
+void benchcull(int *iters)
+{
+    if(cullpath.empty()) { conoutf(CON_ERROR, "no frustums recorded (see recordcull)"); return; }
+    if(!vacullvalid) genvacull();
+    int n = max(*iters, 1), tested[2] = { 0, 0 }, culled[2] = { 0, 0 };
+    float millis[2];
+    plane oldP[5];
+    memcpy(oldP, vfcP, sizeof(vfcP));
+    float oldfog = vfcDfog;
+    loopk(2)
+    {
+        Uint64 start = SDL_GetPerformanceCounter();
+        loopi(n) loopvj(cullpath)
+        {
+            memcpy(vfcP, cullpath[j].p, sizeof(vfcP));
+            vfcDfog = cullpath[j].fog;
+            calcvfcD();
+            tested[k] += k ? countvisiblevas<true>(varoot, 0, culled[k]) : countvisiblevas<false>(varoot, 0, culled[k]);
+        }
+        millis[k] = max((SDL_GetPerformanceCounter() - start)*1000.0f/SDL_GetPerformanceFrequency(), 1e-3f);
+    }
+    memcpy(vfcP, oldP, sizeof(vfcP));
+    vfcDfog = oldfog;
+    calcvfcD();
+    if(culled[0] != culled[1]) conoutf(CON_WARN, "culling mismatch: scalar %d, blocked %d", culled[0], culled[1]);
+    conoutf("vfc: %d frames, %d vas tested, %d culled", n*cullpath.length(), tested[0], culled[0]);
+    conoutf("vfc: scalar %.2f ms (%.0f culled/ms), blocked %.2f ms (%.0f culled/ms)", millis[0], culled[0]/millis[0], millis[1], culled[1]/millis[1]);
+}
+COMMAND(benchcull, "i");
+
 ///////// occlusion queries /////////////
 
 #define MAXQUERY 2048
@@ -464,7 +660,7 @@ void findvisiblemms(const vector<extentity *> &ents, bool doquery)
     for(vtxarray *va = visibleva; va; va = va->next) if(va->occluded < OCCLUDE_BB && va->curvfc < VFC_FOGGED) loopv(va->mapmodels)
     {
         octaentities *oe = va->mapmodels[i];
-        if(isfoggedcube(oe->o, oe->size) || pvsoccluded(oe->bbmin, oe->bbmax)) continue;
+        if(isfoggedcube(oe->o, oe->size) || pvsoccluded(oe->bbmin, oe->bbmax) || swoccludedbb(oe->bbmin, oe->bbmax)) continue;
 
         bool occluded = doquery && oe->query && oe->query->owner == oe && checkquery(oe->query);
         if(occluded)
@@ -515,7 +711,7 @@ static inline void rendermapmodel(extentity &e)
 void rendermapmodels()
 {
     static int skipoq = 0;
-    bool doquery = !drawtex && oqfrags && oqmm;
+    bool doquery = !drawtex && oqfrags && oqmm && !swoccluding;
     const vector<extentity *> &ents = entities::getents();
     findvisiblemms(ents, doquery);
 
@@ -887,118 +1083,179 @@ float shadowradius = 0, shadowbias = 0;
 int shadowside = 0, shadowspot = 0;
 
 vtxarray *shadowva = NULL;
+static octaentities *shadowmms = NULL;
 
-static inline void addshadowva(vtxarray *va, float dist)
-{
-    va->rdistance = int(dist);
-
-    int hash = clamp(int(dist*VASORTSIZE/shadowradius), 0, VASORTSIZE-1);
-    vtxarray **prev = &vasort[hash], *cur = vasort[hash];
-
-    while(cur && va->rdistance > cur->rdistance)
-    {
-        prev = &cur->rnext;
-        cur = cur->rnext;
-    }
-
-    va->rnext = cur;
-    *prev = va;
-}
-
-void sortshadowvas()
+// the caster search for each light only reads the va tree, so the searches for all of a frame's lights run on
+// the worker threads, each also split over ranges of the root vas, and are then merged into one list per light
+struct shadowcullpart
 {
-    shadowva = NULL;
-    vtxarray **last = &shadowva;
-    loopi(VASORTSIZE) if(vasort[i])
-    {
-        vtxarray *va = vasort[i];
-        *last = va;
-        while(va->rnext) va = va->rnext;
-        last = &va->rnext;
-    }
-}
+    shadowcull *sc;
+    int start, end;
+    vector<shadowcaster> vas;
+};
+static vector<shadowcullpart> shadowcullparts;
 
-void findshadowvas(vector<vtxarray *> &vas)
+static void findshadowvas(shadowcull &sc, vector<shadowcaster> &casters, vtxarray **vas, int numvas)
 {
-    loopv(vas)
+    loopi(numvas)
     {
         vtxarray &v = *vas[i];
-        float dist = vadist(&v, shadoworigin);
-        if(dist < shadowradius || !smdistcull)
+        bool usebb = v.children.length() || v.mapmodels.length();
+        const ivec &bbmin = usebb ? v.bbmin : v.geommin, &bbmax = usebb ? v.bbmax : v.geommax;
+        float dist;
+        int mask;
+        switch(sc.mapping)
         {
-            v.shadowmask = !smbbcull ? 0x3F : (v.children.length() || v.mapmodels.length() ?
-                                calcbbsidemask(v.bbmin, v.bbmax, shadoworigin, shadowradius, shadowbias) :
-                                calcbbsidemask(v.geommin, v.geommax, shadoworigin, shadowradius, shadowbias));
-            addshadowva(&v, dist);
-            if(v.children.length()) findshadowvas(v.children);
+            case SM_CUBEMAP:
+                dist = vadist(&v, sc.origin);
+                if(dist >= sc.radius && smdistcull) continue;
+                mask = !smbbcull ? 0x3F : calcbbsidemask(bbmin, bbmax, sc.origin, sc.radius, sc.bias);
+                break;
+            case SM_SPOT:
+                dist = vadist(&v, sc.origin);
+                if(dist >= sc.radius && smdistcull) continue;
+                mask = !smbbcull || bbinsidespot(sc.origin, sc.dir, sc.spot, bbmin, bbmax) ? 1 : 0;
+                break;
+            case SM_CASCADE:
+                mask = calcbbcsmsplits(bbmin, bbmax);
+                if(!mask) continue;
+                dist = sc.dir.project_bb(bbmin, bbmax) - sc.bias;
+                break;
+            case SM_REFLECT:
+                mask = calcbbrsmsplits(bbmin, bbmax);
+                if(!mask) continue;
+                dist = sc.dir.project_bb(bbmin, bbmax) - sc.bias;
+                break;
+            default:
+                continue;
         }
+        shadowcaster &c = casters.add();
+        c.va = &v;
+        c.dist = int(dist);
+        c.mask = mask;
+        if(v.children.length()) findshadowvas(sc, casters, v.children.getbuf(), v.children.length());
     }
 }
 
-void findcsmshadowvas(vector<vtxarray *> &vas)
+static void findshadowmms(shadowcull &sc)
 {
-    loopv(vas)
+    loopv(sc.vas)
     {
-        vtxarray &v = *vas[i];
-        ivec bbmin, bbmax;
-        if(v.children.length() || v.mapmodels.length()) { bbmin = v.bbmin; bbmax = v.bbmax; }
-        else { bbmin = v.geommin; bbmax = v.geommax; }
-        v.shadowmask = calcbbcsmsplits(bbmin, bbmax);
-        if(v.shadowmask)
+        vtxarray *va = sc.vas[i].va;
+        loopvj(va->mapmodels)
         {
-            float dist = shadowdir.project_bb(bbmin, bbmax) - shadowbias;
-            addshadowva(&v, dist);
-            if(v.children.length()) findcsmshadowvas(v.children);
+            octaentities *oe = va->mapmodels[j];
+            switch(sc.mapping)
+            {
+                case SM_REFLECT:
+                    break;
+                case SM_CASCADE:
+                    if(!calcbbcsmsplits(oe->bbmin, oe->bbmax))
+                        continue;
+                    break;
+                case SM_CUBEMAP:
+                    if(smdistcull && sc.origin.dist_to_bb(oe->bbmin, oe->bbmax) >= sc.radius)
+                        continue;
+                    break;
+                case SM_SPOT:
+                    if(smdistcull && sc.origin.dist_to_bb(oe->bbmin, oe->bbmax) >= sc.radius)
+                        continue;
+                    if(smbbcull && !bbinsidespot(sc.origin, sc.dir, sc.spot, oe->bbmin, oe->bbmax))
+                        continue;
+                    break;
+            }
+            sc.mms.add(oe);
         }
     }
 }
 
-void findrsmshadowvas(vector<vtxarray *> &vas)
+static void findshadowpart(int job, int thread, void *data)
 {
-    loopv(vas)
+    shadowcullpart &p = shadowcullparts[job];
+    p.vas.setsize(0);
+    findshadowvas(*p.sc, p.vas, &varoot[p.start], p.end - p.start);
+}
+
+static inline bool shadowcastercmp(const shadowcaster &x, const shadowcaster &y)
+{
+    return x.dist < y.dist;
+}
+
+static void mergeshadowparts(int job, int thread, void *data)
+{
+    shadowcull &sc = ((shadowcull *)data)[job];
+    sc.vas.setsize(0);
+    sc.mms.setsize(0);
+    loopi(sc.numparts)
     {
-        vtxarray &v = *vas[i];
-        ivec bbmin, bbmax;
-        if(v.children.length() || v.mapmodels.length()) { bbmin = v.bbmin; bbmax = v.bbmax; }
-        else { bbmin = v.geommin; bbmax = v.geommax; }
-        v.shadowmask = calcbbrsmsplits(bbmin, bbmax);
-        if(v.shadowmask)
-        {
-            float dist = shadowdir.project_bb(bbmin, bbmax) - shadowbias;
-            addshadowva(&v, dist);
-            if(v.children.length()) findrsmshadowvas(v.children);
-        }
+        const vector<shadowcaster> &vas = shadowcullparts[sc.firstpart + i].vas;
+        sc.vas.put(vas.getbuf(), vas.length());
     }
+    sc.vas.sort(shadowcastercmp);
+    findshadowmms(sc);
 }
 
-void findspotshadowvas(vector<vtxarray *> &vas)
+void initshadowcull(shadowcull &sc)
 {
-    loopv(vas)
+    sc.mapping = shadowmapping;
+    sc.origin = shadoworigin;
+    sc.dir = shadowdir;
+    sc.radius = shadowradius;
+    sc.bias = shadowbias;
+    sc.spot = shadowspot;
+}
+
+void findshadowcasters(shadowcull *culls, int numculls)
+{
+    if(numculls <= 0) return;
+    int numparts = 0, split = clamp(numworkerthreads()/numculls, 1, max(varoot.length(), 1));
+    loopi(numculls)
     {
-        vtxarray &v = *vas[i];
-        float dist = vadist(&v, shadoworigin);
-        if(dist < shadowradius || !smdistcull)
+        shadowcull &sc = culls[i];
+        sc.firstpart = numparts;
+        sc.numparts = split;
+        loopj(split)
         {
-            v.shadowmask = !smbbcull || (v.children.length() || v.mapmodels.length() ?
-                                bbinsidespot(shadoworigin, shadowdir, shadowspot, v.bbmin, v.bbmax) :
-                                bbinsidespot(shadoworigin, shadowdir, shadowspot, v.geommin, v.geommax)) ? 1 : 0;
-            addshadowva(&v, dist);
-            if(v.children.length()) findspotshadowvas(v.children);
+            if(shadowcullparts.length() <= numparts) shadowcullparts.add();
+            shadowcullpart &p = shadowcullparts[numparts++];
+            p.sc = &sc;
+            p.start = j*varoot.length()/split;
+            p.end = (j+1)*varoot.length()/split;
         }
     }
+    runworkers(numparts, findshadowpart, NULL);
+    runworkers(numculls, mergeshadowparts, culls);
 }
 
-void findshadowvas()
+// links the casters found for a light into the lists the shadow map rendering walks
+void useshadowcasters(shadowcull &sc)
 {
-    memset(vasort, 0, sizeof(vasort));
-    switch(shadowmapping)
+    vtxarray **lastva = &shadowva;
+    loopv(sc.vas)
     {
-        case SM_REFLECT: findrsmshadowvas(varoot); break;
-        case SM_CUBEMAP: findshadowvas(varoot); break;
-        case SM_CASCADE: findcsmshadowvas(varoot); break;
-        case SM_SPOT: findspotshadowvas(varoot); break;
+        const shadowcaster &c = sc.vas[i];
+        c.va->shadowmask = c.mask;
+        c.va->rdistance = c.dist;
+        *lastva = c.va;
+        lastva = &c.va->rnext;
     }
-    sortshadowvas();
+    *lastva = NULL;
+
+    octaentities **lastmms = &shadowmms;
+    loopv(sc.mms)
+    {
+        *lastmms = sc.mms[i];
+        lastmms = &sc.mms[i]->rnext;
+    }
+    *lastmms = NULL;
+}
+
+void findshadowcasters()
+{
+    static shadowcull sc;
+    initshadowcull(sc);
+    findshadowcasters(&sc, 1);
+    useshadowcasters(sc);
 }
 
 void rendershadowmapworld()
@@ -1049,40 +1306,6 @@ void rendershadowmapworld()
     gle::disablevertex();
 }
 
-static octaentities *shadowmms = NULL;
-
-void findshadowmms()
-{
-    shadowmms = NULL;
-    octaentities **lastmms = &shadowmms;
-    for(vtxarray *va = shadowva; va; va = va->rnext) loopvj(va->mapmodels)
-    {
-        octaentities *oe = va->mapmodels[j];
-        switch(shadowmapping)
-        {
-            case SM_REFLECT:
-                break;
-            case SM_CASCADE:
-                if(!calcbbcsmsplits(oe->bbmin, oe->bbmax))
-                    continue;
-                break;
-            case SM_CUBEMAP:
-                if(smdistcull && shadoworigin.dist_to_bb(oe->bbmin, oe->bbmax) >= shadowradius)
-                    continue;
-                break;
-            case SM_SPOT:
-                if(smdistcull && shadoworigin.dist_to_bb(oe->bbmin, oe->bbmax) >= shadowradius)
-                    continue;
-                if(smbbcull && !bbinsidespot(shadoworigin, shadowdir, shadowspot, oe->bbmin, oe->bbmax))
-                    continue;
-                break;
-        }
-        oe->rnext = NULL;
-        *lastmms = oe;
-        lastmms = &oe->rnext;
-    }
-}
-
 void batchshadowmapmodels(bool skipmesh)
 {
     if(!shadowmms) return;
@@ -1545,9 +1768,37 @@ static inline void updateshader(T &cur)
     }
 }
 
+VAR(batchmultidraw, 0, 1, 1);
+
+static vector<GLsizei> multidrawcounts;
+static vector<const GLvoid *> multidrawindices;
+
 static void renderbatch(renderstate &cur, int pass, geombatch &b)
 {
     gbatches++;
+    // every va in a batch shares the bound vbuf, so the whole chain goes out as one draw
+    if(batchmultidraw && b.batch >= 0)
+    {
+        for(geombatch *curbatch = &b;; curbatch = &geombatches[curbatch->batch])
+        {
+            ushort len = curbatch->es.length;
+            if(len)
+            {
+                multidrawcounts.add(len);
+                multidrawindices.add((ushort *)0 + curbatch->va->eoffset + curbatch->offset);
+                vtris += len/3;
+            }
+            if(curbatch->batch < 0) break;
+        }
+        if(multidrawcounts.length())
+        {
+            glMultiDrawElements_(GL_TRIANGLES, multidrawcounts.getbuf(), GL_UNSIGNED_SHORT, multidrawindices.getbuf(), multidrawcounts.length());
+            glde++;
+            multidrawcounts.setsize(0);
+            multidrawindices.setsize(0);
+        }
+        return;
+    }
     for(geombatch *curbatch = &b;; curbatch = &geombatches[curbatch->batch])
     {
         ushort len = curbatch->es.length;
@@ -1587,10 +1838,11 @@ static void renderbatches(renderstate &cur, int pass)
         geombatch &b = geombatches[curbatch];
         curbatch = b.next;
 
-        if(cur.vbuf != b.va->vbuf) changevbuf(cur, pass, b.va);
+        if(cur.vbuf != b.va->vbuf) { changevbuf(cur, pass, b.va); gstates++; }
         if(pass == RENDERPASS_GBUFFER || pass == RENDERPASS_RSM) changebatchtmus(cur, pass, b);
         if(cur.vslot != &b.vslot)
         {
+            gstates++;
             changeslottmus(cur, pass, *b.vslot.slot, b.vslot);
             if(cur.texgenorient != b.es.orient || (cur.texgenorient < O_ANY && cur.texgenvslot != &b.vslot)) changetexgen(cur, b.es.orient, *b.vslot.slot, b.vslot);
             changeshader(cur, pass, b);
@@ -1699,6 +1951,7 @@ void renderva(renderstate &cur, vtxarray *va, int pass = RENDERPASS_GBUFFER, boo
 void cleanupva()
 {
     clearvas(worldroot);
+    cleanupvbos();
     clearqueries();
     cleanupbb();
     cleanupgrass();
@@ -1721,7 +1974,7 @@ VAR(oqgeom, 0, 1, 1);
 
 void rendergeom()
 {
-    bool doOQ = oqfrags && oqgeom && !drawtex, multipassing = false;
+    bool doOQ = oqfrags && oqgeom && !drawtex && !swoccluding, multipassing = false;
     renderstate cur;
 
     int blends = 0;
@@ -1809,6 +2062,7 @@ void rendergeom()
         for(vtxarray *va = visibleva; va; va = va->next) if(va->texs)
         {
             va->query = NULL;
+            if(swoccluding && va->occluded >= OCCLUDE_GEOM) continue;
             va->occluded = pvsoccluded(va->geommin, va->geommax) ? OCCLUDE_GEOM : OCCLUDE_NOTHING;
             if(va->occluded >= OCCLUDE_GEOM) continue;
             blends += va->blends;
@@ -2641,8 +2895,7 @@ static void genshadowmesh(int idx, extentity &e)
     shadowdir = m.type == SM_SPOT ? vec(m.spotloc).sub(m.origin).normalize() : vec(0, 0, 0);
     shadowspot = m.spotangle;
 
-    findshadowvas();
-    findshadowmms();
+    findshadowcasters();
 
     int sides = m.type == SM_SPOT ? 1 : 6;
     shadowdrawinfo draws[6];
@@ -3,9 +3,23 @@
 
 #include "engine/engine.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#ifndef WIN32
+#include <signal.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#endif
+
 #define LOGSTRLEN 512
 
 static FILE *logfile = NULL;
+static int loginstance = -1, serverinstance = 0;
 
 void closelogfile()
 {
@@ -61,7 +75,13 @@ static void writelog(FILE *file, const char *buf)
 static void writelogv(FILE *file, const char *fmt, va_list args)
 {
     static char buf[LOGSTRLEN];
-    vformatstring(buf, fmt, args, sizeof(buf));
+    int prefix = 0;
+    if(loginstance >= 0)
+    {
+        nformatstring(buf, sizeof(buf), "[%d] ", loginstance);
+        prefix = strlen(buf);
+    }
+    vformatstring(&buf[prefix], fmt, args, sizeof(buf)-prefix);
     writelog(file, buf);
 }
 
@@ -112,6 +132,8 @@ struct client                   // server side version of "dynent" type
     int type;
     int num;
     ENetPeer *peer;
+    uint ioid, iortt, iorttvar;
+    ENetAddress address;
     string hostname;
     void *info;
 };
@@ -120,7 +142,12 @@ vector<client *> clients;
 
 ENetHost *serverhost = NULL;
 int laststatus = 0;
-ENetSocket lansock = ENET_SOCKET_NULL;
+ENetSocket lansock = ENET_SOCKET_NULL, metricssock = ENET_SOCKET_NULL;
+
+static std::thread *iothread = NULL;
+static int iomtu = 0;
+static void queueiosend(client &c, int chan, ENetPacket *packet);
+static void queueiodisconnect(client &c, int reason);
 
 int localclients = 0, nonlocalclients = 0;
 
@@ -156,7 +183,7 @@ void delclient(client *c)
     if(!c) return;
     switch(c->type)
     {
-        case ST_TCPIP: nonlocalclients--; if(c->peer) c->peer->data = NULL; break;
+        case ST_TCPIP: nonlocalclients--; if(c->peer && !iothread) c->peer->data = NULL; break;
         case ST_LOCAL: localclients--; break;
         case ST_EMPTY: return;
     }
@@ -169,13 +196,21 @@ void delclient(client *c)
     }
 }
 
+static void stopiothread();
+static void cleanupmetrics();
+
 void cleanupserver()
 {
+    stopiothread();
+    cleanupmetrics();
     if(serverhost) enet_host_destroy(serverhost);
     serverhost = NULL;
 
     if(lansock != ENET_SOCKET_NULL) enet_socket_destroy(lansock);
     lansock = ENET_SOCKET_NULL;
+
+    if(metricssock != ENET_SOCKET_NULL) enet_socket_destroy(metricssock);
+    metricssock = ENET_SOCKET_NULL;
 }
 
 VARF(maxclients, 0, DEFAULTCLIENTS, MAXCLIENTS, { if(!maxclients) maxclients = DEFAULTCLIENTS; });
@@ -184,11 +219,61 @@ VARF(maxdupclients, 0, 0, MAXCLIENTS, { if(serverhost) serverhost->duplicatePeer
 void process(ENetPacket *packet, int sender, int chan);
 //void disconnect_client(int n, int reason);
 
-int getservermtu() { return serverhost ? serverhost->mtu : -1; }
+// tick profiling and traffic counters, scraped in the Prometheus text format from the metrics port
+static const uint phasebuckets[] = { 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000 };
+#define NUMPHASEBUCKETS int(sizeof(phasebuckets)/sizeof(phasebuckets[0]))
+static const char * const phasenames[NUMSERVERPHASES] = { "slice", "update", "events", "worldstate", "demo", "sockets" };
+
+struct phasehistogram
+{
+    uint counts[NUMPHASEBUCKETS+1], count;
+    ullong sum;
+};
+static phasehistogram phasehistograms[NUMSERVERPHASES];
+
+#define METRICCHANS 3
+static ullong sentpackets[METRICCHANS], sentbytes[METRICCHANS], receivedpackets[METRICCHANS], receivedbytes[METRICCHANS];
+
+uint getservermicros()
+{
+    return uint(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void addserverphase(int phase, uint micros)
+{
+    phasehistogram &h = phasehistograms[phase];
+    int bucket = 0;
+    while(bucket < NUMPHASEBUCKETS && micros > phasebuckets[bucket]) bucket++;
+    h.counts[bucket]++;
+    h.count++;
+    h.sum += micros;
+}
+
+void metricf(vector<char> &buf, const char *fmt, ...)
+{
+    char line[1024];
+    va_list args;
+    va_start(args, fmt);
+    vformatstring(line, fmt, args, sizeof(line));
+    va_end(args);
+    buf.put(line, strlen(line));
+}
+
+int getservermtu() { return serverhost ? (iothread ? iomtu : serverhost->mtu) : -1; }
 void *getclientinfo(int i) { return !clients.inrange(i) || clients[i]->type==ST_EMPTY ? NULL : clients[i]->info; }
 ENetPeer *getclientpeer(int i) { return clients.inrange(i) && clients[i]->type==ST_TCPIP ? clients[i]->peer : NULL; }
 int getnumclients()        { return clients.length(); }
-uint getclientip(int n)    { return clients.inrange(n) && clients[n]->type==ST_TCPIP ? clients[n]->peer->address.host : 0; }
+uint getclientip(int n)    { return clients.inrange(n) && clients[n]->type==ST_TCPIP ? clients[n]->address.host : 0; }
+
+// the I/O thread owns the peers, so with it running the game sees the round trip times it last reported
+bool getclientrtt(int n, uint &rtt, uint &variance)
+{
+    if(!clients.inrange(n) || clients[n]->type!=ST_TCPIP || !clients[n]->peer) return false;
+    client &c = *clients[n];
+    if(iothread) { rtt = c.iortt; variance = c.iorttvar; }
+    else { rtt = c.peer->roundTripTime; variance = c.peer->roundTripTimeVariance; }
+    return true;
+}
 
 void sendpacket(int n, int chan, ENetPacket *packet, int exclude)
 {
@@ -202,7 +287,9 @@ void sendpacket(int n, int chan, ENetPacket *packet, int exclude)
     {
         case ST_TCPIP:
         {
-            enet_peer_send(clients[n]->peer, chan, packet);
+            if(chan >= 0 && chan < METRICCHANS) { sentpackets[chan]++; sentbytes[chan] += packet->dataLength; }
+            if(iothread) queueiosend(*clients[n], chan, packet);
+            else enet_peer_send(clients[n]->peer, chan, packet);
             break;
         }
 
@@ -323,7 +410,8 @@ const char *disconnectreason(int reason)
 void disconnect_client(int n, int reason)
 {
     if(!clients.inrange(n) || clients[n]->type!=ST_TCPIP) return;
-    enet_peer_disconnect(clients[n]->peer, reason);
+    if(iothread) queueiodisconnect(*clients[n], reason);
+    else enet_peer_disconnect(clients[n]->peer, reason);
     server::clientdisconnect(n);
     delclient(clients[n]);
     const char *msg = disconnectreason(reason);
@@ -341,6 +429,7 @@ void kicknonlocalclients(int reason)
 
 void process(ENetPacket *packet, int sender, int chan)   // sender may be -1
 {
+    if(chan >= 0 && chan < METRICCHANS) { receivedpackets[chan]++; receivedbytes[chan] += packet->dataLength; }
     packetbuf p(packet);
     server::parsepacket(sender, chan, p);
     if(p.overread()) { disconnect_client(sender, DISC_EOP); return; }
@@ -520,8 +609,12 @@ void flushmasterinput()
 
 static ENetAddress serverinfoaddress;
 
+static bool captureserverinfo = false;
+static void setioinfo(const uchar *data, int len);
+
 void sendserverinforeply(ucharbuf &p)
 {
+    if(captureserverinfo) { setioinfo(p.buf, p.length()); return; }
     ENetBuffer buf;
     buf.data = p.buf;
     buf.dataLength = p.length();
@@ -530,8 +623,12 @@ void sendserverinforeply(ucharbuf &p)
 
 #define MAXPINGDATA 32
 
+static void addmetricssockets(ENetSocket &maxsock, ENetSocketSet &readset, ENetSocketSet &writeset);
+static void checkmetricssockets(ENetSocketSet &readset, ENetSocketSet &writeset);
+
 void checkserversockets()        // reply all server info requests
 {
+    serverphasetimer timer(SERVERPHASE_SOCKETS);
     static ENetSocketSet readset, writeset;
     ENET_SOCKETSET_EMPTY(readset);
     ENET_SOCKETSET_EMPTY(writeset);
@@ -542,14 +639,17 @@ void checkserversockets()        // reply all server info requests
         ENET_SOCKETSET_ADD(readset, mastersock);
         if(!masterconnected) ENET_SOCKETSET_ADD(writeset, mastersock);
     }
-    if(lansock != ENET_SOCKET_NULL)
+    if(lansock != ENET_SOCKET_NULL && !iothread)
     {
         maxsock = maxsock == ENET_SOCKET_NULL ? lansock : max(maxsock, lansock);
         ENET_SOCKETSET_ADD(readset, lansock);
     }
+    addmetricssockets(maxsock, readset, writeset);
     if(maxsock == ENET_SOCKET_NULL || enet_socketset_select(maxsock, &readset, &writeset, 0) <= 0) return;
 
-    if(lansock != ENET_SOCKET_NULL && ENET_SOCKETSET_CHECK(readset, lansock))
+    checkmetricssockets(readset, writeset);
+
+    if(lansock != ENET_SOCKET_NULL && !iothread && ENET_SOCKETSET_CHECK(readset, lansock))
     {
         ENetBuffer buf;
         uchar data[MAXTRANS];
@@ -596,6 +696,574 @@ static int serverinfointercept(ENetHost *host, ENetEvent *event)
     return 1;
 }
 
+// network I/O thread for dedicated servers: it owns the ENet host and the LAN info socket, hands
+// received events to the game thread and sends whatever the game thread queues up for it, so that
+// neither a burst of info queries nor a slow tick on one side holds up the other
+VAR(serveriothread, 0, 0, 1);
+
+// lock-free ring buffer for exactly one producer and one consumer thread
+template<class T, int SIZE> struct spscqueue
+{
+    T items[SIZE];
+    std::atomic<uint> head, tail;
+
+    spscqueue() : head(0), tail(0) {}
+
+    bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+
+    bool push(const T &item)
+    {
+        uint t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) >= uint(SIZE)) return false;
+        items[t%SIZE] = item;
+        tail.store(t+1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        uint h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire)) return false;
+        item = items[h%SIZE];
+        head.store(h+1, std::memory_order_release);
+        return true;
+    }
+};
+
+enum { IO_CONNECT = 0, IO_RECEIVE, IO_DISCONNECT, IO_INFO, IO_PEERINFO, IO_SEND, IO_RELEASE, IO_FLUSH };
+
+struct iomsg
+{
+    int type, chan;
+    ENetPeer *peer;
+    uint id, reason, rtt, rttvar;
+    ENetAddress address;
+    ENetPacket *packet;
+};
+
+// packets the game thread sent during the current slice, mirrored into copies owned by the I/O thread;
+// shared copies point into the original's data, which then lives until ENet is done with the copy
+struct iomirror
+{
+    ENetPacket *source, *copy;
+    bool shared;
+};
+
+static spscqueue<iomsg, 4096> ioevents;
+static spscqueue<iomsg, 16384> iocommands;
+static std::atomic<bool> iorunning(false);
+static std::atomic<uint> iosentdata(0), ioreceiveddata(0);
+static std::mutex iowaitlock, ioinfolock, iofreelock;
+static std::condition_variable iowait;
+static uint ioids[MAXCLIENTS], iortts[MAXCLIENTS][2], lastioid = 0;
+static uchar ioinfo[MAXTRANS];
+static int ioinfolen = 0, lastioinfo = 0;
+static vector<iomirror> iomirrors;
+static vector<ENetPacket *> iofreed;
+
+static void setioinfo(const uchar *data, int len)
+{
+    std::lock_guard<std::mutex> lock(ioinfolock);
+    ioinfolen = min(len, int(sizeof(ioinfo)));
+    memcpy(ioinfo, data, ioinfolen);
+}
+
+static void updateioinfo()
+{
+    // basic info replies only depend on a little game state, so the I/O thread answers them from a copy
+    uchar data[MAXTRANS];
+    ucharbuf req(data, 0), p(data, sizeof(data));
+    captureserverinfo = true;
+    server::serverinforeply(req, p);
+    captureserverinfo = false;
+    lastioinfo = totalmillis;
+}
+
+static void pushiocommand(const iomsg &m)
+{
+    while(!iocommands.push(m)) std::this_thread::yield();
+}
+
+static void freeiomirror(ENetPacket *copy)
+{
+    // called on the I/O thread, the original is given back to the game thread to release
+    std::lock_guard<std::mutex> lock(iofreelock);
+    iofreed.add((ENetPacket *)copy->userData);
+}
+
+static ENetPacket *mirroriopacket(ENetPacket *packet)
+{
+    loopvrev(iomirrors) if(iomirrors[i].source == packet) return iomirrors[i].copy;
+    iomirror &m = iomirrors.add();
+    m.source = packet;
+    m.shared = (packet->flags&ENET_PACKET_FLAG_NO_ALLOCATE)!=0;
+    m.copy = enet_packet_create(packet->data, packet->dataLength, packet->flags);
+    if(m.shared)
+    {
+        m.copy->userData = packet;
+        m.copy->freeCallback = freeiomirror;
+    }
+    // the copy's own reference is dropped by IO_RELEASE, after which ENet frees it once it is sent
+    m.copy->referenceCount = 1;
+    // hold on to the original until the slice is over, or for shared copies until the copy is gone
+    packet->referenceCount++;
+    return m.copy;
+}
+
+static void queueiosend(client &c, int chan, ENetPacket *packet)
+{
+    iomsg m;
+    m.type = IO_SEND;
+    m.chan = chan;
+    m.peer = c.peer;
+    m.id = c.ioid;
+    m.packet = mirroriopacket(packet);
+    pushiocommand(m);
+}
+
+static void queueiodisconnect(client &c, int reason)
+{
+    iomsg m;
+    m.type = IO_DISCONNECT;
+    m.peer = c.peer;
+    m.id = c.ioid;
+    m.reason = reason;
+    pushiocommand(m);
+}
+
+static void flushio(bool flush)
+{
+    loopv(iomirrors)
+    {
+        iomirror &m = iomirrors[i];
+        iomsg r;
+        r.type = IO_RELEASE;
+        r.packet = m.copy;
+        pushiocommand(r);
+        if(!m.shared && !--m.source->referenceCount) enet_packet_destroy(m.source);
+    }
+    iomirrors.setsize(0);
+    static vector<ENetPacket *> freed;
+    iofreelock.lock();
+    swap(freed, iofreed);
+    iofreelock.unlock();
+    loopv(freed) if(!--freed[i]->referenceCount) enet_packet_destroy(freed[i]);
+    freed.setsize(0);
+    if(flush)
+    {
+        iomsg f;
+        f.type = IO_FLUSH;
+        pushiocommand(f);
+    }
+}
+
+static void runiocommands()
+{
+    iomsg m;
+    while(iocommands.pop(m)) switch(m.type)
+    {
+        case IO_SEND:
+            if(ioids[m.peer - serverhost->peers] == m.id) enet_peer_send(m.peer, m.chan, m.packet);
+            break;
+
+        case IO_DISCONNECT:
+            if(ioids[m.peer - serverhost->peers] == m.id) enet_peer_disconnect(m.peer, m.reason);
+            break;
+
+        case IO_RELEASE:
+            if(!--m.packet->referenceCount) enet_packet_destroy(m.packet);
+            break;
+
+        case IO_FLUSH:
+            enet_host_flush(serverhost);
+            break;
+    }
+}
+
+static void pushioevent(const iomsg &m)
+{
+    while(!ioevents.push(m))
+    {
+        // keep sending while the game thread catches up, it may be waiting on us in turn
+        runiocommands();
+        std::this_thread::yield();
+    }
+}
+
+static void queueioinfo(const ENetAddress &address, const uchar *req, int len)
+{
+    iomsg m;
+    m.type = IO_INFO;
+    m.address = address;
+    m.packet = enet_packet_create(req, len, 0);
+    pushioevent(m);
+}
+
+static bool ioinforeply(const ENetAddress &address, const uchar *req, int len)
+{
+    ucharbuf q((uchar *)req, len);
+    if(q.remaining() && !getint(q)) return false; // extended info needs the game state
+    uchar data[MAXPINGDATA + MAXTRANS];
+    memcpy(data, req, len);
+    ioinfolock.lock();
+    memcpy(&data[len], ioinfo, ioinfolen);
+    len += ioinfolen;
+    ioinfolock.unlock();
+    ENetBuffer buf;
+    buf.data = data;
+    buf.dataLength = len;
+    enet_socket_send(serverhost->socket, &address, &buf, 1);
+    return true;
+}
+
+static int iointercept(ENetHost *host, ENetEvent *event)
+{
+    if(host->receivedDataLength < 2 || host->receivedData[0] != 0xFF || host->receivedData[1] != 0xFF || host->receivedDataLength-2 > MAXPINGDATA) return 0;
+    if(!ioinforeply(host->receivedAddress, host->receivedData+2, host->receivedDataLength-2)) queueioinfo(host->receivedAddress, host->receivedData+2, host->receivedDataLength-2);
+    return 1;
+}
+
+static void checkiolansock()
+{
+    if(lansock == ENET_SOCKET_NULL) return;
+    for(;;)
+    {
+        ENetAddress address;
+        ENetBuffer buf;
+        uchar data[MAXTRANS];
+        buf.data = data;
+        buf.dataLength = sizeof(data);
+        int len = enet_socket_receive(lansock, &address, &buf, 1);
+        if(len <= 0) break;
+        if(len < 2 || data[0] != 0xFF || data[1] != 0xFF || len-2 > MAXPINGDATA) continue;
+        if(!ioinforeply(address, data+2, len-2)) queueioinfo(address, data+2, len-2);
+    }
+}
+
+static void runiothread()
+{
+    while(iorunning)
+    {
+        runiocommands();
+        checkiolansock();
+
+        ENetEvent event;
+        bool serviced = false, received = false;
+        while(!serviced)
+        {
+            if(enet_host_check_events(serverhost, &event) <= 0)
+            {
+                if(enet_host_service(serverhost, &event, 1) <= 0) break;
+                serviced = true;
+            }
+            iomsg m;
+            m.peer = event.peer;
+            m.packet = NULL;
+            uint &id = ioids[event.peer - serverhost->peers];
+            switch(event.type)
+            {
+                case ENET_EVENT_TYPE_CONNECT:
+                    m.type = IO_CONNECT;
+                    m.id = id = ++lastioid;
+                    m.address = event.peer->address;
+                    m.rtt = iortts[event.peer - serverhost->peers][0] = event.peer->roundTripTime;
+                    m.rttvar = iortts[event.peer - serverhost->peers][1] = event.peer->roundTripTimeVariance;
+                    break;
+                case ENET_EVENT_TYPE_RECEIVE:
+                    if(!id) { enet_packet_destroy(event.packet); continue; }
+                    m.type = IO_RECEIVE;
+                    m.id = id;
+                    m.chan = event.channelID;
+                    m.packet = event.packet;
+                    break;
+                case ENET_EVENT_TYPE_DISCONNECT:
+                    if(!id) continue;
+                    m.type = IO_DISCONNECT;
+                    m.id = id;
+                    id = 0;
+                    break;
+                default:
+                    continue;
+            }
+            pushioevent(m);
+            received = true;
+        }
+        loopi(min(int(serverhost->peerCount), MAXCLIENTS))
+        {
+            ENetPeer &peer = serverhost->peers[i];
+            uint *rtt = iortts[i];
+            if(!ioids[i] || (peer.roundTripTime == rtt[0] && peer.roundTripTimeVariance == rtt[1])) continue;
+            iomsg m;
+            m.type = IO_PEERINFO;
+            m.peer = &peer;
+            m.id = ioids[i];
+            m.packet = NULL;
+            m.rtt = rtt[0] = peer.roundTripTime;
+            m.rttvar = rtt[1] = peer.roundTripTimeVariance;
+            pushioevent(m);
+        }
+        if(received)
+        {
+            { std::lock_guard<std::mutex> lock(iowaitlock); }
+            iowait.notify_one();
+        }
+
+        iosentdata += serverhost->totalSentData;
+        ioreceiveddata += serverhost->totalReceivedData;
+        serverhost->totalSentData = serverhost->totalReceivedData = 0;
+    }
+}
+
+static client *findioclient(const iomsg &m)
+{
+    loopv(clients) if(clients[i]->type==ST_TCPIP && clients[i]->peer == m.peer && clients[i]->ioid == m.id) return clients[i];
+    return NULL;
+}
+
+static void runioevents()
+{
+    iomsg m;
+    while(ioevents.pop(m)) switch(m.type)
+    {
+        case IO_CONNECT:
+        {
+            client &c = addclient(ST_TCPIP);
+            c.peer = m.peer;
+            c.ioid = m.id;
+            c.iortt = m.rtt;
+            c.iorttvar = m.rttvar;
+            c.address = m.address;
+            string hn;
+            copystring(c.hostname, (enet_address_get_host_ip(&c.address, hn, sizeof(hn))==0) ? hn : "unknown");
+            logoutf("client connected (%s)", c.hostname);
+            int reason = server::clientconnect(c.num, c.address.host);
+            if(reason) disconnect_client(c.num, reason);
+            break;
+        }
+        case IO_RECEIVE:
+        {
+            client *c = findioclient(m);
+            if(c) process(m.packet, c->num, m.chan);
+            if(m.packet->referenceCount==0) enet_packet_destroy(m.packet);
+            break;
+        }
+        case IO_DISCONNECT:
+        {
+            client *c = findioclient(m);
+            if(!c) break;
+            logoutf("disconnected client (%s)", c->hostname);
+            server::clientdisconnect(c->num);
+            delclient(c);
+            break;
+        }
+        case IO_PEERINFO:
+        {
+            client *c = findioclient(m);
+            if(c) { c->iortt = m.rtt; c->iorttvar = m.rttvar; }
+            break;
+        }
+        case IO_INFO:
+        {
+            uchar data[MAXTRANS];
+            int len = m.packet->dataLength;
+            memcpy(data, m.packet->data, len);
+            enet_packet_destroy(m.packet);
+            serverinfoaddress = m.address;
+            ucharbuf req(data, len), p(data, sizeof(data));
+            p.len += len;
+            server::serverinforeply(req, p);
+            break;
+        }
+    }
+}
+
+static void waitio(uint timeout)
+{
+    std::unique_lock<std::mutex> lock(iowaitlock);
+    iowait.wait_for(lock, std::chrono::milliseconds(timeout), [] { return !ioevents.empty(); });
+}
+
+static void stopiothread()
+{
+    if(!iothread) return;
+    iorunning = false;
+    iothread->join();
+    delete iothread;
+    iothread = NULL;
+    if(serverhost) serverhost->intercept = serverinfointercept;
+}
+
+static void startiothread()
+{
+    if(iothread || !serverhost) return;
+    memset(ioids, 0, sizeof(ioids));
+    iomtu = serverhost->mtu;
+    updateioinfo();
+    serverhost->intercept = iointercept;
+    iorunning = true;
+    iothread = new std::thread(runiothread);
+    atexit(stopiothread);
+    logoutf("network I/O thread started");
+}
+
+VAR(metricsport, 0, 0, 0xFFFF);
+
+static void setupmetrics()
+{
+    if(!metricsport) return;
+    ENetAddress address = { ENET_HOST_ANY, enet_uint16(metricsport) };
+    enet_address_set_host(&address, "127.0.0.1");
+    metricssock = enet_socket_create(ENET_SOCKET_TYPE_STREAM);
+    if(metricssock != ENET_SOCKET_NULL &&
+       (enet_socket_set_option(metricssock, ENET_SOCKOPT_REUSEADDR, 1) < 0 ||
+        enet_socket_bind(metricssock, &address) < 0 ||
+        enet_socket_listen(metricssock, -1) < 0 ||
+        enet_socket_set_option(metricssock, ENET_SOCKOPT_NONBLOCK, 1) < 0))
+    {
+        enet_socket_destroy(metricssock);
+        metricssock = ENET_SOCKET_NULL;
+    }
+    if(metricssock == ENET_SOCKET_NULL) conoutf(CON_WARN, "WARNING: could not create metrics socket");
+}
+
+static void writemetrics(vector<char> &buf)
+{
+    metricf(buf, "# HELP resseract_phase_seconds Time spent in each phase of a server tick.\n# TYPE resseract_phase_seconds histogram\n");
+    loopi(NUMSERVERPHASES)
+    {
+        phasehistogram &h = phasehistograms[i];
+        uint total = 0;
+        loopj(NUMPHASEBUCKETS)
+        {
+            total += h.counts[j];
+            metricf(buf, "resseract_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %u\n", phasenames[i], phasebuckets[j]/1e6, total);
+        }
+        metricf(buf, "resseract_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %u\n", phasenames[i], h.count);
+        metricf(buf, "resseract_phase_seconds_sum{phase=\"%s\"} %g\n", phasenames[i], h.sum/1e6);
+        metricf(buf, "resseract_phase_seconds_count{phase=\"%s\"} %u\n", phasenames[i], h.count);
+    }
+    metricf(buf, "# TYPE resseract_packets_sent_total counter\n");
+    loopi(METRICCHANS) metricf(buf, "resseract_packets_sent_total{channel=\"%d\"} %llu\n", i, sentpackets[i]);
+    metricf(buf, "# TYPE resseract_bytes_sent_total counter\n");
+    loopi(METRICCHANS) metricf(buf, "resseract_bytes_sent_total{channel=\"%d\"} %llu\n", i, sentbytes[i]);
+    metricf(buf, "# TYPE resseract_packets_received_total counter\n");
+    loopi(METRICCHANS) metricf(buf, "resseract_packets_received_total{channel=\"%d\"} %llu\n", i, receivedpackets[i]);
+    metricf(buf, "# TYPE resseract_bytes_received_total counter\n");
+    loopi(METRICCHANS) metricf(buf, "resseract_bytes_received_total{channel=\"%d\"} %llu\n", i, receivedbytes[i]);
+    metricf(buf, "# TYPE resseract_connections gauge\nresseract_connections{type=\"remote\"} %d\nresseract_connections{type=\"local\"} %d\n", nonlocalclients, localclients);
+    server::writemetrics(buf);
+}
+
+#define METRICSTIMEOUT 5000
+#define MAXMETRICSCONNS 8
+
+// scrapes are served a piece at a time as their sockets become ready, so a slow or idle scraper
+// only ever holds its own connection open and never stalls a server tick
+struct metricsconn
+{
+    enum { READ = 0, SEND, DRAIN };
+
+    ENetSocket sock;
+    int state, reqlen, sent;
+    uint deadline;
+    char req[1024];
+    vector<char> reply;
+
+    metricsconn(ENetSocket sock) : sock(sock), state(READ), reqlen(0), sent(0), deadline(enet_time_get() + METRICSTIMEOUT) {}
+    ~metricsconn() { enet_socket_destroy(sock); }
+};
+static vector<metricsconn *> metricsconns;
+
+static void cleanupmetrics()
+{
+    metricsconns.deletecontents();
+}
+
+static void addmetricssockets(ENetSocket &maxsock, ENetSocketSet &readset, ENetSocketSet &writeset)
+{
+    uint now = enet_time_get();
+    loopvrev(metricsconns) if(int(metricsconns[i]->deadline - now) <= 0) delete metricsconns.remove(i);
+    loopv(metricsconns)
+    {
+        metricsconn &c = *metricsconns[i];
+        maxsock = maxsock == ENET_SOCKET_NULL ? c.sock : max(maxsock, c.sock);
+        if(c.state == metricsconn::SEND) ENET_SOCKETSET_ADD(writeset, c.sock);
+        else ENET_SOCKETSET_ADD(readset, c.sock);
+    }
+    if(metricssock != ENET_SOCKET_NULL && metricsconns.length() < MAXMETRICSCONNS)
+    {
+        maxsock = maxsock == ENET_SOCKET_NULL ? metricssock : max(maxsock, metricssock);
+        ENET_SOCKETSET_ADD(readset, metricssock);
+    }
+}
+
+static bool sendmetrics(metricsconn &c)
+{
+    while(c.sent < c.reply.length())
+    {
+        ENetBuffer buf;
+        buf.data = &c.reply[c.sent];
+        buf.dataLength = c.reply.length() - c.sent;
+        int len = enet_socket_send(c.sock, NULL, &buf, 1);
+        if(len < 0) return false;
+        if(!len) return true; // wait until the socket is writable again
+        c.sent += len;
+    }
+    // let the scraper close first, draining anything it still sends so the close stays orderly
+    enet_socket_shutdown(c.sock, ENET_SOCKET_SHUTDOWN_WRITE);
+    c.state = metricsconn::DRAIN;
+    return true;
+}
+
+static bool servemetrics(metricsconn &c)
+{
+    if(c.state == metricsconn::SEND) return sendmetrics(c);
+    // the socket was reported readable, so receiving nothing means the scraper closed its side
+    ENetBuffer buf;
+    buf.data = &c.req[c.reqlen];
+    buf.dataLength = sizeof(c.req) - 1 - c.reqlen;
+    int len = enet_socket_receive(c.sock, NULL, &buf, 1);
+    if(len < 0 || (!len && c.state == metricsconn::DRAIN)) return false;
+    if(c.state == metricsconn::DRAIN) return true;
+    // any request gets the metrics, but it has to be read up to the end of its headers first,
+    // or closing with unread data makes the kernel reset the connection under the scraper
+    if(len)
+    {
+        c.reqlen += len;
+        c.req[c.reqlen] = '\0';
+        if(!strstr(c.req, "\r\n\r\n") && !strstr(c.req, "\n\n"))
+        {
+            if(c.reqlen >= int(sizeof(c.req)) - 1) c.reqlen = 0; // oversized headers, keep reading until their end
+            return true;
+        }
+    }
+    vector<char> body;
+    writemetrics(body);
+    defformatstring(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", body.length());
+    c.reply.put(header, strlen(header));
+    c.reply.put(body.getbuf(), body.length());
+    c.state = metricsconn::SEND;
+    return sendmetrics(c);
+}
+
+static void checkmetricssockets(ENetSocketSet &readset, ENetSocketSet &writeset)
+{
+    loopvrev(metricsconns)
+    {
+        metricsconn &c = *metricsconns[i];
+        if(!ENET_SOCKETSET_CHECK(c.state == metricsconn::SEND ? writeset : readset, c.sock)) continue;
+        if(!servemetrics(c)) delete metricsconns.remove(i);
+    }
+    if(metricssock == ENET_SOCKET_NULL || !ENET_SOCKETSET_CHECK(readset, metricssock)) return;
+    while(metricsconns.length() < MAXMETRICSCONNS)
+    {
+        ENetSocket sock = enet_socket_accept(metricssock, NULL);
+        if(sock == ENET_SOCKET_NULL) break;
+        enet_socket_set_option(sock, ENET_SOCKOPT_NONBLOCK, 1);
+        metricsconns.add(new metricsconn(sock));
+    }
+}
+
 VAR(serveruprate, 0, 0, INT_MAX);
 SVAR(serverip, "");
 VARF(serverport, 0, server::serverport(), 0xFFFF, { if(!serverport) serverport = server::serverport(); });
@@ -626,6 +1294,14 @@ void updatetime()
 
 void serverslice(bool dedicated, uint timeout)   // main server update, called from main loop in sp, or from below in dedicated server
 {
+    struct slicetimer
+    {
+        uint start, idle;
+
+        slicetimer() : start(getservermicros()), idle(0) {}
+        ~slicetimer() { addserverphase(SERVERPHASE_SLICE, getservermicros() - start - idle); }
+    } slice;
+
     if(!serverhost)
     {
         server::serverupdate();
@@ -659,8 +1335,26 @@ void serverslice(bool dedicated, uint timeout)   // main server update, called f
     if(totalmillis-laststatus>60*1000)   // display bandwidth stats, useful for server ops
     {
         laststatus = totalmillis;
-        if(nonlocalclients || serverhost->totalSentData || serverhost->totalReceivedData) logoutf("status: %d remote clients, %.1f send, %.1f rec (K/sec)", nonlocalclients, serverhost->totalSentData/60.0f/1024, serverhost->totalReceivedData/60.0f/1024);
-        serverhost->totalSentData = serverhost->totalReceivedData = 0;
+        uint sent, received;
+        if(iothread) { sent = iosentdata.exchange(0); received = ioreceiveddata.exchange(0); }
+        else
+        {
+            sent = serverhost->totalSentData;
+            received = serverhost->totalReceivedData;
+            serverhost->totalSentData = serverhost->totalReceivedData = 0;
+        }
+        if(nonlocalclients || sent || received) logoutf("status: %d remote clients, %.1f send, %.1f rec (K/sec)", nonlocalclients, sent/60.0f/1024, received/60.0f/1024);
+    }
+
+    if(iothread)
+    {
+        if(totalmillis-lastioinfo >= 250) updateioinfo();
+        runioevents();
+        flushio(server::sendpackets());
+        uint waitstart = getservermicros();
+        waitio(timeout);
+        slice.idle += getservermicros() - waitstart;
+        return;
     }
 
     ENetEvent event;
@@ -669,7 +1363,10 @@ void serverslice(bool dedicated, uint timeout)   // main server update, called f
     {
         if(enet_host_check_events(serverhost, &event) <= 0)
         {
-            if(enet_host_service(serverhost, &event, timeout) <= 0) break;
+            uint waitstart = getservermicros();
+            int serviceresult = enet_host_service(serverhost, &event, timeout);
+            slice.idle += getservermicros() - waitstart;
+            if(serviceresult <= 0) break;
             serviced = true;
         }
         switch(event.type)
@@ -679,6 +1376,7 @@ void serverslice(bool dedicated, uint timeout)   // main server update, called f
                 client &c = addclient(ST_TCPIP);
                 c.peer = event.peer;
                 c.peer->data = &c;
+                c.address = c.peer->address;
                 string hn;
                 copystring(c.hostname, (enet_address_get_host_ip(&c.peer->address, hn, sizeof(hn))==0) ? hn : "unknown");
                 logoutf("client connected (%s)", c.hostname);
@@ -711,7 +1409,11 @@ void serverslice(bool dedicated, uint timeout)   // main server update, called f
 
 void flushserver(bool force)
 {
-    if(server::sendpackets(force) && serverhost) enet_host_flush(serverhost);
+    if(server::sendpackets(force) && serverhost)
+    {
+        if(iothread) flushio(true);
+        else enet_host_flush(serverhost);
+    }
 }
 
 #ifndef STANDALONE
@@ -1018,6 +1720,7 @@ bool isdedicatedserver() { return dedicatedserver; }
 void rundedicatedserver()
 {
     dedicatedserver = true;
+    if(serveriothread) startiothread();
     logoutf("dedicated server started, waiting for clients...");
 #ifdef WIN32
     SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS);
@@ -1064,7 +1767,7 @@ bool setuplistenserver(bool dedicated)
     if(!serverhost) return servererror(dedicated, "could not create server host");
     serverhost->duplicatePeers = maxdupclients ? maxdupclients : MAXCLIENTS;
     serverhost->intercept = serverinfointercept;
-    address.port = server::laninfoport();
+    address.port = server::laninfoport() + serverinstance;
     lansock = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
     if(lansock != ENET_SOCKET_NULL && (enet_socket_set_option(lansock, ENET_SOCKOPT_REUSEADDR, 1) < 0 || enet_socket_bind(lansock, &address) < 0))
     {
@@ -1073,9 +1776,47 @@ bool setuplistenserver(bool dedicated)
     }
     if(lansock == ENET_SOCKET_NULL) conoutf(CON_WARN, "WARNING: could not create LAN server info socket");
     else enet_socket_set_option(lansock, ENET_SOCKOPT_NONBLOCK, 1);
+    setupmetrics();
     return true;
 }
 
+// multi-instance dedicated server: config, identifiers and the entities of all maps in the rotation
+// are set up once, after which forked instances share them copy-on-write, each hosting its own match;
+// instance i listens on the server and LAN info ports plus i. The game keeps its match state in
+// globals, so instances are processes rather than threads, and Windows without fork() runs just one
+VAR(serverinstances, 1, 1, 64);
+
+static void forkinstances()
+{
+#ifndef WIN32
+    if(serverinstances <= 1) return;
+    server::preloadmaps();
+    int baseport = serverport <= 0 ? server::serverport() : serverport, instance = 0;
+    signal(SIGCHLD, SIG_IGN);
+    pid_t parent = getpid();
+    for(int i = 1; i < serverinstances; i++)
+    {
+        fflush(NULL);
+        pid_t pid = fork();
+        if(pid < 0) { logoutf("could not fork server instance %d", i); break; }
+        if(!pid)
+        {
+#ifdef __linux__
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            // the parent may have exited before the death signal was armed
+            if(getppid() != parent) _exit(EXIT_FAILURE);
+#endif
+            instance = i;
+            break;
+        }
+    }
+    serverport = baseport + instance;
+    if(metricsport) metricsport += instance;
+    loginstance = serverinstance = instance;
+    logoutf("server instance %d of %d on port %d", instance, serverinstances, serverport);
+#endif
+}
+
 void initserver(bool listen, bool dedicated)
 {
     if(dedicated)
@@ -1087,6 +1828,8 @@ void initserver(bool listen, bool dedicated)
 
     execfile("config/server-init.cfg", false);
 
+    if(listen && dedicated) forkinstances();
+
     if(listen) setuplistenserver(dedicated);
 
     server::serverinit();
@@ -853,4 +853,5 @@ extern Slot dummyslot;
 extern VSlot dummyvslot;
 extern vector<Slot *> slots;
 extern vector<VSlot *> vslots;
+extern vector<DecalSlot *> decalslots;
 
@@ -0,0 +1,112 @@
+// workers.cpp: persistent pool of threads that split independent engine jobs with the main thread
+
+#include "engine/engine.h"
+
+static vector<SDL_Thread *> workers;
+static SDL_mutex *workmutex = NULL;
+static SDL_cond *workstart = NULL, *workfinish = NULL;
+static SDL_atomic_t nextjob;
+static workfunc curwork = NULL;
+static void *curworkdata = NULL;
+static int numjobs = 0, workgeneration = 0, workbusy = 0;
+static bool workactive = false, workquit = false;
+
+VARP(workerthreads, 0, 0, 16);              // 0 uses one thread per cpu
+
+static void dojobs(int thread)
+{
+    for(;;)
+    {
+        int job = SDL_AtomicAdd(&nextjob, 1);
+        if(job >= numjobs) break;
+        curwork(job, thread, curworkdata);
+    }
+}
+
+static int workerthread(void *data)
+{
+    int thread = int(size_t(data)), generation = 0;
+    SDL_LockMutex(workmutex);
+    for(;;)
+    {
+        if(workquit) break;
+        // a worker only joins while the jobs are still being handed out, so none can linger into the next batch
+        if(!workactive || generation == workgeneration) { SDL_CondWait(workstart, workmutex); continue; }
+        generation = workgeneration;
+        workbusy++;
+        SDL_UnlockMutex(workmutex);
+        dojobs(thread);
+        SDL_LockMutex(workmutex);
+        if(--workbusy <= 0) SDL_CondSignal(workfinish);
+    }
+    SDL_UnlockMutex(workmutex);
+    return 0;
+}
+
+static void stopworkers()
+{
+    if(workers.empty()) return;
+    SDL_LockMutex(workmutex);
+    workquit = true;
+    SDL_CondBroadcast(workstart);
+    SDL_UnlockMutex(workmutex);
+    loopv(workers) SDL_WaitThread(workers[i], NULL);
+    workers.setsize(0);
+    workquit = false;
+}
+
+int numworkerthreads()
+{
+    return clamp(workerthreads > 0 ? workerthreads : numcpus, 1, 16);
+}
+
+static void startworkers()
+{
+    int numworkers = numworkerthreads() - 1;
+    if(workers.length() == numworkers) return;
+    stopworkers();
+    if(!workmutex) workmutex = SDL_CreateMutex();
+    if(!workstart) workstart = SDL_CreateCond();
+    if(!workfinish) workfinish = SDL_CreateCond();
+    loopi(numworkers)
+    {
+        SDL_Thread *thread = SDL_CreateThread(workerthread, "worker", (void *)size_t(i+1));
+        if(!thread) break;
+        workers.add(thread);
+    }
+}
+
+// runs fn for every job in [0, n) and returns once all of them are done; the main thread works as
+// thread 0 and workers as 1 to numworkerthreads()-1, so per-thread scratch can be indexed by it
+void runworkers(int n, workfunc fn, void *data)
+{
+    if(n <= 0) return;
+    if(workactive || n == 1 || numworkerthreads() <= 1)
+    {
+        loopi(n) fn(i, 0, data);
+        return;
+    }
+    startworkers();
+
+    SDL_LockMutex(workmutex);
+    curwork = fn;
+    curworkdata = data;
+    numjobs = n;
+    SDL_AtomicSet(&nextjob, 0);
+    workgeneration++;
+    workactive = true;
+    SDL_CondBroadcast(workstart);
+    SDL_UnlockMutex(workmutex);
+
+    dojobs(0);
+
+    SDL_LockMutex(workmutex);
+    while(workbusy > 0) SDL_CondWait(workfinish, workmutex);
+    workactive = false;
+    SDL_UnlockMutex(workmutex);
+}
+
+void cleanupworkers()
+{
+    stopworkers();
+}
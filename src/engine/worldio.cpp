@@ -2,6 +2,8 @@
 
 #include "engine/engine.h"
 
+#include <sys/stat.h>
+
 static void fixent(entity &e, int version)
 {
     if(version <= 0)
@@ -48,7 +50,7 @@ bool supportedgametype(const string &gametype)
     return (strcmp(gametype, game::gameident()) == 0) || (strcmp(gametype, "Tesseract") == 0);
 }
 
-bool loadents(const char *fname, vector<entity> &ents, uint *crc)
+static bool loadentsfile(const char *fname, vector<entity> &ents, uint *crc)
 {
     defformatstring(ogzname, "media/map/%s.ogz", fname);
     path(ogzname);
@@ -118,6 +120,54 @@ bool loadents(const char *fname, vector<entity> &ents, uint *crc)
     return true;
 }
 
+// entities loaded ahead of time so that server instances forked afterwards share them, kept only
+// for as long as the map file on disk has the same modification time and size
+struct preloadedents
+{
+    vector<entity> ents;
+    uint crc;
+    bool loaded;
+    time_t mtime;
+    long long size;
+};
+static hashtable<const char *, preloadedents> preloaded;
+
+static void mapfilestamp(const char *fname, time_t &mtime, long long &size)
+{
+    defformatstring(ogzname, "media/map/%s.ogz", fname);
+    struct stat st;
+    if(stat(findfile(path(ogzname), "rb"), &st) < 0) { mtime = 0; size = -1; }
+    else { mtime = st.st_mtime; size = st.st_size; }
+}
+
+static void loadpreloadedents(const char *fname, preloadedents &p)
+{
+    mapfilestamp(fname, p.mtime, p.size);
+    p.ents.setsize(0);
+    p.crc = 0;
+    p.loaded = loadentsfile(fname, p.ents, &p.crc);
+}
+
+void preloadents(const char *fname)
+{
+    if(!fname[0] || preloaded.access(fname)) return;
+    loadpreloadedents(fname, preloaded[newstring(fname)]);
+}
+
+bool loadents(const char *fname, vector<entity> &ents, uint *crc)
+{
+    preloadedents *p = preloaded.access(fname);
+    if(!p) return loadentsfile(fname, ents, crc);
+    time_t mtime;
+    long long size;
+    mapfilestamp(fname, mtime, size);
+    if(mtime != p->mtime || size != p->size) loadpreloadedents(fname, *p);
+    if(!p->loaded) return false;
+    ents.put(p->ents.getbuf(), p->ents.length());
+    if(crc) *crc = p->crc;
+    return true;
+}
+
 #ifndef STANDALONE
 string ogzname, bakname, cfgname, picname;
 
@@ -664,6 +714,7 @@ bool save_world(const char *mname, bool nolms)
         if(getnumviewcells()>0) { renderprogress(0, "saving pvs..."); savepvs(f); }
     }
     if(shouldsaveblendmap()) { renderprogress(0, "saving blendmap..."); saveblendmap(f); }
+    if(!nolms) savebakedvas(f);
 
     delete f;
     conoutf("wrote map file %s", ogzname);
@@ -855,7 +906,8 @@ bool load_world(const char *mname, const char *cname)        // still supports a
     }
 
     mapcrc = f->getcrc();
-    delete f;
+    // baked vas follow the map data, but can only be checked against the slots once the map config has run
+    if(failed || !findbakedvas(f, mapcrc)) DELETEP(f);
 
     conoutf("read map %s (%.1f seconds)", ogzname, (SDL_GetTicks()-loadingstart)/1000.0f);
 
@@ -875,7 +927,8 @@ bool load_world(const char *mname, const char *cname)        // still supports a
 
     entitiesinoctanodes();
     attachentities();
-    allchanged(true);
+    allchanged(true, f);
+    DELETEP(f);
 
     renderbackground("loading...", mapshot, mname, game::getmapinfo());
 
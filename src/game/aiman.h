@@ -99,6 +99,7 @@ namespace aiman
                 ci->ownernum = owner ? owner->clientnum : -1;
                 if(owner) owner->bots.add(ci);
                 ci->aireinit = 2;
+                resetposclient(ci->clientnum);
                 dorefresh = true;
                 return true;
             }
@@ -108,6 +109,7 @@ namespace aiman
         if(!bots[cn]) bots[cn] = new clientinfo;
         clientinfo *ci = bots[cn];
         ci->clientnum = MAXCLIENTS + cn;
+        resetposclient(ci->clientnum);
         ci->state.aitype = AI_BOT;
         clientinfo *owner = findaiclient();
         ci->ownernum = owner ? owner->clientnum : -1;
@@ -135,6 +137,7 @@ namespace aiman
         clientinfo *owner = (clientinfo *)getclientinfo(ci->ownernum);
         if(owner) owner->bots.removeobj(ci);
         clients.removeobj(ci);
+        resetposclient(ci->clientnum);
         DELETEP(bots[cn]);
         dorefresh = true;
     }
@@ -158,6 +161,7 @@ namespace aiman
             if(ci->aireinit == 2)
             {
                 ci->reassign();
+                resetposclient(ci->clientnum);
                 if(ci->state.state==CS_ALIVE) sendspawn(ci);
                 else sendresume(ci);
             }
@@ -923,9 +923,14 @@ namespace game
         memset(connectpass, 0, sizeof(connectpass));
     }
 
+    int posack = -1;
+    bool sendposack = false;
+
     void gameconnect(bool _remote)
     {
         remote = _remote;
+        posack = -1;
+        sendposack = false;
     }
 
     void gamedisconnect(bool cleanup)
@@ -940,6 +945,8 @@ namespace game
         messages.setsize(0);
         messagereliable = false;
         messagecn = -1;
+        posack = -1;
+        sendposack = false;
         player1->respawn();
         player1->lifesequence = 0;
         player1->state = CS_ALIVE;
@@ -1076,6 +1083,12 @@ namespace game
             messagereliable = false;
             messagecn = -1;
         }
+        if(sendposack)
+        {
+            putint(p, N_POSACK);
+            putint(p, posack);
+            sendposack = false;
+        }
         if(totalmillis-lastping>250)
         {
             putint(p, N_PING);
@@ -1149,80 +1162,112 @@ namespace game
         }
     }
 
+    static void updateposition(int cn, const posfields &f)
+    {
+        int physstate = f.physstate, flags = f.flags;
+        vec o, vel, falling;
+        float yaw, pitch, roll;
+        loopk(3) o[k] = f.o[k]/DMF;
+        yaw = f.dir%360;
+        pitch = clamp(f.dir/360, 0, 180)-90;
+        roll = clamp(f.roll, 0, 180)-90;
+        vecfromyawpitch(f.veldir%360, clamp(f.veldir/360, 0, 180)-90, 1, 0, vel);
+        vel.mul(f.vel/DVELF);
+        if(flags&(1<<4))
+        {
+            if(flags&(1<<6)) vecfromyawpitch(f.falldir%360, clamp(f.falldir/360, 0, 180)-90, 1, 0, falling);
+            else falling = vec(0, 0, -1);
+            falling.mul(f.fall/DVELF);
+        }
+        else falling = vec(0, 0, 0);
+        int seqcolor = (physstate>>3)&1;
+        gameent *d = getclient(cn);
+        if(!d || d->lifesequence < 0 || seqcolor!=(d->lifesequence&1) || d->state==CS_DEAD) return;
+        float oldyaw = d->yaw, oldpitch = d->pitch, oldroll = d->roll;
+        d->yaw = yaw;
+        d->pitch = pitch;
+        d->roll = roll;
+        d->move = (physstate>>4)&2 ? -1 : (physstate>>4)&1;
+        d->strafe = (physstate>>6)&2 ? -1 : (physstate>>6)&1;
+        d->crouching = (flags&(1<<8))!=0 ? -1 : abs(d->crouching);
+        vec oldpos(d->o);
+        d->o = o;
+        d->o.z += d->eyeheight;
+        d->vel = vel;
+        d->falling = falling;
+        d->physstate = physstate&7;
+        updatephysstate(d);
+        updatepos(d);
+        if(smoothmove && d->smoothmillis>=0 && oldpos.dist(d->o) < smoothdist)
+        {
+            d->newpos = d->o;
+            d->newyaw = d->yaw;
+            d->newpitch = d->pitch;
+            d->newroll = d->roll;
+            d->o = oldpos;
+            d->yaw = oldyaw;
+            d->pitch = oldpitch;
+            d->roll = oldroll;
+            (d->deltapos = oldpos).sub(d->newpos);
+            d->deltayaw = oldyaw - d->newyaw;
+            if(d->deltayaw > 180) d->deltayaw -= 360;
+            else if(d->deltayaw < -180) d->deltayaw += 360;
+            d->deltapitch = oldpitch - d->newpitch;
+            d->deltaroll = oldroll - d->newroll;
+            d->smoothmillis = lastmillis;
+        }
+        else d->smoothmillis = 0;
+        if(d->state==CS_LAGGED || d->state==CS_SPAWNING) d->state = CS_ALIVE;
+    }
+
     void parsepositions(ucharbuf &p)
     {
-        int type;
+        int type, frame = -1;
+        bool missed = false, unapplied = false;
         while(p.remaining()) switch(type = getint(p))
         {
             case N_DEMOPACKET: break;
             case N_POS:                        // position of another client
             {
-                int cn = getuint(p), physstate = p.get(), flags = getuint(p);
-                vec o, vel, falling;
-                float yaw, pitch, roll;
-                loopk(3)
+                int cn = getuint(p);
+                posfields f;
+                f.parse(p);
+                updateposition(cn, f);
+                break;
+            }
+
+            case N_POSFRAME:
+                frame = p.get();
+                break;
+
+            case N_POSDELTA:                   // position of another client relative to an acknowledged baseline
+            {
+                int cn = getuint(p), seq = p.get(), dist = p.get();
+                gameent *d = getclient(cn);
+                posbaseline *base = NULL;
+                if(dist)
                 {
-                    int n = p.get(); n |= p.get()<<8; if(flags&(1<<k)) { n |= p.get()<<16; if(n&0x800000) n |= ~0U<<24; }
-                    o[k] = n/DMF;
+                    int baseseq = (seq - dist)&0xFF;
+                    if(d && d->posbaselines && d->posbaselines[baseseq%POSHISTORY].seq == baseseq) base = &d->posbaselines[baseseq%POSHISTORY];
+                    else missed = true;
                 }
-                int dir = p.get(); dir |= p.get()<<8;
-                yaw = dir%360;
-                pitch = clamp(dir/360, 0, 180)-90;
-                roll = clamp(int(p.get()), 0, 180)-90;
-                int mag = p.get(); if(flags&(1<<3)) mag |= p.get()<<8;
-                dir = p.get(); dir |= p.get()<<8;
-                vecfromyawpitch(dir%360, clamp(dir/360, 0, 180)-90, 1, 0, vel);
-                vel.mul(mag/DVELF);
-                if(flags&(1<<4))
+                posfields f;
+                f.getdelta(p, base ? base->pos : posfields());
+                if(dist && !base) break;
+                // without a player to hold the baseline this frame can't be acknowledged
+                if(!d) unapplied = true;
+                else
                 {
-                    mag = p.get(); if(flags&(1<<5)) mag |= p.get()<<8;
-                    if(flags&(1<<6))
+                    if(!d->posbaselines)
                     {
-                        dir = p.get(); dir |= p.get()<<8;
-                        vecfromyawpitch(dir%360, clamp(dir/360, 0, 180)-90, 1, 0, falling);
+                        d->posbaselines = new posbaseline[POSHISTORY];
+                        loopi(POSHISTORY) d->posbaselines[i].seq = -1;
                     }
-                    else falling = vec(0, 0, -1);
-                    falling.mul(mag/DVELF);
+                    posbaseline &b = d->posbaselines[seq%POSHISTORY];
+                    b.seq = seq;
+                    b.pos = f;
                 }
-                else falling = vec(0, 0, 0);
-                int seqcolor = (physstate>>3)&1;
-                gameent *d = getclient(cn);
-                if(!d || d->lifesequence < 0 || seqcolor!=(d->lifesequence&1) || d->state==CS_DEAD) continue;
-                float oldyaw = d->yaw, oldpitch = d->pitch, oldroll = d->roll;
-                d->yaw = yaw;
-                d->pitch = pitch;
-                d->roll = roll;
-                d->move = (physstate>>4)&2 ? -1 : (physstate>>4)&1;
-                d->strafe = (physstate>>6)&2 ? -1 : (physstate>>6)&1;
-                d->crouching = (flags&(1<<8))!=0 ? -1 : abs(d->crouching);
-                vec oldpos(d->o);
-                d->o = o;
-                d->o.z += d->eyeheight;
-                d->vel = vel;
-                d->falling = falling;
-                d->physstate = physstate&7;
-                updatephysstate(d);
-                updatepos(d);
-                if(smoothmove && d->smoothmillis>=0 && oldpos.dist(d->o) < smoothdist)
-                {
-                    d->newpos = d->o;
-                    d->newyaw = d->yaw;
-                    d->newpitch = d->pitch;
-                    d->newroll = d->roll;
-                    d->o = oldpos;
-                    d->yaw = oldyaw;
-                    d->pitch = oldpitch;
-                    d->roll = oldroll;
-                    (d->deltapos = oldpos).sub(d->newpos);
-                    d->deltayaw = oldyaw - d->newyaw;
-                    if(d->deltayaw > 180) d->deltayaw -= 360;
-                    else if(d->deltayaw < -180) d->deltayaw += 360;
-                    d->deltapitch = oldpitch - d->newpitch;
-                    d->deltaroll = oldroll - d->newroll;
-                    d->smoothmillis = lastmillis;
-                }
-                else d->smoothmillis = 0;
-                if(d->state==CS_LAGGED || d->state==CS_SPAWNING) d->state = CS_ALIVE;
+                updateposition(cn, f);
                 break;
             }
 
@@ -1248,6 +1293,16 @@ namespace game
                 neterr("type");
                 return;
         }
+        if(frame >= 0)
+        {
+            // acknowledge the frame so its positions become baselines, or ask for full updates
+            if(missed) { posack = -1; sendposack = true; }
+            else if(!unapplied)
+            {
+                if(!sendposack || posack >= 0) posack = frame;
+                sendposack = true;
+            }
+        }
     }
 
     void parsestate(gameent *d, ucharbuf &p, bool resume = false)
@@ -1825,6 +1880,16 @@ namespace game
             case N_DEMOPLAYBACK:
             {
                 int on = getint(p);
+                if(on==2)
+                {
+                    // the server is seeking and replays a keyframe next, so forget everything from before it
+                    getint(p);
+                    clearclients(false);
+                    clearbouncers();
+                    clearprojectiles();
+                    entities::resetspawns();
+                    break;
+                }
                 if(on) player1->state = CS_SPECTATOR;
                 else clearclients();
                 demoplayback = on!=0;
@@ -2075,6 +2140,14 @@ namespace game
     }
     ICOMMAND(cleardemos, "i", (int *val), cleardemos(*val));
 
+    void seekdemo(int millis, bool relative)
+    {
+        if(!m_demo || (remote && player1->privilege<PRIV_MASTER)) return;
+        addmsg(N_SEEKDEMO, "rii", millis, relative ? 1 : 0);
+    }
+    ICOMMAND(seekdemo, "f", (float *secs), seekdemo(int(*secs*1000), false));
+    ICOMMAND(skipdemo, "f", (float *secs), seekdemo(int(*secs*1000), true));
+
     void getdemo(int i)
     {
         if(i<=0) conoutf("getting demo...");
@@ -213,6 +213,8 @@ enum
     N_SWITCHNAME, N_SWITCHMODEL, N_SWITCHCOLOR, N_SWITCHTEAM,
     N_SERVCMD,
     N_DEMOPACKET,
+    N_POSFRAME, N_POSDELTA, N_POSACK,
+    N_SEEKDEMO,
     NUMMSG
 };
 
@@ -241,15 +243,20 @@ static const int msgsizes[] =               // size inclusive message token, 0 f
     N_SWITCHNAME, 0, N_SWITCHMODEL, 2, N_SWITCHCOLOR, 2, N_SWITCHTEAM, 2,
     N_SERVCMD, 0,
     N_DEMOPACKET, 0,
+    N_POSFRAME, 0, N_POSDELTA, 0, N_POSACK, 2,
+    N_SEEKDEMO, 3,
     -1
 };
 
 #define RESSERACT_SERVER_PORT 42010
 #define RESSERACT_LANINFO_PORT 42008
 #define RESSERACT_MASTER_PORT 42009
-#define PROTOCOL_VERSION 2              // bump when protocol changes
-#define DEMO_VERSION 1                  // bump when demo format changes
+#define PROTOCOL_VERSION 4              // bump when protocol changes
+#define DEMO_VERSION 2                  // bump when demo format changes
+#define DEMO_LEGACY_VERSION 1           // gzipped record stream without an index
 #define DEMO_MAGIC "RESSERACT_DEMO\0\0"
+#define DEMO_INDEX_MAGIC "RESSERACT_INDEX\0"
+#define DEMO_KEYFRAME -1                // channel of the state snapshots that start each demo segment
 
 struct demoheader
 {
@@ -257,6 +264,113 @@ struct demoheader
     int version, protocol;
 };
 
+struct demoblockheader
+{
+    int millis, rawlen, packedlen;
+};
+
+struct demoindexentry
+{
+    int millis, offset;
+};
+
+struct demoindexfooter
+{
+    int numblocks, interval;
+    char magic[16];
+};
+
+#define POSHISTORY 64                   // number of past positions kept per player as delta baselines
+
+// the fields of an N_POS update, which the server may instead send as an N_POSDELTA that only
+// contains the fields that changed since a baseline the receiver has acknowledged with N_POSACK
+struct posfields
+{
+    enum
+    {
+        F_PHYSSTATE = 1<<0, F_FLAGS = 1<<1, F_X = 1<<2, F_Y = 1<<3, F_Z = 1<<4, F_DIR = 1<<5, F_ROLL = 1<<6,
+        F_VEL = 1<<7, F_VELDIR = 1<<8, F_FALL = 1<<9, F_FALLDIR = 1<<10
+    };
+
+    int physstate, flags, o[3], dir, roll, vel, veldir, fall, falldir;
+
+    posfields() : physstate(0), flags(0), dir(0), roll(0), vel(0), veldir(0), fall(0), falldir(0) { o[0] = o[1] = o[2] = 0; }
+
+    // parses an N_POS body following the client number
+    void parse(ucharbuf &p)
+    {
+        physstate = p.get();
+        flags = getuint(p);
+        loopk(3)
+        {
+            int n = p.get(); n |= p.get()<<8; if(flags&(1<<k)) { n |= p.get()<<16; if(n&0x800000) n |= ~0U<<24; }
+            o[k] = n;
+        }
+        dir = p.get(); dir |= p.get()<<8;
+        roll = p.get();
+        vel = p.get(); if(flags&(1<<3)) vel |= p.get()<<8;
+        veldir = p.get(); veldir |= p.get()<<8;
+        fall = falldir = 0;
+        if(flags&(1<<4))
+        {
+            fall = p.get(); if(flags&(1<<5)) fall |= p.get()<<8;
+            if(flags&(1<<6)) { falldir = p.get(); falldir |= p.get()<<8; }
+        }
+    }
+
+    int changed(const posfields &base) const
+    {
+        int mask = 0;
+        if(physstate != base.physstate) mask |= F_PHYSSTATE;
+        if(flags != base.flags) mask |= F_FLAGS;
+        loopk(3) if(o[k] != base.o[k]) mask |= F_X<<k;
+        if(dir != base.dir) mask |= F_DIR;
+        if(roll != base.roll) mask |= F_ROLL;
+        if(vel != base.vel) mask |= F_VEL;
+        if(veldir != base.veldir) mask |= F_VELDIR;
+        if(fall != base.fall) mask |= F_FALL;
+        if(falldir != base.falldir) mask |= F_FALLDIR;
+        return mask;
+    }
+
+    template<class T>
+    void putdelta(T &p, const posfields &base) const
+    {
+        int mask = changed(base);
+        putuint(p, mask);
+        if(mask&F_PHYSSTATE) p.put(physstate);
+        if(mask&F_FLAGS) putuint(p, flags);
+        loopk(3) if(mask&(F_X<<k)) putint(p, o[k] - base.o[k]);
+        if(mask&F_DIR) putuint(p, dir);
+        if(mask&F_ROLL) p.put(roll);
+        if(mask&F_VEL) putuint(p, vel);
+        if(mask&F_VELDIR) putuint(p, veldir);
+        if(mask&F_FALL) putuint(p, fall);
+        if(mask&F_FALLDIR) putuint(p, falldir);
+    }
+
+    void getdelta(ucharbuf &p, const posfields &base)
+    {
+        *this = base;
+        int mask = getuint(p);
+        if(mask&F_PHYSSTATE) physstate = p.get();
+        if(mask&F_FLAGS) flags = getuint(p);
+        loopk(3) if(mask&(F_X<<k)) o[k] += getint(p);
+        if(mask&F_DIR) dir = getuint(p);
+        if(mask&F_ROLL) roll = p.get();
+        if(mask&F_VEL) vel = getuint(p);
+        if(mask&F_VELDIR) veldir = getuint(p);
+        if(mask&F_FALL) fall = getuint(p);
+        if(mask&F_FALLDIR) falldir = getuint(p);
+    }
+};
+
+struct posbaseline
+{
+    int seq;
+    posfields pos;
+};
+
 #define MAXNAMELEN 15
 
 enum
@@ -392,8 +506,9 @@ struct gameent : dynent, gamestate
     int ownernum, lastnode;
 
     vec muzzle;
+    posbaseline *posbaselines;
 
-    gameent() : weight(100), clientnum(-1), privilege(PRIV_NONE), lastupdate(0), plag(0), ping(0), lifesequence(0), respawned(-1), suicided(-1), lastpain(0), frags(0), flags(0), deaths(0), totaldamage(0), totalshots(0), edit(NULL), smoothmillis(-1), team(0), playermodel(-1), playercolor(0), ai(NULL), ownernum(-1), muzzle(-1, -1, -1)
+    gameent() : weight(100), clientnum(-1), privilege(PRIV_NONE), lastupdate(0), plag(0), ping(0), lifesequence(0), respawned(-1), suicided(-1), lastpain(0), frags(0), flags(0), deaths(0), totaldamage(0), totalshots(0), edit(NULL), smoothmillis(-1), team(0), playermodel(-1), playercolor(0), ai(NULL), ownernum(-1), muzzle(-1, -1, -1), posbaselines(NULL)
     {
         name[0] = info[0] = 0;
         respawn();
@@ -402,6 +517,7 @@ struct gameent : dynent, gamestate
     {
         freeeditinfo(edit);
         if(ai) delete ai;
+        DELETEA(posbaselines);
     }
 
     void hitpush(int damage, const vec &dir, gameent *actor, int atk)
@@ -1,5 +1,10 @@
 #include "game/game.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 namespace game
 {
     void parseoptions(vector<const char *> &args)
@@ -30,23 +35,6 @@ namespace server
 
     struct clientinfo;
 
-    struct gameevent
-    {
-        virtual ~gameevent() {}
-
-        virtual bool flush(clientinfo *ci, int fmillis);
-        virtual void process(clientinfo *ci) {}
-
-        virtual bool keepable() const { return false; }
-    };
-
-    struct timedevent : gameevent
-    {
-        int millis;
-
-        bool flush(clientinfo *ci, int fmillis);
-    };
-
     struct hitinfo
     {
         int target;
@@ -56,35 +44,117 @@ namespace server
         vec dir;
     };
 
-    struct shotevent : timedevent
+    enum { EV_SHOT = 0, EV_EXPLODE, EV_SUICIDE, EV_PICKUP };
+
+    // events are plain records queued by value, so a burst of shots costs no allocations and
+    // processing is a switch over contiguous memory
+    struct gameevent
     {
-        int id, atk;
+        int type, millis;
+        int id, atk;                    // entity for pickups
         vec from, to;
-        vector<hitinfo> hits;
+        int firsthit, numhits;
 
-        void process(clientinfo *ci);
+        bool timed() const { return type==EV_SHOT || type==EV_EXPLODE; }
+        bool keepable() const { return type==EV_EXPLODE; }
     };
 
-    struct explodeevent : timedevent
+    // pending events of a client along with the hits they reference, consumed from the front, reset
+    // as a whole once drained and compacted once more than half of it is consumed
+    struct eventqueue
     {
-        int id, atk;
+        vector<gameevent> events;
         vector<hitinfo> hits;
+        int head;
 
-        bool keepable() const { return true; }
+        eventqueue() : head(0) {}
 
-        void process(clientinfo *ci);
-    };
+        int length() const { return events.length() - head; }
+        bool empty() const { return head >= events.length(); }
 
-    struct suicideevent : gameevent
-    {
-        void process(clientinfo *ci);
-    };
+        void clear()
+        {
+            events.setsize(0);
+            hits.setsize(0);
+            head = 0;
+        }
 
-    struct pickupevent : gameevent
-    {
-        int ent;
+        gameevent &add(int type)
+        {
+            gameevent &e = events.add();
+            e.type = type;
+            e.millis = 0;
+            e.firsthit = hits.length();
+            e.numhits = 0;
+            return e;
+        }
+
+        hitinfo &addhit(gameevent &e)
+        {
+            e.numhits++;
+            return hits.add();
+        }
+
+        void droplast()
+        {
+            hits.setsize(events.last().firsthit);
+            events.drop();
+            if(empty()) clear();
+        }
+
+        hitinfo *gethits(const gameevent &e) { return hits.getbuf() + e.firsthit; }
+
+        gameevent &front() { return events[head]; }
 
-        void process(clientinfo *ci);
+        // moves the live events and their hits down to the start of the storage
+        void compact()
+        {
+            int numhits = 0;
+            for(int i = head; i < events.length(); i++)
+            {
+                gameevent &e = events[i];
+                if(e.firsthit != numhits) loopj(e.numhits) hits[numhits + j] = hits[e.firsthit + j];
+                e.firsthit = numhits;
+                numhits += e.numhits;
+                events[i - head] = e;
+            }
+            events.setsize(events.length() - head);
+            hits.setsize(numhits);
+            head = 0;
+        }
+
+        void pop()
+        {
+            if(++head >= events.length()) clear();
+            else if(head > events.length()/2) compact();
+        }
+
+        // drops everything except explosions, whose projectiles are still in flight
+        void cleartimed()
+        {
+            int keep = head;
+            for(int i = head; i < events.length(); i++) if(events[i].keepable()) events[keep++] = events[i];
+            events.setsize(keep);
+            if(empty()) clear();
+            else compact();
+        }
+
+        template<class F>
+        void flush(int fmillis, int &lastevent, F process)
+        {
+            while(!empty())
+            {
+                gameevent &e = front();
+                if(e.timed())
+                {
+                    if(e.millis > fmillis) break;
+                    if(e.millis < lastevent) { pop(); continue; }
+                    lastevent = e.millis;
+                }
+                process(e, gethits(e));
+                pop();
+            }
+        }
     };
 
     template <int N>
@@ -203,6 +273,29 @@ namespace server
 
     extern int gamemillis, nextexceeded;
 
+    struct posinterest
+    {
+        uint seq;
+        int millis, baseline;
+
+        posinterest() : seq(0), millis(0), baseline(-1) {}
+    };
+
+    #define POSFRAMES 16
+
+    struct posframeentry
+    {
+        int cn, num;
+    };
+
+    struct posframe
+    {
+        int id;
+        vector<posframeentry> sent;
+
+        posframe() : id(-1) {}
+    };
+
     struct clientinfo
     {
         int clientnum, ownernum, connectmillis, sessionid, overflow;
@@ -213,10 +306,15 @@ namespace server
         bool connected, local, timesync;
         int gameoffset, lastevent, pushed, exceeded;
         servstate state;
-        vector<gameevent *> events;
+        eventqueue events;
         vector<uchar> position, messages;
         uchar *wsdata;
         int wslen;
+        uint posseq, recordedposseq;
+        vector<posinterest> posinterests;
+        posfields posstate, poshistory[POSHISTORY];
+        int posnum, nextposframe;
+        posframe posframes[POSFRAMES];
         vector<clientinfo *> bots;
         int ping, aireinit;
         string clientmap;
@@ -232,12 +330,12 @@ namespace server
         char *authkickreason;
 
         clientinfo() : getdemo(NULL), getmap(NULL), clipboard(NULL), authchallenge(NULL), authkickreason(NULL) { reset(); }
-        ~clientinfo() { events.deletecontents(); cleanclipboard(); cleanauth(); }
+        ~clientinfo() { cleanclipboard(); cleanauth(); }
 
-        void addevent(gameevent *e)
+        // drops the event just queued if the client can not act or is flooding
+        void checkevent()
         {
-            if(state.state==CS_SPECTATOR || events.length()>100) delete e;
-            else events.add(e);
+            if(state.state==CS_SPECTATOR || events.length()>101) events.droplast();
         }
 
         enum
@@ -247,8 +345,8 @@ namespace server
 
         int calcpushrange()
         {
-            ENetPeer *peer = getclientpeer(ownernum);
-            return PUSHMILLIS + (peer ? peer->roundTripTime + peer->roundTripTimeVariance : ENET_PEER_DEFAULT_ROUND_TRIP_TIME);
+            uint rtt, rttvar;
+            return PUSHMILLIS + (getclientrtt(ownernum, rtt, rttvar) ? rtt + rttvar : ENET_PEER_DEFAULT_ROUND_TRIP_TIME);
         }
 
         bool checkpushed(int millis, int range)
@@ -280,12 +378,66 @@ namespace server
             return state.state==CS_ALIVE && exceeded && gamemillis > exceeded + calcpushrange();
         }
 
+        posinterest &getinterest(int cn)
+        {
+            while(posinterests.length() <= cn) posinterests.add();
+            return posinterests[cn];
+        }
+
+        void addposition(const posfields &f)
+        {
+            posstate = f;
+            poshistory[++posnum%POSHISTORY] = f;
+        }
+
+        const posfields *findposition(int num) const
+        {
+            return num > 0 && num < posnum && posnum - num < POSHISTORY ? &poshistory[num%POSHISTORY] : NULL;
+        }
+
+        posframe &newposframe()
+        {
+            posframe &f = posframes[nextposframe%POSFRAMES];
+            f.id = nextposframe++;
+            f.sent.setsize(0);
+            return f;
+        }
+
+        void ackposframe(int ack)
+        {
+            if(ack < 0)
+            {
+                // the client lost track of a baseline, so fall back to full updates
+                loopv(posinterests) posinterests[i].baseline = -1;
+                return;
+            }
+            posframe &f = posframes[ack%POSFRAMES];
+            if(f.id < 0 || (f.id&0xFF) != ack) return;
+            loopv(f.sent)
+            {
+                posinterest &pi = getinterest(f.sent[i].cn);
+                pi.baseline = max(pi.baseline, f.sent[i].num);
+            }
+            f.id = -1;
+        }
+
+        // drops every baseline and pending ack for a client number that is being vacated or reused
+        void forgetposclient(int cn)
+        {
+            if(posinterests.inrange(cn)) posinterests[cn] = posinterest();
+            loopi(POSFRAMES)
+            {
+                vector<posframeentry> &sent = posframes[i].sent;
+                for(int j = sent.length()-1; j >= 0; j--) if(sent[j].cn == cn) sent.remove(j);
+            }
+        }
+
         void mapchange()
         {
             mapvote[0] = 0;
             modevote = INT_MAX;
             state.reset();
-            events.deletecontents();
+            events.clear();
             overflow = 0;
             timesync = false;
             lastevent = 0;
@@ -300,7 +452,7 @@ namespace server
         void reassign()
         {
             state.reassign();
-            events.deletecontents();
+            events.clear();
             timesync = false;
             lastevent = 0;
         }
@@ -335,6 +487,10 @@ namespace server
             connectauth = 0;
             position.setsize(0);
             messages.setsize(0);
+            posseq = recordedposseq = 0;
+            posinterests.setsize(0);
+            posnum = nextposframe = 0;
+            loopi(POSFRAMES) posframes[i].id = -1;
             ping = 0;
             aireinit = 0;
             needclipboard = 0;
@@ -597,12 +753,204 @@ namespace server
 
     vector<demofile> demos;
 
-    bool demonextmatch = false;
-    stream *demotmp = NULL, *demorecord = NULL, *demoplayback = NULL;
-    int nextplayback = 0, demomillis = 0;
-
     VAR(maxdemos, 0, 5, 25);
     VAR(maxdemosize, 0, 16, 31);
+    VAR(demoblocksize, 4, 64, 1024);
+    VAR(demomaxblocks, 2, 64, 1024);
+    VAR(demokeyframe, 1000, 10000, 600000);
+
+    // demos are recorded into large in-memory blocks that a background thread compresses into the
+    // temp file, and once recording ends the same thread reads the finished demo back, so the game
+    // thread only ever copies packets unless all blocks are in flight
+    //
+    // the demo itself is split into segments that each start with a keyframe and are compressed on
+    // their own, with an index of segment times and offsets at the end, so playback can seek directly
+    struct demowriter
+    {
+        struct block
+        {
+            uchar *data;
+            int len, keyframe;
+        };
+
+        stream *tmp;
+        demoheader hdr;
+        std::thread *thread;
+        std::mutex lock;
+        std::condition_variable cond;
+        vector<block *> pending, spare;
+        block *cur;
+        int numblocks, blocksize, stalls, nextkeyframe, lastkeyframe, interval;
+        bool finishing, keep;
+        std::atomic<bool> done;
+        std::atomic<int> written;
+        uchar *data;
+        int len;
+
+        // only touched by the writer thread
+        vector<uchar> segment, packed;
+        vector<demoindexentry> index;
+        int segmentmillis;
+
+        demowriter(stream *tmp, const demoheader &hdr) : tmp(tmp), hdr(hdr), thread(NULL), cur(NULL), numblocks(0), blocksize(demoblocksize<<10), stalls(0), nextkeyframe(0), lastkeyframe(0), interval(demokeyframe), finishing(false), keep(false), done(false), written(0), data(NULL), len(0), segmentmillis(0)
+        {
+            thread = new std::thread(&demowriter::run, this);
+        }
+
+        ~demowriter()
+        {
+            if(thread) { thread->join(); delete thread; }
+            DELETEP(tmp);
+            if(cur) { delete[] cur->data; delete cur; }
+            loopv(spare) { delete[] spare[i]->data; delete spare[i]; }
+            DELETEA(data);
+        }
+
+        block *getblock()
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if(spare.empty() && numblocks >= demomaxblocks)
+            {
+                // out of memory budget, so wait for the writer to catch up
+                stalls++;
+                cond.wait(guard, [this] { return !spare.empty(); });
+            }
+            if(spare.length()) return spare.pop();
+            numblocks++;
+            block *b = new block;
+            b->data = new uchar[blocksize];
+            b->len = 0;
+            return b;
+        }
+
+        void submit()
+        {
+            if(!cur) return;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if(cur->len > 0) pending.add(cur);
+                else spare.add(cur);
+            }
+            cur = NULL;
+            cond.notify_all();
+        }
+
+        bool needkeyframe(int millis) const { return millis - lastkeyframe >= interval; }
+
+        // everything written after this goes into a new segment starting at millis
+        void keyframe(int millis)
+        {
+            submit();
+            nextkeyframe = lastkeyframe = millis;
+        }
+
+        void write(const void *buf, int n)
+        {
+            const uchar *src = (const uchar *)buf;
+            while(n > 0)
+            {
+                if(!cur)
+                {
+                    cur = getblock();
+                    cur->keyframe = nextkeyframe;
+                    nextkeyframe = -1;
+                }
+                int chunk = min(n, blocksize - cur->len);
+                memcpy(&cur->data[cur->len], src, chunk);
+                cur->len += chunk;
+                src += chunk;
+                n -= chunk;
+                if(cur->len >= blocksize) submit();
+            }
+        }
+
+        void finish(bool keepdemo)
+        {
+            submit();
+            std::lock_guard<std::mutex> guard(lock);
+            finishing = true;
+            keep = keepdemo;
+            cond.notify_all();
+        }
+
+        void flushsegment()
+        {
+            if(segment.empty()) return;
+            uLongf packedlen = compressBound(segment.length());
+            packed.setsize(0);
+            if(compress2(packed.reserve(int(packedlen)).buf, &packedlen, segment.getbuf(), segment.length(), Z_BEST_COMPRESSION) != Z_OK) packedlen = 0;
+            demoindexentry &e = index.add();
+            e.millis = segmentmillis;
+            e.offset = int(tmp->tell());
+            demoblockheader bh = { segmentmillis, segment.length(), int(packedlen) };
+            lilswap(&bh.millis, 3);
+            tmp->write(&bh, sizeof(bh));
+            tmp->write(packed.getbuf(), int(packedlen));
+            segment.setsize(0);
+            written = int(tmp->tell());
+        }
+
+        void writeindex()
+        {
+            loopv(index) { lilswap(&index[i].millis, 2); }
+            tmp->write(index.getbuf(), index.length()*sizeof(demoindexentry));
+            demoindexfooter f;
+            f.numblocks = index.length();
+            f.interval = interval;
+            memcpy(f.magic, DEMO_INDEX_MAGIC, sizeof(f.magic));
+            lilswap(&f.numblocks, 2);
+            tmp->write(&f, sizeof(f));
+        }
+
+        void run()
+        {
+            tmp->write(&hdr, sizeof(hdr));
+            for(;;)
+            {
+                block *b;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    cond.wait(guard, [this] { return pending.length() || finishing; });
+                    if(pending.empty()) break;
+                    b = pending.remove(0);
+                }
+                if(b->keyframe >= 0)
+                {
+                    flushsegment();
+                    segmentmillis = b->keyframe;
+                }
+                segment.put(b->data, b->len);
+                b->len = 0;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    spare.add(b);
+                }
+                cond.notify_all();
+            }
+            flushsegment();
+            writeindex();
+            if(keep)
+            {
+                // the whole file is kept since the index lives at its end
+                len = int(tmp->size());
+                data = new uchar[len];
+                tmp->seek(0, SEEK_SET);
+                tmp->read(data, len);
+            }
+            DELETEP(tmp);
+            done = true;
+        }
+    };
+
+    bool demonextmatch = false;
+    demowriter *demorecord = NULL;
+    vector<demowriter *> demofinishing;
+    stream *demoplayback = NULL;
+    int nextplayback = 0, demomillis = 0;
+    // indexed playback reads one decompressed segment at a time, legacy demos stream from demoplayback
+    vector<demoindexentry> demoindex;
+    vector<uchar> demosegment;
+    int demosegmentnum = -1, demosegmentpos = 0, demointerval = 0;
     VAR(restrictdemos, 0, 1, 1);
 
     VAR(restrictpausegame, 0, 1, 1);
@@ -975,44 +1323,72 @@ namespace server
         demos.remove(0, n);
     }
 
-    void adddemo()
+    void adddemo(uchar *data, int len)
     {
-        if(!demotmp) return;
-        int len = (int)min(demotmp->size(), stream::offset((maxdemosize<<20) + 0x10000));
         demofile &d = demos.add();
         time_t t = time(NULL);
         char *timestr = ctime(&t), *trim = timestr + strlen(timestr);
         while(trim>timestr && iscubespace(*--trim)) *trim = '\0';
         formatstring(d.info, "%s: %s, %s, %.2f%s", timestr, modeprettyname(gamemode), smapname, len > 1024*1024 ? len/(1024*1024.f) : len/1024.0f, len > 1024*1024 ? "MB" : "kB");
         sendservmsgf("demo \"%s\" recorded", d.info);
-        d.data = new uchar[len];
+        d.data = data;
         d.len = len;
-        demotmp->seek(0, SEEK_SET);
-        demotmp->read(d.data, len);
-        DELETEP(demotmp);
     }
 
     void enddemorecord()
     {
         if(!demorecord) return;
 
-        DELETEP(demorecord);
-
-        if(!demotmp) return;
-        if(!maxdemos || !maxdemosize) { DELETEP(demotmp); return; }
+        if(demorecord->stalls) logoutf("demo recording waited on the writer %d times", demorecord->stalls);
+        demorecord->finish(maxdemos && maxdemosize);
+        demofinishing.add(demorecord);
+        demorecord = NULL;
+    }
 
-        prunedemos(1);
-        adddemo();
+    void checkdemorecord()
+    {
+        loopv(demofinishing)
+        {
+            demowriter *d = demofinishing[i];
+            if(!d->done) continue;
+            if(d->data)
+            {
+                prunedemos(1);
+                adddemo(d->data, d->len);
+                d->data = NULL;
+            }
+            delete d;
+            demofinishing.remove(i--);
+        }
     }
 
-    void writedemo(int chan, void *data, int len)
+    int welcomepacket(packetbuf &p, clientinfo *ci);
+    void sendwelcome(clientinfo *ci);
+
+    static void putdemorecord(int chan, const void *data, int len)
     {
-        if(!demorecord) return;
         int stamp[3] = { gamemillis, chan, len };
         lilswap(stamp, 3);
         demorecord->write(stamp, sizeof(stamp));
         demorecord->write(data, len);
-        if(demorecord->rawtell() >= (maxdemosize<<20)) enddemorecord();
+    }
+
+    // starts a new segment with a snapshot of the game state, which playback only sends after seeking
+    static void writedemokeyframe()
+    {
+        demorecord->keyframe(gamemillis);
+        packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
+        welcomepacket(p, NULL);
+        putdemorecord(DEMO_KEYFRAME, p.buf, p.len);
+    }
+
+    void writedemo(int chan, void *data, int len)
+    {
+        if(!demorecord) return;
+        serverphasetimer timer(SERVERPHASE_DEMO);
+        if(demorecord->needkeyframe(gamemillis)) writedemokeyframe();
+        putdemorecord(chan, data, len);
+        if(demorecord->written >= (maxdemosize<<20)) enddemorecord();
     }
 
     void recordpacket(int chan, void *data, int len)
@@ -1020,29 +1396,23 @@ namespace server
         writedemo(chan, data, len);
     }
 
-    int welcomepacket(packetbuf &p, clientinfo *ci);
-    void sendwelcome(clientinfo *ci);
-
     void setupdemorecord()
     {
         if(!m_mp(gamemode) || m_edit) return;
 
-        demotmp = opentempfile("demorecord", "w+b");
-        if(!demotmp) return;
-
-        stream *f = opengzfile(NULL, "wb", demotmp);
-        if(!f) { DELETEP(demotmp); return; }
+        stream *tmp = opentempfile("demorecord", "w+b");
+        if(!tmp) return;
 
         sendservmsg("recording demo");
 
-        demorecord = f;
-
         demoheader hdr;
         memcpy(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic));
         hdr.version = DEMO_VERSION;
         hdr.protocol = PROTOCOL_VERSION;
         lilswap(&hdr.version, 2);
-        demorecord->write(&hdr, sizeof(demoheader));
+
+        demorecord = new demowriter(tmp, hdr);
+        demorecord->keyframe(gamemillis);
 
         packetbuf p(MAXTRANS, ENET_PACKET_FLAG_RELIABLE);
         welcomepacket(p, NULL);
@@ -1106,6 +1476,9 @@ namespace server
     {
         if(!demoplayback) return;
         DELETEP(demoplayback);
+        demoindex.setsize(0);
+        demosegment.setsize(0);
+        demosegmentnum = -1;
 
         loopv(clients) sendf(clients[i]->clientnum, 1, "ri3", N_DEMOPLAYBACK, 0, clients[i]->clientnum);
 
@@ -1114,6 +1487,82 @@ namespace server
         loopv(clients) sendwelcome(clients[i]);
     }
 
+    static bool loaddemosegment(int n)
+    {
+        if(!demoindex.inrange(n) || !demoplayback->seek(demoindex[n].offset, SEEK_SET)) return false;
+        demoblockheader bh;
+        if(demoplayback->read(&bh, sizeof(bh))!=sizeof(bh)) return false;
+        lilswap(&bh.millis, 3);
+        if(bh.rawlen < 0 || bh.rawlen > (1<<28) || bh.packedlen <= 0 || bh.packedlen > (1<<28)) return false;
+        static vector<uchar> packed;
+        packed.setsize(0);
+        if(demoplayback->read(packed.reserve(bh.packedlen).buf, bh.packedlen)!=size_t(bh.packedlen)) return false;
+        demosegment.setsize(0);
+        uLongf rawlen = bh.rawlen;
+        if(uncompress(demosegment.reserve(bh.rawlen).buf, &rawlen, packed.getbuf(), bh.packedlen)!=Z_OK || rawlen!=uLongf(bh.rawlen)) return false;
+        demosegment.advance(bh.rawlen);
+        demosegmentnum = n;
+        demosegmentpos = 0;
+        return true;
+    }
+
+    static bool loaddemoindex()
+    {
+        demoindexfooter f;
+        stream::offset size = demoplayback->size();
+        if(size < stream::offset(sizeof(demoheader) + sizeof(f)) ||
+           !demoplayback->seek(size - sizeof(f), SEEK_SET) ||
+           demoplayback->read(&f, sizeof(f))!=sizeof(f) ||
+           memcmp(f.magic, DEMO_INDEX_MAGIC, sizeof(f.magic)))
+            return false;
+        lilswap(&f.numblocks, 2);
+        if(f.numblocks <= 0 || f.interval <= 0 || stream::offset(sizeof(demoheader) + f.numblocks*sizeof(demoindexentry) + sizeof(f)) > size) return false;
+        demoindex.setsize(0);
+        demoindexentry *e = demoindex.pad(f.numblocks);
+        if(!demoplayback->seek(size - sizeof(f) - f.numblocks*sizeof(demoindexentry), SEEK_SET) ||
+           demoplayback->read(e, f.numblocks*sizeof(demoindexentry))!=f.numblocks*sizeof(demoindexentry))
+            return false;
+        lilswap(&e->millis, 2*f.numblocks);
+        demointerval = f.interval;
+        return loaddemosegment(0);
+    }
+
+    // keyframes are written roughly every interval, so the guess is at most a step or two off
+    static int finddemosegment(int millis)
+    {
+        int n = clamp(millis/demointerval, 0, demoindex.length()-1);
+        while(n > 0 && demoindex[n].millis > millis) n--;
+        while(n+1 < demoindex.length() && demoindex[n+1].millis <= millis) n++;
+        return n;
+    }
+
+    static bool readdemodata(void *data, int len)
+    {
+        if(demosegmentnum < 0) return demoplayback->read(data, len)==size_t(len);
+        uchar *dst = (uchar *)data;
+        while(len > 0)
+        {
+            if(demosegmentpos >= demosegment.length() && !loaddemosegment(demosegmentnum+1)) return false;
+            int n = min(len, demosegment.length() - demosegmentpos);
+            memcpy(dst, &demosegment[demosegmentpos], n);
+            demosegmentpos += n;
+            dst += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    static bool nextdemorecord()
+    {
+        if(!readdemodata(&nextplayback, sizeof(nextplayback)))
+        {
+            enddemoplayback();
+            return false;
+        }
+        lilswap(&nextplayback, 1);
+        return true;
+    }
+
     void setupdemoplayback()
     {
         if(demoplayback) return;
@@ -1121,19 +1570,28 @@ namespace server
         string msg;
         msg[0] = '\0';
         defformatstring(file, "%s.dmo", smapname);
+        int version = DEMO_LEGACY_VERSION;
         demoplayback = opengzfile(file, "rb");
+        if(!demoplayback)
+        {
+            version = DEMO_VERSION;
+            demoplayback = openfile(file, "rb");
+        }
         if(!demoplayback) formatstring(msg, "could not read demo \"%s\"", file);
         else if(demoplayback->read(&hdr, sizeof(demoheader))!=sizeof(demoheader) || memcmp(hdr.magic, DEMO_MAGIC, sizeof(hdr.magic)))
             formatstring(msg, "\"%s\" is not a demo file", file);
         else
         {
             lilswap(&hdr.version, 2);
-            if(hdr.version!=DEMO_VERSION) formatstring(msg, "demo \"%s\" requires an %s version of Resseract", file, hdr.version<DEMO_VERSION ? "older" : "newer");
+            if(hdr.version!=version) formatstring(msg, "demo \"%s\" requires an %s version of Resseract", file, hdr.version<version ? "older" : "newer");
             else if(hdr.protocol!=PROTOCOL_VERSION) formatstring(msg, "demo \"%s\" requires an %s version of Resseract", file, hdr.protocol<PROTOCOL_VERSION ? "older" : "newer");
+            else if(version==DEMO_VERSION && !loaddemoindex()) formatstring(msg, "demo \"%s\" is damaged", file);
         }
         if(msg[0])
         {
             DELETEP(demoplayback);
+            demoindex.setsize(0);
+            demosegmentnum = -1;
             sendservmsg(msg);
             return;
         }
@@ -1143,23 +1601,34 @@ namespace server
         demomillis = 0;
         sendf(-1, 1, "ri3", N_DEMOPLAYBACK, 1, -1);
 
-        if(demoplayback->read(&nextplayback, sizeof(nextplayback))!=sizeof(nextplayback))
-        {
-            enddemoplayback();
-            return;
-        }
-        lilswap(&nextplayback, 1);
+        nextdemorecord();
     }
 
-    void readdemo()
+    // a seek replays everything from the keyframe on, so messages are coalesced into a few large packets
+    // and positions are only sent for the last stretch before the target, since anything older is stale
+    #define DEMOSEEKBATCH (64<<10)
+    #define DEMOSEEKPOSITIONS 1000
+
+    static vector<uchar> demoseekbuf;
+
+    static void flushdemoseek()
     {
-        if(!demoplayback) return;
-        demomillis += curtime;
+        if(demoseekbuf.empty()) return;
+        ENetPacket *packet = enet_packet_create(NULL, demoseekbuf.length()+1, ENET_PACKET_FLAG_RELIABLE);
+        packet->data[0] = N_DEMOPACKET;
+        memcpy(packet->data+1, demoseekbuf.getbuf(), demoseekbuf.length());
+        demoseekbuf.setsize(0);
+        sendpacket(-1, 1, packet);
+        if(!packet->referenceCount) enet_packet_destroy(packet);
+    }
+
+    static void playdemo(bool seeking = false)
+    {
+        demoseekbuf.setsize(0);
         while(demomillis>=nextplayback)
         {
             int chan, len;
-            if(demoplayback->read(&chan, sizeof(chan))!=sizeof(chan) ||
-               demoplayback->read(&len, sizeof(len))!=sizeof(len))
+            if(!readdemodata(&chan, sizeof(chan)) || !readdemodata(&len, sizeof(len)))
             {
                 enddemoplayback();
                 return;
@@ -1167,23 +1636,55 @@ namespace server
             lilswap(&chan, 1);
             lilswap(&len, 1);
             ENetPacket *packet = enet_packet_create(NULL, len+1, 0);
-            if(!packet || demoplayback->read(packet->data+1, len)!=size_t(len))
+            if(!packet || !readdemodata(packet->data+1, len))
             {
                 if(packet) enet_packet_destroy(packet);
                 enddemoplayback();
                 return;
             }
-            packet->data[0] = N_DEMOPACKET;
-            sendpacket(-1, chan, packet);
-            if(!packet->referenceCount) enet_packet_destroy(packet);
-            if(!demoplayback) break;
-            if(demoplayback->read(&nextplayback, sizeof(nextplayback))!=sizeof(nextplayback))
+            // keyframes only matter when jumping into the middle of a segment
+            if(chan==DEMO_KEYFRAME) chan = seeking ? 1 : -1;
+            if(seeking && chan==1)
             {
-                enddemoplayback();
-                return;
+                if(demoseekbuf.length() + len > DEMOSEEKBATCH) flushdemoseek();
+                demoseekbuf.put(packet->data+1, len);
+                chan = -1;
+            }
+            else if(seeking && chan==0)
+            {
+                if(demomillis - nextplayback >= DEMOSEEKPOSITIONS) chan = -1;
+                else flushdemoseek(); // the positions should not overtake the keyframe that introduces their players
             }
-            lilswap(&nextplayback, 1);
+            if(chan >= 0)
+            {
+                packet->data[0] = N_DEMOPACKET;
+                sendpacket(-1, chan, packet);
+            }
+            if(!packet->referenceCount) enet_packet_destroy(packet);
+            if(!demoplayback || !nextdemorecord()) return;
         }
+        if(seeking) flushdemoseek();
+    }
+
+    void readdemo()
+    {
+        if(!demoplayback) return;
+        demomillis += curtime;
+        playdemo();
+    }
+
+    // restarts the segment containing millis from its keyframe and replays up to millis at once,
+    // after telling clients to drop whatever they know so the keyframe rebuilds the state from scratch
+    void seekdemo(int millis)
+    {
+        if(!demoplayback) return;
+        if(demosegmentnum < 0) { sendservmsg("demo has no index and can not be seeked"); return; }
+        millis = max(millis, 0);
+        if(!loaddemosegment(finddemosegment(millis))) { enddemoplayback(); return; }
+        if(!nextdemorecord()) return;
+        sendf(-1, 1, "ri3", N_DEMOPLAYBACK, 2, -1);
+        demomillis = millis;
+        playdemo(true);
     }
 
     void stopdemo()
@@ -1452,7 +1953,7 @@ namespace server
         }
 
         uchar operator[](int msg) const { return msg >= 0 && msg < NUMMSG ? msgmask[msg] : 0; }
-    } msgfilter(-1, N_CONNECT, N_SERVINFO, N_INITCLIENT, N_WELCOME, N_MAPCHANGE, N_SERVMSG, N_DAMAGE, N_HITPUSH, N_SHOTFX, N_EXPLODEFX, N_DIED, N_SPAWNSTATE, N_FORCEDEATH, N_TEAMINFO, N_ITEMACC, N_ITEMSPAWN, N_TIMEUP, N_CDIS, N_CURRENTMASTER, N_PONG, N_RESUME, N_SENDDEMOLIST, N_SENDDEMO, N_DEMOPLAYBACK, N_SENDMAP, N_DROPFLAG, N_SCOREFLAG, N_RETURNFLAG, N_RESETFLAG, N_CLIENT, N_AUTHCHAL, N_INITAI, N_DEMOPACKET, -2, N_CALCLIGHT, N_REMIP, N_NEWMAP, N_GETMAP, N_SENDMAP, N_CLIPBOARD, -3, N_EDITENT, N_EDITF, N_EDITT, N_EDITM, N_FLIP, N_COPY, N_PASTE, N_ROTATE, N_REPLACE, N_DELCUBE, N_EDITVAR, N_EDITVSLOT, N_UNDO, N_REDO, -4, N_POS, NUMMSG),
+    } msgfilter(-1, N_CONNECT, N_SERVINFO, N_INITCLIENT, N_WELCOME, N_MAPCHANGE, N_SERVMSG, N_DAMAGE, N_HITPUSH, N_SHOTFX, N_EXPLODEFX, N_DIED, N_SPAWNSTATE, N_FORCEDEATH, N_TEAMINFO, N_ITEMACC, N_ITEMSPAWN, N_TIMEUP, N_CDIS, N_CURRENTMASTER, N_PONG, N_RESUME, N_SENDDEMOLIST, N_SENDDEMO, N_DEMOPLAYBACK, N_SENDMAP, N_DROPFLAG, N_SCOREFLAG, N_RETURNFLAG, N_RESETFLAG, N_CLIENT, N_AUTHCHAL, N_INITAI, N_DEMOPACKET, N_POSFRAME, N_POSDELTA, -2, N_CALCLIGHT, N_REMIP, N_NEWMAP, N_GETMAP, N_SENDMAP, N_CLIPBOARD, -3, N_EDITENT, N_EDITF, N_EDITT, N_EDITM, N_FLIP, N_COPY, N_PASTE, N_ROTATE, N_REPLACE, N_DELCUBE, N_EDITVAR, N_EDITVSLOT, N_UNDO, N_REDO, -4, N_POS, N_POSACK, NUMMSG),
       connectfilter(-1, N_CONNECT, -2, N_AUTHANS, -3, N_PING, NUMMSG);
 
     int checktype(int type, clientinfo *ci)
@@ -1487,36 +1988,62 @@ namespace server
         return type;
     }
 
+    // worldstate slabs are pooled and reused, each packet pointing back at its slab through its
+    // user data so that the slab returns to the free list as soon as its last packet is freed
     struct worldstate
     {
-        int uses, len;
+        int uses, len, size;
         uchar *data;
 
-        worldstate() : uses(0), len(0), data(NULL) {}
-
-        void setup(int n) { len = n; data = new uchar[n]; }
-        void cleanup() { DELETEA(data); len = 0; }
-        bool contains(const uchar *p) const { return p >= data && p < &data[len]; }
+        worldstate() : uses(0), len(0), size(0), data(NULL) {}
+        ~worldstate() { DELETEA(data); }
     };
-    vector<worldstate> worldstates;
+    vector<worldstate *> worldstates, freeworldstates;
+    int wsallocs = 0, wsreuses = 0, wsticks = 0, wstickallocs = 0;
     bool reliablemessages = false;
 
-    void cleanworldstate(ENetPacket *packet)
+    static worldstate &newworldstate(int len)
     {
-        loopv(worldstates)
+        worldstate *ws;
+        if(freeworldstates.length()) { ws = freeworldstates.pop(); wsreuses++; }
+        else { ws = worldstates.add(new worldstate); wsallocs++; }
+        if(ws->size < len)
         {
-            worldstate &ws = worldstates[i];
-            if(!ws.contains(packet->data)) continue;
-            ws.uses--;
-            if(ws.uses <= 0)
-            {
-                ws.cleanup();
-                worldstates.removeunordered(i);
-            }
-            break;
+            DELETEA(ws->data);
+            ws->size = (len + 0xFFF)&~0xFFF;
+            ws->data = new uchar[ws->size];
+            wsallocs++;
         }
+        ws->len = len;
+        ws->uses = 0;
+        return *ws;
     }
 
+    static void freeworldstate(worldstate &ws)
+    {
+        freeworldstates.add(&ws);
+    }
+
+    void cleanworldstate(ENetPacket *packet)
+    {
+        worldstate &ws = *(worldstate *)packet->userData;
+        if(--ws.uses <= 0) freeworldstate(ws);
+    }
+
+    static ENetPacket *newworldstatepacket(worldstate &ws, uchar *data, int size, int flags)
+    {
+        ENetPacket *packet = enet_packet_create(data, size, flags | ENET_PACKET_FLAG_NO_ALLOCATE);
+        packet->userData = &ws;
+        return packet;
+    }
+
+    void worldstatestats()
+    {
+        conoutf("worldstate: %d slabs (%d free), %d allocations, %d reuses, %d allocations last tick, %.2f allocations per tick",
+            worldstates.length(), freeworldstates.length(), wsallocs, wsreuses, wstickallocs, wsticks ? wsallocs/float(wsticks) : 0.0f);
+    }
+    COMMAND(worldstatestats, "");
+
     void flushclientposition(clientinfo &ci)
     {
         if(ci.position.empty() || (!hasnonlocalclients() && !demorecord)) return;
@@ -1540,7 +2067,7 @@ namespace server
             int size = wslen;
             if(ci.wsdata >= wsbuf.buf) { data = ci.wsdata + ci.wslen; size -= ci.wslen; }
             if(size <= 0) continue;
-            ENetPacket *packet = enet_packet_create(data, size, ENET_PACKET_FLAG_NO_ALLOCATE);
+            ENetPacket *packet = newworldstatepacket(ws, data, size, 0);
             sendpacket(ci.clientnum, 0, packet);
             if(packet->referenceCount) { ws.uses++; packet->freeCallback = cleanworldstate; }
             else enet_packet_destroy(packet);
@@ -1574,7 +2101,7 @@ namespace server
             int size = wslen;
             if(ci.wsdata >= wsbuf.buf) { data = ci.wsdata + ci.wslen; size -= ci.wslen; }
             if(size <= 0) continue;
-            ENetPacket *packet = enet_packet_create(data, size, (reliablemessages ? ENET_PACKET_FLAG_RELIABLE : 0) | ENET_PACKET_FLAG_NO_ALLOCATE);
+            ENetPacket *packet = newworldstatepacket(ws, data, size, reliablemessages ? ENET_PACKET_FLAG_RELIABLE : 0);
             sendpacket(ci.clientnum, 1, packet);
             if(packet->referenceCount) { ws.uses++; packet->freeCallback = cleanworldstate; }
             else enet_packet_destroy(packet);
@@ -1597,35 +2124,187 @@ namespace server
         else ci.wslen += len;
     }
 
+    // interest management: instead of broadcasting every position to everyone, each recipient
+    // gets a packet of its own where far away (or, on a listen server, PVS occluded) players
+    // are updated less often, optionally capped to a byte budget with the most overdue first
+    VAR(interestmode, 0, 0, 1);
+    // delta positions: each recipient gets positions encoded against the last ones it acknowledged
+    VAR(deltapositions, 0, 0, 1);
+    VAR(interestnear, 0, 512, 1<<16);
+    VAR(interestfar, 0, 2048, 1<<16);
+    VAR(interestfarmillis, 0, 200, 5000);
+    VAR(interesthiddenmillis, 0, 400, 5000);
+    VAR(interestpvs, 0, 1, 1);
+    VAR(interestmaxbytes, 0, 0, 1<<16);
+
+    uint lastposseq = 0;
+
+    struct interestcandidate
+    {
+        clientinfo *ci;
+        float priority;
+
+        interestcandidate() {}
+        interestcandidate(clientinfo *ci, float priority) : ci(ci), priority(priority) {}
+
+        static bool compare(const interestcandidate &x, const interestcandidate &y) { return x.priority > y.priority; }
+    };
+
+    static int interestdelay(clientinfo &ci, clientinfo &bi)
+    {
+        float dist = ci.state.o.dist(bi.state.o);
+        int delay = 0;
+        if(dist > interestnear)
+        {
+            if(dist >= interestfar || interestfar <= interestnear) delay = interestfarmillis;
+            else delay = int(interestfarmillis*(dist - interestnear)/(interestfar - interestnear));
+        }
+#ifndef STANDALONE
+        // only a listen server has the map geometry (and thus the PVS) loaded
+        if(interestpvs && delay < interesthiddenmillis && !strcmp(smapname, game::getclientmap()) &&
+           pvsoccludedfrom(ci.state.o, bi.state.o, 16))
+            delay = interesthiddenmillis;
+#endif
+        return delay;
+    }
+
+    static bool flushinterest(clientinfo &ci, ucharbuf &buf)
+    {
+        if(buf.empty()) return false;
+        ENetPacket *packet = enet_packet_create(buf.buf, buf.length(), 0);
+        sendpacket(ci.clientnum, 0, packet);
+        bool sent = packet->referenceCount > 0;
+        if(!sent) enet_packet_destroy(packet);
+        buf.reset();
+        return sent;
+    }
+
+    #define MAXPOSDELTA 48
+
+    static void putposdelta(ucharbuf &buf, clientinfo &ci, clientinfo &bi, posinterest &pi)
+    {
+        if(buf.empty())
+        {
+            posframe &frame = ci.newposframe();
+            putint(buf, N_POSFRAME);
+            buf.put(uchar(frame.id));
+        }
+        const posfields *base = bi.findposition(pi.baseline);
+        putint(buf, N_POSDELTA);
+        putuint(buf, bi.clientnum);
+        buf.put(uchar(bi.posnum));
+        buf.put(base ? uchar(bi.posnum - pi.baseline) : 0);
+        bi.posstate.putdelta(buf, base ? *base : posfields());
+        posframeentry &e = ci.posframes[(ci.nextposframe-1)%POSFRAMES].sent.add();
+        e.cn = bi.clientnum;
+        e.num = bi.posnum;
+    }
+
+    static bool sendclientpositions()
+    {
+        static uchar data[MAXTRANS];
+        int mtu = getservermtu() - 100;
+        if(mtu <= 0 || mtu > MAXTRANS) mtu = MAXTRANS;
+        if(demorecord)
+        {
+            static vector<uchar> demobuf;
+            demobuf.setsize(0);
+            loopv(clients)
+            {
+                clientinfo &bi = *clients[i];
+                if(bi.position.empty() || bi.recordedposseq == bi.posseq) continue;
+                demobuf.put(bi.position.getbuf(), bi.position.length());
+                bi.recordedposseq = bi.posseq;
+            }
+            if(demobuf.length()) recordpacket(0, demobuf.getbuf(), demobuf.length());
+        }
+        bool flush = false;
+        static vector<interestcandidate> candidates;
+        loopv(clients)
+        {
+            clientinfo &ci = *clients[i];
+            if(ci.state.aitype != AI_NONE) continue;
+            // spectators and editors may look anywhere, so they get everything at full rate
+            bool filter = interestmode && ci.state.state==CS_ALIVE && !m_edit, delta = deltapositions && !ci.local;
+            candidates.setsize(0);
+            loopvj(clients)
+            {
+                clientinfo &bi = *clients[j];
+                if(bi.position.empty() || &bi == &ci || bi.ownernum == ci.clientnum) continue;
+                posinterest &pi = ci.getinterest(bi.clientnum);
+                if(pi.seq == bi.posseq) continue;
+                float priority = 1;
+                if(filter)
+                {
+                    int delay = interestdelay(ci, bi), elapsed = totalmillis - pi.millis;
+                    if(elapsed < delay) continue;
+                    priority = (elapsed + 40)/float(delay + 40);
+                }
+                candidates.add(interestcandidate(&bi, priority));
+            }
+            if(candidates.empty()) continue;
+            int budget = INT_MAX;
+            if(filter && interestmaxbytes)
+            {
+                candidates.sort(interestcandidate::compare);
+                budget = interestmaxbytes;
+            }
+            ucharbuf buf(data, mtu);
+            loopvj(candidates)
+            {
+                clientinfo &bi = *candidates[j].ci;
+                int len = bi.position.length();
+                if(len > budget) continue;
+                if(buf.length() + (delta ? MAXPOSDELTA : len) > mtu && flushinterest(ci, buf)) flush = true;
+                int start = buf.length();
+                posinterest &pi = ci.getinterest(bi.clientnum);
+                if(delta) putposdelta(buf, ci, bi, pi);
+                else buf.put(bi.position.getbuf(), len);
+                budget -= buf.length() - start;
+                pi.seq = bi.posseq;
+                pi.millis = totalmillis;
+            }
+            if(flushinterest(ci, buf)) flush = true;
+        }
+        return flush;
+    }
+
     bool buildworldstate()
     {
+        serverphasetimer timer(SERVERPHASE_WORLDSTATE);
         int wsmax = 0;
         loopv(clients)
         {
             clientinfo &ci = *clients[i];
             ci.overflow = 0;
             ci.wsdata = NULL;
-            wsmax += ci.position.length();
+            if(!interestmode && !deltapositions) wsmax += ci.position.length();
             if(ci.messages.length()) wsmax += 10 + ci.messages.length();
         }
+        bool flush = (interestmode || deltapositions) && sendclientpositions();
         if(wsmax <= 0)
         {
             reliablemessages = false;
-            return false;
+            return flush;
         }
-        worldstate &ws = worldstates.add();
-        ws.setup(2*wsmax);
+        int allocs = wsallocs;
+        worldstate &ws = newworldstate(2*wsmax);
+        wstickallocs = wsallocs - allocs;
+        wsticks++;
         int mtu = getservermtu() - 100;
         if(mtu <= 0) mtu = ws.len;
         ucharbuf wsbuf(ws.data, ws.len);
-        loopv(clients)
+        if(!interestmode && !deltapositions)
         {
-            clientinfo &ci = *clients[i];
-            if(ci.state.aitype != AI_NONE) continue;
-            addposition(ws, wsbuf, mtu, ci, ci);
-            loopvj(ci.bots) addposition(ws, wsbuf, mtu, *ci.bots[j], ci);
+            loopv(clients)
+            {
+                clientinfo &ci = *clients[i];
+                if(ci.state.aitype != AI_NONE) continue;
+                addposition(ws, wsbuf, mtu, ci, ci);
+                loopvj(ci.bots) addposition(ws, wsbuf, mtu, *ci.bots[j], ci);
+            }
+            sendpositions(ws, wsbuf);
         }
-        sendpositions(ws, wsbuf);
         loopv(clients)
         {
             clientinfo &ci = *clients[i];
@@ -1636,9 +2315,8 @@ namespace server
         sendmessages(ws, wsbuf);
         reliablemessages = false;
         if(ws.uses) return true;
-        ws.cleanup();
-        worldstates.drop();
-        return false;
+        freeworldstate(ws);
+        return flush;
     }
 
     bool sendpackets(bool force)
@@ -1872,6 +2550,11 @@ namespace server
         sendpacket(-1, 1, p.finalize(), ci->clientnum);
     }
 
+    void preloadmaps()
+    {
+        loopv(maprotations) preloadents(maprotations[i].map);
+    }
+
     void loaditems()
     {
         resetitems();
@@ -2126,27 +2809,23 @@ namespace server
         gs.respawn();
     }
 
-    void suicideevent::process(clientinfo *ci)
-    {
-        suicide(ci);
-    }
-
-    void explodeevent::process(clientinfo *ci)
+    static void processexplode(clientinfo *ci, const gameevent &e, const hitinfo *hits)
     {
         servstate &gs = ci->state;
+        int atk = e.atk;
         switch(atk)
         {
             case ATK_PULSE_SHOOT:
-                if(!gs.projs.remove(id)) return;
+                if(!gs.projs.remove(e.id)) return;
                 break;
 
             default:
                 return;
         }
-        sendf(-1, 1, "ri4x", N_EXPLODEFX, ci->clientnum, atk, id, ci->ownernum);
-        loopv(hits)
+        sendf(-1, 1, "ri4x", N_EXPLODEFX, ci->clientnum, atk, e.id, ci->ownernum);
+        loopi(e.numhits)
         {
-            hitinfo &h = hits[i];
+            const hitinfo &h = hits[i];
             clientinfo *target = getinfo(h.target);
             if(!target || target->state.state!=CS_ALIVE || h.lifesequence!=target->state.lifesequence || h.dist<0 || h.dist>attacks[atk].exprad) continue;
 
@@ -2160,9 +2839,118 @@ namespace server
         }
     }
 
-    void shotevent::process(clientinfo *ci)
+    // lag compensation: the server keeps a short history of where everyone was and checks claimed
+    // hits against the target as the shooter saw it, one round trip (plus interpolation) ago
+    VAR(lagcomp, 0, 0, 1);
+    VAR(lagcompinterval, 1, 15, 100);
+    VAR(lagcompdelay, 0, 40, 500);
+    VAR(lagcompslack, 0, 8, 64);
+
+    #define LAGCOMPFRAMES 64
+    #define LAGCOMPCLIENTS (MAXCLIENTS + MAXBOTS)
+
+    // stored as separate coordinate arrays with each client's frames adjacent, so rewinding a target
+    // only touches a few cache lines no matter how many players there are
+    struct lagcomphistory
+    {
+        int millis[LAGCOMPFRAMES], numframes, curframe;
+        float x[LAGCOMPCLIENTS][LAGCOMPFRAMES], y[LAGCOMPCLIENTS][LAGCOMPFRAMES], z[LAGCOMPCLIENTS][LAGCOMPFRAMES];
+        signed char lifesequence[LAGCOMPCLIENTS][LAGCOMPFRAMES];
+
+        lagcomphistory() { reset(); }
+
+        void reset() { numframes = curframe = 0; }
+
+        void record(int gamemillis)
+        {
+            if(numframes && gamemillis < millis[curframe]) reset(); // new map
+            if(numframes && gamemillis - millis[curframe] < lagcompinterval) return;
+            curframe = (curframe + 1)%LAGCOMPFRAMES;
+            numframes = min(numframes + 1, LAGCOMPFRAMES);
+            millis[curframe] = gamemillis;
+            loopi(LAGCOMPCLIENTS) lifesequence[i][curframe] = -1;
+            loopv(clients)
+            {
+                clientinfo *ci = clients[i];
+                int cn = ci->clientnum;
+                if(cn < 0 || cn >= LAGCOMPCLIENTS || ci->state.state != CS_ALIVE) continue;
+                x[cn][curframe] = ci->state.o.x;
+                y[cn][curframe] = ci->state.o.y;
+                z[cn][curframe] = ci->state.o.z;
+                lifesequence[cn][curframe] = ci->state.lifesequence;
+            }
+        }
+
+        bool find(int cn, int life, int when, vec &o) const
+        {
+            if(cn < 0 || cn >= LAGCOMPCLIENTS) return false;
+            const signed char *lives = lifesequence[cn];
+            for(int n = 0, frame = curframe; n < numframes; n++, frame = (frame + LAGCOMPFRAMES - 1)%LAGCOMPFRAMES)
+            {
+                if(millis[frame] > when) continue;
+                if(lives[frame] != life) return false;
+                o = vec(x[cn][frame], y[cn][frame], z[cn][frame]);
+                // blend towards the following frame if it belongs to the same life
+                int next = (frame + 1)%LAGCOMPFRAMES;
+                if(n > 0 && lives[next] == life && millis[next] > millis[frame])
+                    o.lerp(vec(x[cn][next], y[cn][next], z[cn][next]), float(when - millis[frame])/(millis[next] - millis[frame]));
+                return true;
+            }
+            return false;
+        }
+    };
+    lagcomphistory lagcompstate;
+    ullong lagcompaccepted = 0, lagcomprejected = 0, lagcompunchecked = 0;
+
+    // slab test of the shot segment against the target's bounding box at the rewound position
+    static bool lagcomphit(const vec &o, const vec &from, const vec &to)
+    {
+        float r = 4.1f + lagcompslack;
+        vec bbmin(o.x - r, o.y - r, o.z - lagcompslack), bbmax(o.x + r, o.y + r, o.z + 18 + 2 + lagcompslack);
+        vec ray = vec(to).sub(from);
+        float len = ray.magnitude();
+        if(len <= 0) return bbmin.x <= from.x && from.x <= bbmax.x && bbmin.y <= from.y && from.y <= bbmax.y && bbmin.z <= from.z && from.z <= bbmax.z;
+        ray.div(len);
+        float tmin = 0, tmax = len + lagcompslack;
+        loopk(3)
+        {
+            if(fabs(ray[k]) < 1e-6f)
+            {
+                if(from[k] < bbmin[k] || from[k] > bbmax[k]) return false;
+                continue;
+            }
+            float t1 = (bbmin[k] - from[k])/ray[k], t2 = (bbmax[k] - from[k])/ray[k];
+            if(t1 > t2) swap(t1, t2);
+            tmin = max(tmin, t1);
+            tmax = min(tmax, t2);
+            if(tmin > tmax) return false;
+        }
+        return true;
+    }
+
+    static bool checklagcomp(clientinfo *ci, clientinfo *target, const vec &from, const vec &to, int millis)
+    {
+        if(!lagcomp) return true;
+        uint rtt = 0, rttvar;
+        getclientrtt(ci->ownernum, rtt, rttvar);
+        int when = millis - lagcompdelay - int(rtt);
+        vec o;
+        if(!lagcompstate.find(target->clientnum, target->state.lifesequence, when, o))
+        {
+            // no history for that moment, e.g. the target only just spawned, so check where it is now
+            lagcompunchecked++;
+            return lagcomphit(target->state.o, from, to);
+        }
+        if(lagcomphit(o, from, to)) { lagcompaccepted++; return true; }
+        lagcomprejected++;
+        return false;
+    }
+
+    static void processshot(clientinfo *ci, const gameevent &e, const hitinfo *hits)
     {
         servstate &gs = ci->state;
+        int atk = e.atk, millis = e.millis;
+        const vec &from = e.from, &to = e.to;
         int wait = millis - gs.lastshot;
         if(!gs.isalive(gamemillis) ||
            wait<gs.gunwait ||
@@ -2174,22 +2962,23 @@ namespace server
         gs.ammo[gun] -= attacks[atk].use;
         gs.lastshot = millis;
         gs.gunwait = attacks[atk].attackdelay;
-        sendf(-1, 1, "rii9x", N_SHOTFX, ci->clientnum, atk, id,
+        sendf(-1, 1, "rii9x", N_SHOTFX, ci->clientnum, atk, e.id,
                 int(from.x*DMF), int(from.y*DMF), int(from.z*DMF),
                 int(to.x*DMF), int(to.y*DMF), int(to.z*DMF),
                 ci->ownernum);
         gs.shotdamage += attacks[atk].damage*attacks[atk].rays;
         switch(atk)
         {
-            case ATK_PULSE_SHOOT: gs.projs.add(id); break;
+            case ATK_PULSE_SHOOT: gs.projs.add(e.id); break;
             default:
             {
                 int totalrays = 0, maxrays = attacks[atk].rays;
-                loopv(hits)
+                loopi(e.numhits)
                 {
-                    hitinfo &h = hits[i];
+                    const hitinfo &h = hits[i];
                     clientinfo *target = getinfo(h.target);
                     if(!target || target->state.state!=CS_ALIVE || h.lifesequence!=target->state.lifesequence || h.rays<1 || h.dist > attacks[atk].range + 1) continue;
+                    if(!checklagcomp(ci, target, from, to, millis)) continue;
 
                     totalrays += h.rays;
                     if(totalrays>maxrays) continue;
@@ -2201,80 +2990,146 @@ namespace server
         }
     }
 
-    void pickupevent::process(clientinfo *ci)
+    static void processpickup(clientinfo *ci, const gameevent &e)
     {
         servstate &gs = ci->state;
         if(m_mp(gamemode) && !gs.isalive(gamemillis)) return;
-        pickup(ent, ci->clientnum);
+        pickup(e.id, ci->clientnum);
     }
 
-    bool gameevent::flush(clientinfo *ci, int fmillis)
+    static void processevent(clientinfo *ci, const gameevent &e, const hitinfo *hits)
     {
-        process(ci);
-        return true;
-    }
-
-    bool timedevent::flush(clientinfo *ci, int fmillis)
-    {
-        if(millis > fmillis) return false;
-        else if(millis >= ci->lastevent)
+        switch(e.type)
         {
-            ci->lastevent = millis;
-            process(ci);
+            case EV_SHOT: processshot(ci, e, hits); break;
+            case EV_EXPLODE: processexplode(ci, e, hits); break;
+            case EV_SUICIDE: suicide(ci); break;
+            case EV_PICKUP: processpickup(ci, e); break;
         }
-        return true;
-    }
-
-    void clearevent(clientinfo *ci)
-    {
-        delete ci->events.remove(0);
     }
 
     void flushevents(clientinfo *ci, int millis)
     {
-        while(ci->events.length())
-        {
-            gameevent *ev = ci->events[0];
-            if(ev->flush(ci, millis)) clearevent(ci);
-            else break;
-        }
+        ci->events.flush(millis, ci->lastevent, [ci](const gameevent &e, const hitinfo *hits) { processevent(ci, e, hits); });
     }
 
     void processevents()
     {
+        serverphasetimer timer(SERVERPHASE_EVENTS);
         loopv(clients)
         {
             clientinfo *ci = clients[i];
-            flushevents(ci, gamemillis);
+            if(!ci->events.empty()) flushevents(ci, gamemillis);
         }
     }
 
     void cleartimedevents(clientinfo *ci)
     {
-        int keep = 0;
-        loopv(ci->events)
+        ci->events.cleartimed();
+        ci->timesync = false;
+    }
+
+    // measures event bookkeeping against the previous scheme of one heap allocated polymorphic
+    // object per event, with stand-in processing so game state is left alone
+    struct legacyevent
+    {
+        int millis;
+
+        virtual ~legacyevent() {}
+        virtual void process(int &sum) = 0;
+    };
+
+    struct legacyshot : legacyevent
+    {
+        int id, atk;
+        vec from, to;
+        vector<hitinfo> hits;
+
+        void process(int &sum) { sum += atk + hits.length(); }
+    };
+
+    struct legacypickup : legacyevent
+    {
+        int ent;
+
+        void process(int &sum) { sum += ent; }
+    };
+
+    void eventbench(int *numevents)
+    {
+        const int batch = 64;
+        int n = *numevents > 0 ? *numevents : 1000000, legacysum = 0, sum = 0;
+
+        uint start = getservermicros();
+        vector<legacyevent *> legacy;
+        for(int done = 0; done < n; done += batch)
         {
-            if(ci->events[i]->keepable())
+            loopi(batch)
             {
-                if(keep < i)
+                if(i&3)
                 {
-                    for(int j = keep; j < i; j++) delete ci->events[j];
-                    ci->events.remove(keep, i - keep);
-                    i = keep;
+                    legacyshot *e = new legacyshot;
+                    e->millis = done + i;
+                    e->id = e->atk = i;
+                    e->hits.add().target = i;
+                    legacy.add(e);
                 }
-                keep = i+1;
-                continue;
+                else
+                {
+                    legacypickup *e = new legacypickup;
+                    e->millis = done + i;
+                    e->ent = i;
+                    legacy.add(e);
+                }
+            }
+            while(legacy.length())
+            {
+                legacy[0]->process(legacysum);
+                delete legacy.remove(0);
             }
         }
-        while(ci->events.length() > keep) delete ci->events.pop();
-        ci->timesync = false;
+        uint legacymicros = max(getservermicros() - start, 1U);
+
+        start = getservermicros();
+        eventqueue q;
+        int lastevent = 0;
+        for(int done = 0; done < n; done += batch)
+        {
+            loopi(batch)
+            {
+                if(i&3)
+                {
+                    gameevent &e = q.add(EV_SHOT);
+                    e.millis = done + i;
+                    e.id = e.atk = i;
+                    q.addhit(e).target = i;
+                }
+                else q.add(EV_PICKUP).id = i;
+            }
+            q.flush(INT_MAX, lastevent, [&sum](const gameevent &e, const hitinfo *hits)
+            {
+                switch(e.type)
+                {
+                    case EV_SHOT: sum += e.atk + e.numhits; break;
+                    case EV_PICKUP: sum += e.id; break;
+                }
+            });
+        }
+        uint micros = max(getservermicros() - start, 1U);
+
+        conoutf("events: %d in batches of %d, allocated %.0f/s, queued %.0f/s (%.1fx)%s",
+            n, batch, n*1e6/legacymicros, n*1e6/micros, legacymicros/float(micros), legacysum != sum ? ", results differ" : "");
     }
+    COMMAND(eventbench, "i");
 
     void serverupdate()
     {
+        serverphasetimer timer(SERVERPHASE_UPDATE);
+        if(demofinishing.length()) checkdemorecord();
         if(shouldstep && !gamepaused)
         {
             gamemillis += curtime;
+            if(lagcomp && !m_demo) lagcompstate.record(gamemillis);
 
             if(m_demo) readdemo();
             else if(!m_timed || gamemillis < gamelimit)
@@ -2451,12 +3306,19 @@ namespace server
         clientdisconnect(n);
     }
 
+    // a client number that is taken over by someone new must not inherit its position baselines
+    void resetposclient(int cn)
+    {
+        loopv(clients) clients[i]->forgetposclient(cn);
+    }
+
     int clientconnect(int n, uint ip)
     {
         clientinfo *ci = getinfo(n);
         ci->clientnum = ci->ownernum = n;
         ci->connectmillis = totalmillis;
         ci->sessionid = (rnd(0x1000000)*((totalmillis%10000)+1))&0xFFFFFF;
+        resetposclient(n);
 
         connects.add(ci);
         if(!m_mp(gamemode)) return DISC_LOCAL;
@@ -2476,6 +3338,7 @@ namespace server
             savescore(ci);
             sendf(-1, 1, "ri2", N_CDIS, n);
             clients.removeobj(ci);
+            resetposclient(n);
             aiman::removeai(ci);
             if(!numclients(-1, false, true)) noclients(); // bans clear when server empties
             if(ci->local) checkpausegame();
@@ -2745,6 +3608,45 @@ namespace server
         if(servermotd[0]) sendf(ci->clientnum, 1, "ris", N_SERVMSG, servermotd);
     }
 
+    struct msgstat
+    {
+        ullong count, bytes;
+    };
+    msgstat msgstats[NUMMSG];
+    int lastmsgtype = -1, lastmsgstart = 0;
+
+    // counts each received message, and the bytes of the previous one now that it ended at start
+    static inline int countmsg(int type, int start)
+    {
+        if(lastmsgtype >= 0) msgstats[lastmsgtype].bytes += start - lastmsgstart;
+        lastmsgtype = type >= 0 && type < NUMMSG ? type : -1;
+        lastmsgstart = start;
+        if(lastmsgtype >= 0) msgstats[type].count++;
+        return type;
+    }
+
+    void writemetrics(vector<char> &buf)
+    {
+        metricf(buf, "# TYPE resseract_messages_received_total counter\n");
+        loopi(NUMMSG) if(msgstats[i].count) metricf(buf, "resseract_messages_received_total{type=\"%d\"} %llu\n", i, msgstats[i].count);
+        metricf(buf, "# TYPE resseract_message_bytes_received_total counter\n");
+        loopi(NUMMSG) if(msgstats[i].count) metricf(buf, "resseract_message_bytes_received_total{type=\"%d\"} %llu\n", i, msgstats[i].bytes);
+        metricf(buf, "# TYPE resseract_players gauge\nresseract_players %d\n", numclients(-1, false, true));
+        metricf(buf, "# TYPE resseract_lagcomp_hits_total counter\nresseract_lagcomp_hits_total{result=\"accepted\"} %llu\nresseract_lagcomp_hits_total{result=\"rejected\"} %llu\nresseract_lagcomp_hits_total{result=\"unchecked\"} %llu\n",
+            lagcompaccepted, lagcomprejected, lagcompunchecked);
+        metricf(buf, "# TYPE resseract_client_rtt_milliseconds gauge\n");
+        loopv(clients)
+        {
+            clientinfo *ci = clients[i];
+            uint rtt, rttvar;
+            if(ci->state.aitype != AI_NONE || !getclientrtt(ci->clientnum, rtt, rttvar)) continue;
+            string name;
+            filtertext(name, ci->name, false, false, MAXNAMELEN);
+            for(char *c = name; *c; c++) if(*c == '"' || *c == '\\') *c = '_';
+            metricf(buf, "resseract_client_rtt_milliseconds{cn=\"%d\",name=\"%s\"} %u\n", ci->clientnum, name, rtt);
+        }
+    }
+
     void parsepacket(int sender, int chan, packetbuf &p)     // has to parse exactly each byte of the packet
     {
         if(sender<0 || p.packet->flags&ENET_PACKET_FLAG_UNSEQUENCED || chan > 2) return;
@@ -2828,30 +3730,19 @@ namespace server
         #define QUEUE_UINT(n) QUEUE_BUF(putuint(cm->messages, n))
         #define QUEUE_STR(text) QUEUE_BUF(sendstring(text, cm->messages))
         int curmsg;
-        while((curmsg = p.length()) < p.maxlen) switch(type = checktype(getint(p), ci))
+        lastmsgtype = -1;
+        while((curmsg = p.length()) < p.maxlen) switch(type = countmsg(checktype(getint(p), ci), curmsg))
         {
             case N_POS:
             {
                 int pcn = getuint(p);
-                p.get();
-                uint flags = getuint(p);
+                posfields f;
+                f.parse(p);
+                uint flags = f.flags;
                 clientinfo *cp = getinfo(pcn);
                 if(cp && pcn != sender && cp->ownernum != sender) cp = NULL;
-                vec pos;
-                loopk(3)
-                {
-                    int n = p.get(); n |= p.get()<<8; if(flags&(1<<k)) { n |= p.get()<<16; if(n&0x800000) n |= ~0U<<24; }
-                    pos[k] = n/DMF;
-                }
-                loopk(3) p.get();
-                int mag = p.get(); if(flags&(1<<3)) mag |= p.get()<<8;
-                int dir = p.get(); dir |= p.get()<<8;
-                vec vel = vec((dir%360)*RAD, (clamp(dir/360, 0, 180)-90)*RAD).mul(mag/DVELF);
-                if(flags&(1<<4))
-                {
-                    p.get(); if(flags&(1<<5)) p.get();
-                    if(flags&(1<<6)) loopk(2) p.get();
-                }
+                vec pos(f.o[0]/DMF, f.o[1]/DMF, f.o[2]/DMF);
+                vec vel = vec((f.veldir%360)*RAD, (clamp(f.veldir/360, 0, 180)-90)*RAD).mul(f.vel/DVELF);
                 if(cp)
                 {
                     if((!ci->local || demorecord || hasnonlocalclients()) && (cp->state.state==CS_ALIVE || cp->state.state==CS_EDITING))
@@ -2860,6 +3751,8 @@ namespace server
                             cp->setexceeded();
                         cp->position.setsize(0);
                         while(curmsg<p.length()) cp->position.add(p.buf[curmsg++]);
+                        cp->posseq = ++lastposseq;
+                        cp->addposition(f);
                     }
                     if(smode && cp->state.state==CS_ALIVE) smode->moved(cp, cp->state.o, cp->gameclip, pos, (flags&0x80)!=0);
                     cp->state.o = pos;
@@ -2921,7 +3814,7 @@ namespace server
                 {
                     ci->state.editstate = ci->state.state;
                     ci->state.state = CS_EDITING;
-                    ci->events.setsize(0);
+                    ci->events.clear();
                     ci->state.projs.reset();
                 }
                 else ci->state.state = ci->state.editstate;
@@ -3001,23 +3894,28 @@ namespace server
 
             case N_SUICIDE:
             {
-                if(cq) cq->addevent(new suicideevent);
+                if(!cq) break;
+                cq->events.add(EV_SUICIDE);
+                cq->checkevent();
                 break;
             }
 
             case N_SHOOT:
             {
-                shotevent *shot = new shotevent;
-                shot->id = getint(p);
-                shot->millis = cq ? cq->geteventmillis(gamemillis, shot->id) : 0;
-                shot->atk = getint(p);
-                loopk(3) shot->from[k] = getint(p)/DMF;
-                loopk(3) shot->to[k] = getint(p)/DMF;
+                static eventqueue discard;
+                eventqueue &q = cq ? cq->events : discard;
+                int id = getint(p), millis = cq ? cq->geteventmillis(gamemillis, id) : 0;
+                gameevent &shot = q.add(EV_SHOT);
+                shot.id = id;
+                shot.millis = millis;
+                shot.atk = getint(p);
+                loopk(3) shot.from[k] = getint(p)/DMF;
+                loopk(3) shot.to[k] = getint(p)/DMF;
                 int hits = getint(p);
                 loopk(hits)
                 {
                     if(p.overread()) break;
-                    hitinfo &hit = shot->hits.add();
+                    hitinfo &hit = q.addhit(shot);
                     hit.target = getint(p);
                     hit.lifesequence = getint(p);
                     hit.dist = getint(p)/DMF;
@@ -3026,33 +3924,35 @@ namespace server
                 }
                 if(cq)
                 {
-                    cq->addevent(shot);
+                    cq->checkevent();
                     cq->setpushed();
                 }
-                else delete shot;
+                else discard.clear();
                 break;
             }
 
             case N_EXPLODE:
             {
-                explodeevent *exp = new explodeevent;
-                int cmillis = getint(p);
-                exp->millis = cq ? cq->geteventmillis(gamemillis, cmillis) : 0;
-                exp->atk = getint(p);
-                exp->id = getint(p);
+                static eventqueue discard;
+                eventqueue &q = cq ? cq->events : discard;
+                int cmillis = getint(p), millis = cq ? cq->geteventmillis(gamemillis, cmillis) : 0;
+                gameevent &exp = q.add(EV_EXPLODE);
+                exp.millis = millis;
+                exp.atk = getint(p);
+                exp.id = getint(p);
                 int hits = getint(p);
                 loopk(hits)
                 {
                     if(p.overread()) break;
-                    hitinfo &hit = exp->hits.add();
+                    hitinfo &hit = q.addhit(exp);
                     hit.target = getint(p);
                     hit.lifesequence = getint(p);
                     hit.dist = getint(p)/DMF;
                     hit.rays = getint(p);
                     loopk(3) hit.dir[k] = getint(p)/DNF;
                 }
-                if(cq) cq->addevent(exp);
-                else delete exp;
+                if(cq) cq->checkevent();
+                else discard.clear();
                 break;
             }
 
@@ -3060,9 +3960,8 @@ namespace server
             {
                 int n = getint(p);
                 if(!cq) break;
-                pickupevent *pickup = new pickupevent;
-                pickup->ent = n;
-                cq->addevent(pickup);
+                cq->events.add(EV_PICKUP).id = n;
+                cq->checkevent();
                 break;
             }
 
@@ -3198,6 +4097,13 @@ namespace server
                 sendf(sender, 1, "i2", N_PONG, getint(p));
                 break;
 
+            case N_POSACK:
+            {
+                int ack = getint(p);
+                if(ci) ci->ackposframe(ack);
+                break;
+            }
+
             case N_CLIENTPING:
             {
                 int ping = getint(p);
@@ -3308,6 +4214,14 @@ namespace server
                 break;
             }
 
+            case N_SEEKDEMO:
+            {
+                int millis = getint(p), relative = getint(p);
+                if(!m_demo || (ci->privilege < (restrictdemos ? PRIV_ADMIN : PRIV_MASTER) && !ci->local)) break;
+                seekdemo(relative ? demomillis + millis : millis);
+                break;
+            }
+
             case N_CLEARDEMOS:
             {
                 int demo = getint(p);
@@ -3554,6 +4468,7 @@ namespace server
                 break;
             }
         }
+        countmsg(-1, p.length());
     }
 
     int laninfoport() { return RESSERACT_LANINFO_PORT; }
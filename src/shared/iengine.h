@@ -49,6 +49,8 @@ extern float raycube   (const vec &o, const vec &ray,     float radius = 0, int
 extern float raycubepos(const vec &o, const vec &ray, vec &hit, float radius = 0, int mode = RAY_CLIPMAT, int size = 0);
 extern float rayfloor  (const vec &o, vec &floor, int mode = 0, float radius = 0);
 extern bool  raycubelos(const vec &o, const vec &dest, vec &hitpos);
+extern void  raycubelos(int n, const vec *o, const vec *dest, bool *visible);
+extern void  raycubepacket(int n, const vec *o, const vec *ray, const float *radius, float *dist, int mode = RAY_CLIPMAT);
 
 extern int thirdperson;
 extern bool isthirdperson();
@@ -217,6 +219,9 @@ static inline bool insideworld(const ivec &o)
     return uint(o.x)<uint(worldsize) && uint(o.y)<uint(worldsize) && uint(o.z)<uint(worldsize);
 }
 
+// pvs
+extern bool pvsoccludedfrom(const vec &viewer, const vec &center, float radius);
+
 // world
 extern bool emptymap(int factor, bool force, const char *mname = "", bool usecfg = true);
 extern bool enlargemap(bool force);
@@ -374,6 +379,7 @@ extern bool save_world(const char *mname, bool nolms = false);
 extern uint getmapcrc();
 extern void clearmapcrc();
 extern bool loadents(const char *fname, vector<entity> &ents, uint *crc = NULL);
+extern void preloadents(const char *fname);
 
 // physics
 extern vec collidewall;
@@ -469,6 +475,7 @@ enum { DISC_NONE = 0, DISC_EOP, DISC_LOCAL, DISC_KICK, DISC_MSGERR, DISC_IPBAN,
 
 extern void *getclientinfo(int i);
 extern ENetPeer *getclientpeer(int i);
+extern bool getclientrtt(int n, uint &rtt, uint &variance);
 extern ENetPacket *sendf(int cn, int chan, const char *format, ...);
 extern ENetPacket *sendfile(int cn, int chan, stream *file, const char *format = "", ...);
 extern void sendpacket(int cn, int chan, ENetPacket *packet, int exclude = -1);
@@ -487,6 +494,21 @@ extern bool requestmaster(const char *req);
 extern bool requestmasterf(const char *fmt, ...) PRINTFARGS(1, 2);
 extern bool isdedicatedserver();
 
+enum { SERVERPHASE_SLICE = 0, SERVERPHASE_UPDATE, SERVERPHASE_EVENTS, SERVERPHASE_WORLDSTATE, SERVERPHASE_DEMO, SERVERPHASE_SOCKETS, NUMSERVERPHASES };
+
+extern uint getservermicros();
+extern void addserverphase(int phase, uint micros);
+extern void metricf(vector<char> &buf, const char *fmt, ...) PRINTFARGS(2, 3);
+
+struct serverphasetimer
+{
+    int phase;
+    uint start;
+
+    serverphasetimer(int phase) : phase(phase), start(getservermicros()) {}
+    ~serverphasetimer() { addserverphase(phase, getservermicros() - start); }
+};
+
 // serverbrowser
 
 struct servinfo
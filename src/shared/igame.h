@@ -96,6 +96,7 @@ namespace server
     extern void *newclientinfo();
     extern void deleteclientinfo(void *ci);
     extern void serverinit();
+    extern void preloadmaps();
     extern int reserveclients();
     extern int numchannels();
     extern void clientdisconnect(int n);
@@ -108,6 +109,7 @@ namespace server
     extern void sendservmsg(const char *s);
     extern bool sendpackets(bool force = false);
     extern void serverinforeply(ucharbuf &req, ucharbuf &p);
+    extern void writemetrics(vector<char> &buf);
     extern void serverupdate();
     extern int protocolversion();
     extern int laninfoport();